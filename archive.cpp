@@ -0,0 +1,237 @@
+#include "format.hpp"
+#include <thread>
+
+/**
+ * Indexed binary archive of drawing commands
+ * Layout: header, chunk data, chunk index. Chunks hold consecutive commands, so
+ * replaying the chunks in order keeps the painter's order. Each chunk stores its
+ * opcodes, then its colors, then its fixed point coordinates.
+ */
+const uint32_t archiveChunk = 4096;    // Commands per chunk
+
+struct
+ArchiveHeader {
+  char magic[8];
+  int32_t width, height;    // Canvas the commands were generated for
+  uint64_t count;           // Number of commands
+  int32_t box[4];           // Bounding box of all commands in 1/100 pixel
+  uint32_t chunkSize;       // Commands per chunk
+  uint32_t chunkCount;
+  uint64_t index;           // Offset of the chunk index
+};
+
+struct
+ArchiveChunk {
+  uint64_t offset;          // Offset of the chunk data
+  uint32_t count;           // Number of commands
+  uint32_t coords;          // Number of coordinates
+  int32_t box[4];           // Bounding box of the commands in 1/100 pixel
+};
+
+/**
+ * Gets the area a command may cover, in fixed point
+ * Non-finite coordinates cover everything
+ * @param op Opcode
+ * @param fixed Parameters in 1/100 pixel
+ * @param box Receives x0, y0, x1, y1
+ */
+void
+archive_bounds(
+  uint8_t op,
+  const int32_t *fixed,
+  int64_t box[4]
+) {
+  int num = DrawInfo::paramNum[op], points = (op == DRAW_TRIA) ? 3 : (op == DRAW_CIRC) ? 1 : 2;
+  for (int i = 0; i < num; i++) {
+    if (fixed[i] == DrawInfo::fixedNaN) {
+      box[0] = box[1] = INT32_MIN, box[2] = box[3] = INT32_MAX;
+      return;
+    }
+  }
+  int64_t pad = (op == DRAW_LINE) ? (llabs(fixed[4]) + 1) / 2 : (op == DRAW_CIRC) ? llabs(fixed[2]) : 0;
+  box[0] = box[2] = fixed[0], box[1] = box[3] = fixed[1];
+  for (int i = 1; i < points; i++) {
+    box[0] = min(box[0], (int64_t) fixed[2 * i]), box[2] = max(box[2], (int64_t) fixed[2 * i]);
+    box[1] = min(box[1], (int64_t) fixed[2 * i + 1]), box[3] = max(box[3], (int64_t) fixed[2 * i + 1]);
+  }
+  box[0] -= pad, box[1] -= pad, box[2] += pad, box[3] += pad;
+}
+
+/**
+ * Extends a fixed point box, saturating to the 32-bit range
+ * @param into Box to extend
+ * @param box Box to add
+ */
+void
+archive_merge(
+  int32_t into[4],
+  const int64_t box[4]
+) {
+  into[0] = max((int64_t) INT32_MIN, min((int64_t) into[0], box[0]));
+  into[1] = max((int64_t) INT32_MIN, min((int64_t) into[1], box[1]));
+  into[2] = min((int64_t) INT32_MAX, max((int64_t) into[2], box[2]));
+  into[3] = min((int64_t) INT32_MAX, max((int64_t) into[3], box[3]));
+}
+
+/**
+ * Writes DrawInfo as an indexed binary archive
+ * The file is replaced atomically, so it may be the input being replayed
+ * @param fileName Archive path
+ * @param width Canvas width the commands were generated for
+ * @param height Canvas height the commands were generated for
+ * @return true if the archive was written
+ */
+bool
+archive_write(
+  const string& fileName,
+  int width,
+  int height
+) {
+  FILE *file = fopen((fileName + ".tmp").c_str(), "wb");
+  if (!file) return false;
+
+  ArchiveHeader header;
+  memcpy(header.magic, archiveMagic, sizeof(header.magic));
+  header.width = width, header.height = height;
+  header.count = drawinfo.size();
+  header.box[0] = header.box[1] = INT32_MAX, header.box[2] = header.box[3] = INT32_MIN;
+  header.chunkSize = archiveChunk;
+  header.chunkCount = (drawinfo.size() + archiveChunk - 1) / archiveChunk;
+  fwrite(&header, sizeof(header), 1, file);
+
+  vector<ArchiveChunk> index(header.chunkCount);
+  uint64_t offset = sizeof(header);
+  vector<int32_t> coords;
+  for (uint32_t c = 0; c < header.chunkCount; c++) {
+    size_t first = (size_t) c * archiveChunk, last = min(drawinfo.size(), first + archiveChunk);
+    ArchiveChunk& chunk = index[c];
+    chunk.offset = offset, chunk.count = last - first;
+    chunk.box[0] = chunk.box[1] = INT32_MAX, chunk.box[2] = chunk.box[3] = INT32_MIN;
+    coords.clear();
+    for (size_t i = first; i < last; i++) {
+      const int32_t *fixed = drawinfo.fixed(i);
+      int64_t box[4];
+      archive_bounds(drawinfo.ops[i], fixed, box);
+      archive_merge(chunk.box, box);
+      coords.insert(coords.end(), fixed, fixed + DrawInfo::paramNum[drawinfo.ops[i]]);
+    }
+    chunk.coords = coords.size();
+    uint32_t padding = 0, opBytes = (chunk.count + 3) & ~3u;   // Keeps the colors aligned
+    fwrite(&drawinfo.ops[first], 1, chunk.count, file);
+    fwrite(&padding, 1, opBytes - chunk.count, file);
+    fwrite(&drawinfo.colors[first], 4, chunk.count, file);
+    fwrite(coords.data(), 4, coords.size(), file);
+    offset += opBytes + 4 * (chunk.count + coords.size());
+    int64_t box[4] = { chunk.box[0], chunk.box[1], chunk.box[2], chunk.box[3] };
+    archive_merge(header.box, box);
+  }
+
+  uint64_t padding = 0;
+  fwrite(&padding, 1, (8 - offset % 8) % 8, file);   // Aligns the index
+  header.index = offset + (8 - offset % 8) % 8;
+  fwrite(index.data(), sizeof(ArchiveChunk), index.size(), file);
+  fseek(file, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, file);
+  bool written = !ferror(file);
+  if (fclose(file) != 0) written = false;
+  if (written) written = rename((fileName + ".tmp").c_str(), fileName.c_str()) == 0;
+  else remove((fileName + ".tmp").c_str());
+  return written;
+}
+
+/**
+ * Decodes one chunk, placing its commands on the output image
+ * @param data Archive contents
+ * @param chunk Chunk to decode
+ * @param place Placement of source coordinates
+ * @param into Receives the commands
+ */
+void
+archive_decode(
+  const char *data,
+  const ArchiveChunk& chunk,
+  const DrawPlace& place,
+  DrawInfo& into
+) {
+  const uint8_t *ops = (const uint8_t*) (data + chunk.offset);
+  const uint32_t *colors = (const uint32_t*) (ops + ((chunk.count + 3) & ~3u));
+  const int32_t *coords = (const int32_t*) (colors + chunk.count);
+  bool identity = place.identity();
+  double params[6];
+  const int32_t *end = coords + chunk.coords;
+  for (uint32_t i = 0; i < chunk.count; i++) {
+    uint8_t op = ops[i];
+    if (op >= DRAW_NONE || end - coords < DrawInfo::paramNum[op]) return;
+    int num = DrawInfo::paramNum[op];
+    for (int k = 0; k < num; k++) params[k] = (coords[k] == DrawInfo::fixedNaN) ? NAN : coords[k] / 100.0;
+    if (!identity) place.apply(op, params);
+    into.push(op, params, colors[i]);
+    coords += num;
+  }
+}
+
+/**
+ * Loads the commands of an archive that may touch the output image
+ * Chunks outside the requested region are skipped without being read, and the
+ * remaining chunks are decoded in parallel, then joined in their original order.
+ * Without a region, the archived canvas is fitted into the image.
+ * @param data Archive contents, usually memory mapped
+ * @param size Size of the contents in bytes
+ * @param place Placement of source coordinates, completed from the header
+ * @param width Width of the output image
+ * @param height Height of the output image
+ * @param into Receives the commands
+ * @return false if the contents are not a valid archive
+ */
+bool
+archive_load(
+  const char *data,
+  size_t size,
+  DrawPlace& place,
+  int width,
+  int height,
+  DrawInfo& into
+) {
+  if (size < sizeof(ArchiveHeader) || memcmp(data, archiveMagic, sizeof(archiveMagic))) return false;
+  ArchiveHeader header;
+  memcpy(&header, data, sizeof(header));
+  if (header.index > size || (size - header.index) / sizeof(ArchiveChunk) < header.chunkCount) return false;
+  const ArchiveChunk *index = (const ArchiveChunk*) (data + header.index);
+
+  if (!place.region) {
+    place.left = place.top = 0;
+    place.width = header.width, place.height = header.height;
+  }
+  place.fit(width, height);
+
+  // Source area shown in the image, with a margin for antialiasing
+  double margin = 2 / place.scale;
+  double area[4] = {
+    (place.left - margin) * 100, (place.top - margin) * 100,
+    (place.left + width / place.scale + margin) * 100, (place.top + height / place.scale + margin) * 100
+  };
+  vector<uint32_t> chosen;
+  for (uint32_t c = 0; c < header.chunkCount; c++) {
+    const ArchiveChunk& chunk = index[c];
+    uint64_t bytes = ((chunk.count + 3) & ~3u) + 4 * ((uint64_t) chunk.count + chunk.coords);
+    if (chunk.offset > header.index || bytes > header.index - chunk.offset || chunk.count > header.chunkSize) return false;
+    if (chunk.box[2] < area[0] || chunk.box[0] > area[2] || chunk.box[3] < area[1] || chunk.box[1] > area[3]) continue;
+    chosen.push_back(c);
+  }
+
+  vector<DrawInfo> parts(chosen.size());
+  int threads = max(1u, min(thread::hardware_concurrency(), (unsigned) chosen.size()));
+  vector<thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.push_back(thread([&, t]() {
+      for (size_t i = t; i < chosen.size(); i += threads) archive_decode(data, index[chosen[i]], place, parts[i]);
+    }));
+  }
+  for (thread& worker: workers) worker.join();
+  for (DrawInfo& part: parts) into.append(part);
+
+  if (getenv("PFC_VERBOSE")) {
+    fprintf(stderr, "pfc: \033[36m[Render]\033[0m archive: %u of %u chunks decoded on %d threads\n", (unsigned) chosen.size(), header.chunkCount, threads);
+  }
+  return true;
+}
@@ -0,0 +1,519 @@
+#include "format.hpp"
+#include <map>
+#include <thread>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * Synthetic workload of the benchmark suite
+ */
+struct
+BenchWorkload {
+  string name;
+  string description;
+  int width, height;      // Canvas
+  string flags;           // Extra pfc options of the pipeline runs
+  bool replay;            // Whether to time pfc-draw replaying the archived commands alone
+};
+
+/**
+ * One phase of a single run, as read back from the PFC_STATS file
+ */
+struct
+BenchPhase {
+  string process, phase;
+  double begin;           // Seconds on the monotonic clock
+  double wall;            // Milliseconds
+  map<string, long long> items;
+};
+
+/**
+ * Timings of one phase over the repetitions
+ */
+struct
+BenchResult {
+  string workload;
+  string stage;           // "pipeline" for whole pfc runs, "replay" for pfc-draw alone
+  string process, phase;
+  string unit;            // Unit of the throughput, empty for none
+  double amount = 0;      // Units handled per run
+  vector<double> walls;   // Milliseconds of every repetition
+  double median = 0, p95 = 0;
+};
+
+/**
+ * Generates a huge source for the lexer and parser
+ * Every function is a long arithmetic expression, and main calls a few of them.
+ * @param scale Size factor
+ * @return Program
+ */
+string
+bench_source(
+  double scale
+) {
+  int functions = max(1, (int) (2000 * scale));
+  ostringstream code;
+  for (int f = 0; f < functions; f++) {
+    code << "def f" << f << "(int a, int b) -> int {" << endl;
+    code << "  int c = a * " << f % 7 + 2 << " - b;" << endl;
+    code << "  return c";
+    for (int t = 1; t <= 40; t++) code << ((t % 3) ? " + " : " - ") << "(a * " << t << " + b) / " << t % 5 + 1;
+    code << ";" << endl << "}" << endl << endl;
+  }
+  code << "def main() -> int {" << endl;
+  code << "  int x = 0;" << endl;
+  for (int f = 0; f < functions; f += max(1, functions / 16)) code << "  x = x + f" << f << "(" << f << ", 3);" << endl;
+  code << "  draw rectangle(vec(10, 10), vec(90, 90), #3a7bd5);" << endl;
+  code << "}" << endl;
+  return code.str();
+}
+
+/**
+ * Generates a deep recursion drawing a Sierpinski triangle
+ * @param scale Work factor, each factor of 3 adds a level
+ * @return Program
+ */
+string
+bench_fractal(
+  double scale
+) {
+  int depth = max(1, 10 + (int) lround(log(max(scale, 0.01)) / log(3)));
+  ostringstream code;
+  code << "def mid(int a, int b) -> int {" << endl;
+  code << "  return (a + b) / 2;" << endl;
+  code << "}" << endl << endl;
+  code << "def fractal(int dep, int x1, int y1, int x2, int y2, int x3, int y3) -> void {" << endl;
+  code << "  if (dep > " << depth << ") {" << endl;
+  code << "    return;" << endl;
+  code << "  }" << endl;
+  code << "  draw triangle(vec(x1, y1), vec(x2, y2), vec(x3, y3), #e6c90d);" << endl;
+  code << "  fractal(dep + 1, x1, y1, mid(x1, x2), mid(y1, y2), mid(x3, x1), mid(y3, y1));" << endl;
+  code << "  fractal(dep + 1, x2, y2, mid(x2, x3), mid(y2, y3), mid(x1, x2), mid(y1, y2));" << endl;
+  code << "  fractal(dep + 1, x3, y3, mid(x3, x1), mid(y3, y1), mid(x2, x3), mid(y2, y3));" << endl;
+  code << "}" << endl << endl;
+  code << "def main() -> int {" << endl;
+  code << "  fractal(0, 2000, 0, 0, 4000, 4000, 4000);" << endl;
+  code << "}" << endl;
+  return code.str();
+}
+
+/**
+ * Generates a loop drawing a million small circles across the canvas
+ * @param scale Iteration factor
+ * @return Program
+ */
+string
+bench_loop(
+  double scale
+) {
+  long long iterations = max(1LL, (long long) (1000000 * scale));
+  ostringstream code;
+  code << "def main() -> int {" << endl;
+  code << "  int x = 0, y = 0;" << endl;
+  code << "  for (int i = 0; i < " << iterations << "; i++) {" << endl;
+  code << "    x = x + 37;" << endl;
+  code << "    if (x > 2000) {" << endl;
+  code << "      x = x - 2000;" << endl;
+  code << "      y = y + 11;" << endl;
+  code << "    }" << endl;
+  code << "    if (y > 2000) {" << endl;
+  code << "      y = y - 2000;" << endl;
+  code << "    }" << endl;
+  code << "    draw circle(vec(x, y), 4, #3a7bd5);" << endl;
+  code << "  }" << endl;
+  code << "}" << endl;
+  return code.str();
+}
+
+/**
+ * Generates a few hundred large shapes for a large canvas
+ * @param scale Pixel factor
+ * @return Program
+ */
+string
+bench_canvas(
+  double scale
+) {
+  int size = max(100, (int) (8000 * sqrt(scale))), cell = size / 16;
+  ostringstream code;
+  code << "def main() -> int {" << endl;
+  code << "  for (int i = 0; i < 16; i++) {" << endl;
+  code << "    for (int j = 0; j < 16; j++) {" << endl;
+  code << "      draw rectangle(vec(i * " << cell << ", j * " << cell << "), vec(i * " << cell << " + " << cell - 8 << ", j * " << cell << " + " << cell - 8 << "), #6915f1);" << endl;
+  code << "      draw circle(vec(i * " << cell << " + " << cell / 2 << ", j * " << cell << " + " << cell / 2 << "), " << cell / 3 << ", #c20e0e);" << endl;
+  code << "      draw line(vec(i * " << cell << ", j * " << cell << "), vec(i * " << cell << " + " << cell << ", j * " << cell << " + " << cell << "), 6, #0e5b0a);" << endl;
+  code << "    }" << endl;
+  code << "  }" << endl;
+  code << "}" << endl;
+  return code.str();
+}
+
+/**
+ * Generates a pfor whose body declares local arrays of the largest size and draws them in batches
+ * @param scale Iteration factor
+ * @return Program
+ */
+string
+bench_arrays(
+  double scale
+) {
+  int rows = max(1, (int) (64 * scale));
+  ostringstream code;
+  code << "def main() -> int {" << endl;
+  code << "  pfor (int row = 0; row < " << rows << "; row++) {" << endl;
+  code << "    float xs[262144], ys[262144], rs[262144];" << endl;
+  code << "    for (int i = 0; i < len(xs); i++) {" << endl;
+  code << "      xs[i] = i / 2.5 + row * 3;" << endl;
+  code << "      ys[i] = row * 9 + 4;" << endl;
+  code << "      rs[i] = 3 + xs[i] / 100;" << endl;
+  code << "    }" << endl;
+  code << "    draw circles(1000, xs, ys, rs, #2a9d8f);" << endl;
+  code << "  }" << endl;
+  code << "}" << endl;
+  return code.str();
+}
+
+/**
+ * Generates constant expressions that fold, some to floats beyond the int range assigned to ints
+ * @param scale Term factor
+ * @return Program
+ */
+string
+bench_fold(
+  double scale
+) {
+  int terms = max(8, (int) (40 * scale));
+  ostringstream code;
+  code << "def half(int v) -> int {" << endl;
+  code << "  return v / 2;" << endl;
+  code << "}" << endl << endl;
+  code << "def wide(int k) -> int {" << endl;
+  code << "  return (k + 6) ^ 4 ^ 2 - 7;" << endl;
+  code << "}" << endl << endl;
+  code << "def main() -> int {" << endl;
+  code << "  int u = 0;" << endl;
+  for (int t = 0; t < terms; t++) {
+    int a = t % 9 + 2, b = t % 4 + 1, y = 10 + t * 580 / terms;
+    // Powers of powers leave the int range, the other terms stay inside it
+    if (t % 4 == 0) code << "  int t" << t << " = (" << a << " + 6) ^ " << b + 3 << " ^ 2 - " << t << ";" << endl;
+    else if (t % 4 == 1) code << "  int t" << t << " = -(" << a << " ^ 4 ^ 3) + " << a * b << " * " << t << ";" << endl;
+    else if (t % 4 == 2) code << "  int t" << t << " = half(" << a << " ^ 3 ^ " << b << ") + " << a << " / " << b << ";" << endl;
+    else code << "  int t" << t << " = wide(" << t << ") / " << b << " + " << a << " ^ " << b << ";" << endl;
+    code << "  draw line(vec(300, " << y << "), vec(300 + t" << t << " / 10000000, " << y << "), 3, #8f2d56);" << endl;
+    code << "  u = t" << t << " = " << a << " ^ 20 + " << b << ";" << endl;
+    code << "  draw line(vec(300 + u / 10000000, " << y + 4 << "), vec(300 + t" << t << " / 10000000, " << y + 7 << "), 2, #2d568f);" << endl;
+  }
+  code << "}" << endl;
+  return code.str();
+}
+
+/**
+ * Generates the source of a workload
+ * @param name Workload name
+ * @param scale Size factor
+ * @return Program
+ */
+string
+bench_generate(
+  const string& name,
+  double scale
+) {
+  if (name == "source") return bench_source(scale);
+  if (name == "fractal") return bench_fractal(scale);
+  if (name == "loop") return bench_loop(scale);
+  if (name == "arrays") return bench_arrays(scale);
+  if (name == "fold") return bench_fold(scale);
+  return bench_canvas(scale);
+}
+
+/**
+ * Runs a command once, collecting the phases its processes append to PFC_STATS
+ * @param command Shell command
+ * @param statsName Phase file
+ * @return Phases in the order they started
+ */
+vector<BenchPhase>
+bench_run(
+  const string& command,
+  const string& statsName
+) {
+  FILE *empty = fopen(statsName.c_str(), "w");
+  if (!empty) {
+    cerr << "pfc-bench: cannot write " << statsName << endl;
+    return {};
+  }
+  fclose(empty);
+  if (system((command + " > /dev/null 2>&1").c_str()) != 0) cerr << "pfc-bench: failed: " << command << endl;
+  vector<BenchPhase> phases;
+  fstream file(statsName, ios::in);
+  string line;
+  while (getline(file, line)) {
+    // process, phase, begin, wall, cpu, rss and item=count pairs, as written by stats_flush
+    istringstream fields(line);
+    string process, phase, counts, item;
+    double begin, wall, cpu;
+    long long rss;
+    getline(fields, process, '\t');
+    getline(fields, phase, '\t');
+    fields >> begin >> wall >> cpu >> rss;
+    if (!fields) continue;
+    fields.get();
+    getline(fields, counts);
+    phases.push_back((BenchPhase) { process, phase, begin, wall * 1000 });
+    istringstream items(counts);
+    while (items >> item) {
+      size_t equal = item.find('=');
+      if (equal != string::npos) phases.back().items[item.substr(0, equal)] += atoll(item.c_str() + equal + 1);
+    }
+  }
+  file.close();
+  remove(statsName.c_str());
+  stable_sort(phases.begin(), phases.end(), [](const BenchPhase& a, const BenchPhase& b) { return a.begin < b.begin; });
+  return phases;
+}
+
+/**
+ * Gets the work done in a phase, the base of its throughput
+ * @param workload Workload of the run
+ * @param phase Phase name
+ * @param items Item counts of the phase
+ * @param tokens Tokens lexed in the run
+ * @param unit Receives the throughput unit
+ * @return Units handled, 0 if the phase has no throughput
+ */
+double
+bench_amount(
+  const BenchWorkload& workload,
+  const string& phase,
+  map<string, long long>& items,
+  long long tokens,
+  string& unit
+) {
+  if (phase == "lex" || phase == "parse/codegen") {
+    unit = "tokens/s";
+    return tokens;
+  }
+  if (phase == "execute" || phase == "input") {
+    unit = "draws/s";
+    return items["line"] + items["circ"] + items["tria"] + items["rect"] + items["culled"];
+  }
+  if (phase == "rasterize" || phase == "encode") {
+    unit = "megapixels/s";
+    return (double) workload.width * workload.height / 1e6;
+  }
+  unit = "";
+  return 0;
+}
+
+/**
+ * Gets a percentile of samples by the nearest rank
+ * @param samples Samples, sorted
+ * @param percent Percentile
+ * @return Sample at the percentile
+ */
+double
+percentile(
+  const vector<double>& samples,
+  double percent
+) {
+  size_t rank = (size_t) ceil(percent / 100 * samples.size());
+  return samples[min(samples.size() - 1, rank ? rank - 1 : 0)];
+}
+
+/**
+ * Gets a string or number member of a one line JSON object
+ * @param line JSON text
+ * @param key Member name
+ * @return Member value as text, empty if missing
+ */
+string
+json_member(
+  const string& line,
+  const string& key
+) {
+  size_t at = line.find("\"" + key + "\": ");
+  if (at == string::npos) return "";
+  at += key.size() + 4;
+  if (line[at] == '"') return line.substr(at + 1, line.find('"', at + 1) - at - 1);
+  return line.substr(at, line.find_first_of(",}", at) - at);
+}
+
+/**
+ * Performance benchmark of the whole pipeline on synthetic workloads
+ * Every workload runs through pfc, and pfc-draw replays its archived commands
+ * alone, each phase timed from the phase profile over several repetitions.
+ * Usage: pfc-bench [-n reps] [-s scale] [-o results.json] [-c baseline.json] [-g dir] [workload...]
+ */
+int
+main(
+  int argc,
+  char* argv[]
+) {
+  vector<BenchWorkload> workloads = {
+    { "source", "many functions with long expressions, for the lexer and parser", 256, 256, "-j", false },
+    { "fractal", "deep recursion drawing a Sierpinski triangle", 4000, 4000, "", true },
+    { "loop", "a million iterations drawing small circles", 2000, 2000, "", true },
+    { "canvas", "large shapes on a large canvas", 8000, 8000, "", true },
+    { "arrays", "local arrays of the largest size in a pfor body", 600, 600, "", true },
+    { "fold", "constant expressions, some beyond the int range assigned to ints", 600, 600, "", true },
+  };
+  int reps = 5;
+  double scale = 1;
+  string resultName, baseName, sourceDir;
+  vector<string> chosen;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "-n" && i + 1 < argc) reps = max(1, atoi(argv[++i]));
+    else if (arg == "-s" && i + 1 < argc) scale = max(0.01, atof(argv[++i]));
+    else if (arg == "-o" && i + 1 < argc) resultName = argv[++i];
+    else if (arg == "-c" && i + 1 < argc) baseName = argv[++i];
+    else if (arg == "-g" && i + 1 < argc) sourceDir = argv[++i];
+    else chosen.push_back(arg);
+  }
+  for (BenchWorkload& workload: workloads) {
+    if (workload.name == "canvas") {
+      workload.width = workload.height = max(100, (int) (8000 * sqrt(scale)));
+    }
+  }
+  if (!chosen.empty()) {
+    vector<BenchWorkload> picked;
+    for (BenchWorkload& workload: workloads) {
+      if (find(chosen.begin(), chosen.end(), workload.name) != chosen.end()) picked.push_back(workload);
+    }
+    workloads = picked;
+  }
+
+  if (!sourceDir.empty()) {
+    // Only writes the generated programs
+    mkdir(sourceDir.c_str(), 0755);
+    for (BenchWorkload& workload: workloads) {
+      fstream source(sourceDir + "/" + workload.name + ".pf", ios::out | ios::trunc);
+      source << bench_generate(workload.name, scale);
+      cout << sourceDir << "/" << workload.name << ".pf: " << workload.description << " (" << workload.width << "x" << workload.height << ")" << endl;
+    }
+    return 0;
+  }
+
+  time_t now = time(NULL);
+  char stamp[32];
+  strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+  if (resultName.empty()) resultName = string("pfc-bench-") + stamp + ".json";
+
+  string workDir = "/tmp/pfc_bench_" + to_string(getpid());
+  mkdir(workDir.c_str(), 0755);
+  string statsName = workDir + "/stats";
+  // pfc, the proxy and pfc-draw all append their phases to this file
+  setenv("PFC_STATS", statsName.c_str(), 1);
+
+  vector<BenchResult> results;
+  for (BenchWorkload& workload: workloads) {
+    string base = workDir + "/" + workload.name;
+    fstream source(base + ".pf", ios::out | ios::trunc);
+    source << bench_generate(workload.name, scale);
+    source.close();
+    string size = " -s " + to_string(workload.width) + " " + to_string(workload.height) + " ";
+    vector<pair<string, string>> stages = { make_pair("pipeline", "pfc " + workload.flags + size + "-o " + base + ".png " + base + ".pf") };
+    if (workload.replay) {
+      // Archives the commands once, so the replay runs only pfc-draw
+      system(("pfc -D" + size + "-o " + base + " " + base + ".pf > /dev/null 2>&1").c_str());
+      stages.push_back(make_pair("replay", "pfc-draw " + to_string(workload.width) + " " + to_string(workload.height) + " " + base + ".png none < " + base + ".draw"));
+    }
+    cerr << "pfc-bench: " << workload.name << ": " << workload.description << endl;
+
+    for (auto& stage: stages) {
+      map<pair<string, string>, BenchResult> phases;
+      vector<pair<string, string>> order;
+      bench_run(stage.second, statsName);   // Warms up the page cache and the compiler
+      for (int rep = 0; rep < reps; rep++) {
+        vector<BenchPhase> run = bench_run(stage.second, statsName);
+        long long tokens = 0;
+        for (BenchPhase& measured: run) if (measured.phase == "lex") tokens = measured.items["tokens"];
+        for (BenchPhase& measured: run) {
+          pair<string, string> key = make_pair(measured.process, measured.phase);
+          BenchResult& result = phases[key];
+          if (result.walls.empty()) {
+            result.workload = workload.name, result.stage = stage.first;
+            result.process = measured.process, result.phase = measured.phase;
+            result.amount = bench_amount(workload, result.phase, measured.items, tokens, result.unit);
+            order.push_back(key);
+          }
+          result.walls.push_back(measured.wall);
+        }
+      }
+      for (auto& key: order) {
+        BenchResult& result = phases[key];
+        vector<double> sorted = result.walls;
+        sort(sorted.begin(), sorted.end());
+        result.median = percentile(sorted, 50), result.p95 = percentile(sorted, 95);
+        results.push_back(result);
+      }
+    }
+  }
+  system(("rm -rf " + workDir).c_str());
+
+  map<string, pair<double, double>> baseline;   // Median ms and median throughput of each phase
+  if (!baseName.empty()) {
+    fstream base(baseName, ios::in);
+    if (!base.is_open()) cerr << "pfc-bench: cannot read " << baseName << endl;
+    string line;
+    while (getline(base, line)) {
+      if (json_member(line, "workload").empty()) continue;
+      string key = json_member(line, "workload") + " " + json_member(line, "stage") + " " + json_member(line, "process") + " " + json_member(line, "phase");
+      baseline[key] = make_pair(atof(json_member(line, "median_ms").c_str()), atof(json_member(line, "median").c_str()));
+    }
+  }
+
+  cout
+  << left << setw(10) << "Workload" << setw(10) << "Stage" << setw(10) << "Process" << setw(15) << "Phase"
+  << right << setw(12) << "Median ms" << setw(12) << "p95 ms" << setw(16) << "Median" << setw(16) << "p95" << "  " << left << setw(14) << "Unit";
+  if (!baseline.empty()) cout << right << setw(10) << "vs base";
+  cout << endl;
+  for (BenchResult& result: results) {
+    cout
+    << left << setw(10) << result.workload << setw(10) << result.stage << setw(10) << result.process << setw(15) << result.phase
+    << right << fixed << setprecision(2) << setw(12) << result.median << setw(12) << result.p95;
+    // The slowest repetitions give the p95 throughput
+    if (!result.unit.empty() && result.median > 0 && result.p95 > 0) {
+      cout << setw(16) << result.amount / result.median * 1000 << setw(16) << result.amount / result.p95 * 1000 << "  " << left << setw(14) << result.unit;
+    } else cout << setw(16) << "" << setw(16) << "" << "  " << left << setw(14) << "";
+    string key = result.workload + " " + result.stage + " " + result.process + " " + result.phase;
+    if (baseline.count(key) && result.median > 0) {
+      // Speedup over the baseline, above 1 when faster. Throughputs stay comparable
+      // across scales, so they are preferred over times.
+      pair<double, double> base = baseline[key];
+      double speedup = (base.second > 0 && !result.unit.empty()) ? result.amount / result.median * 1000 / base.second : base.first / result.median;
+      if (speedup > 0) cout << right << setw(9) << setprecision(2) << speedup << "x";
+    }
+    cout << endl;
+  }
+
+  fstream json(resultName, ios::out | ios::trunc);
+  if (!json.is_open()) {
+    cerr << "pfc-bench: cannot write " << resultName << endl;
+    return 1;
+  }
+  char host[256] = "";
+  gethostname(host, sizeof(host) - 1);
+  json << "{" << endl;
+  json << "  \"date\": \"" << stamp << "\", \"host\": \"" << host << "\", \"threads\": " << thread::hardware_concurrency()
+    << ", \"reps\": " << reps << ", \"scale\": " << scale << "," << endl;
+  json << "  \"results\": [";
+  for (size_t i = 0; i < results.size(); i++) {
+    BenchResult& result = results[i];
+    // One result per line, so later runs can compare against this file
+    json << (i ? "," : "") << endl << fixed << setprecision(3)
+      << "    { \"workload\": \"" << result.workload << "\", \"stage\": \"" << result.stage << "\", \"process\": \"" << result.process
+      << "\", \"phase\": \"" << result.phase << "\", \"median_ms\": " << result.median << ", \"p95_ms\": " << result.p95;
+    if (!result.unit.empty() && result.median > 0 && result.p95 > 0) {
+      json << ", \"unit\": \"" << result.unit << "\", \"amount\": " << result.amount
+        << ", \"median\": " << result.amount / result.median * 1000 << ", \"p95\": " << result.amount / result.p95 * 1000;
+    }
+    json << ", \"wall_ms\": [";
+    for (size_t k = 0; k < result.walls.size(); k++) json << (k ? ", " : "") << result.walls[k];
+    json << "] }";
+  }
+  json << endl << "  ]" << endl << "}" << endl;
+  json.close();
+  cout << "Results written to " << resultName << endl;
+  return 0;
+}
@@ -0,0 +1,253 @@
+#include "format.hpp"
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+/**
+ * Creates a directory only the caller may use, or checks an existing one
+ * @param dir Directory path
+ * @return true if the directory is owned by the caller and closed to everyone else
+ */
+bool
+private_dir(
+  const string& dir
+) {
+  mkdir(dir.c_str(), 0700);
+  struct stat info;
+  if (lstat(dir.c_str(), &info) != 0 || !S_ISDIR(info.st_mode)) return false;
+  return info.st_uid == geteuid() && !(info.st_mode & 077);
+}
+
+/**
+ * Gets the per-user directory for cached images and shared objects
+ * $XDG_CACHE_HOME/pfc/ when set, /tmp/pfc-<uid>/ otherwise
+ * @return Directory path ending in '/', empty if it is not private to the caller
+ */
+string
+user_dir() {
+  string dir = getenv("XDG_CACHE_HOME") ? string(getenv("XDG_CACHE_HOME")) + "/pfc/" : "/tmp/pfc-" + to_string(geteuid()) + "/";
+  return private_dir(dir) ? dir : "";
+}
+
+/**
+ * Content-addressed output cache
+ * Maps a hash of the normalized token stream and render parameters to a finished PNG
+ */
+struct
+CacheInfo {
+  string dir;                           // Directory holding cached images, empty if unusable
+  long long limit = 256LL << 20;        // Total size limit of cached images in bytes
+  long long hits, misses, evictions;    // Persistent hit-rate statistics
+
+  /**
+   * Reads cache location, size limit and statistics
+   * PFC_CACHE_DIR and PFC_CACHE_SIZE (in MiB) override the defaults.
+   * Cached images are linked into output paths, so the directory must belong to the caller alone.
+   */
+  CacheInfo() {
+    hits = misses = evictions = 0;
+    if (getenv("PFC_CACHE_DIR")) {
+      dir = string(getenv("PFC_CACHE_DIR"));
+      if (dir.back() != '/') dir += "/";
+    } else if (!user_dir().empty()) dir = user_dir() + "cache/";
+    if (getenv("PFC_CACHE_SIZE")) limit = atoll(getenv("PFC_CACHE_SIZE")) << 20;
+    if (!dir.empty() && !private_dir(dir)) {
+      static bool noted = false;
+      if (!noted) cout << "pfc: \033[35m[Cache Note]\033[0m " << dir << " is not private to you, the cache is not used." << endl;
+      noted = true, dir = "";
+    }
+    if (dir.empty()) return;
+    fstream stats(dir + "stats", ios::in);
+    if (stats.is_open()) stats >> hits >> misses >> evictions;
+  }
+
+  /**
+   * Writes statistics back to the cache directory
+   */
+  void
+  save() {
+    if (dir.empty()) return;
+    fstream stats(dir + "stats", ios::out | ios::trunc);
+    if (stats.is_open()) stats << hits << " " << misses << " " << evictions << endl;
+  }
+
+  /**
+   * Gets the path of a cached image
+   * @param key Cache key
+   * @return Path of the cached PNG
+   */
+  string
+  path(
+    const string& key
+  ) {
+    return dir + key + ".png";
+  }
+};
+
+/**
+ * Computes the cache key of the current program
+ * Only token types and contents are hashed, so whitespace and comments do not matter
+ * @param antialias Whether antialiasing is enabled
+ * @param width Image width in pixels
+ * @param height Image height in pixels
+ * @param level zlib level of the PNG, -1 for the default
+ * @return Hexadecimal cache key
+ */
+string
+cache_key(
+  bool antialias,
+  int width,
+  int height,
+  int level
+) {
+  uint64_t hash = hash_feed(HASH_SEED, "pfc-cache-1");
+  for (LexiItem& item: lexiinfo) {
+    hash = hash_feed(hash, to_string(item.lexiID));
+    hash = hash_feed(hash, item.content);
+  }
+  hash = hash_feed(hash, to_string(width) + "x" + to_string(height) + (antialias ? "a" : "n") + "z" + to_string(level));
+  return hash_string(hash);
+}
+
+/**
+ * Copies a file byte by byte
+ * @param from Source path
+ * @param to Destination path
+ * @return true if the copy succeeded
+ */
+bool
+copy_file(
+  const string& from,
+  const string& to
+) {
+  fstream src(from, ios::in | ios::binary);
+  fstream dst(to, ios::out | ios::trunc | ios::binary);
+  if (!src.is_open() || !dst.is_open()) return false;
+  dst << src.rdbuf();
+  return !dst.fail();
+}
+
+/**
+ * Gets the identity of the image at the output path, to tell a fresh render from an older file
+ * @param ouName Output filename without extension
+ * @return Inode, size and modification time, empty if there is no image
+ */
+string
+cache_stamp(
+  const string& ouName
+) {
+  struct stat info;
+  if (stat((ouName + ".png").c_str(), &info) != 0) return "";
+  return to_string(info.st_ino) + " " + to_string(info.st_size) + " " + to_string(info.st_mtim.tv_sec) + "." + to_string(info.st_mtim.tv_nsec);
+}
+
+/**
+ * Looks up a cached image and places it at the output path
+ * The image is hard-linked when possible and copied otherwise, then renamed over the output,
+ * so the existing output stays untouched on a miss or a failure.
+ * Entries that are not regular files owned by the caller are never used.
+ * @param key Cache key
+ * @param ouName Output filename without extension
+ * @return true on a cache hit
+ */
+bool
+cache_fetch(
+  const string& key,
+  const string& ouName
+) {
+  CacheInfo cache;
+  if (cache.dir.empty()) return false;
+  string cached = cache.path(key), output = ouName + ".png";
+  struct stat info;
+  if (lstat(cached.c_str(), &info) == 0 && S_ISREG(info.st_mode) && info.st_uid == geteuid()) {
+    utime(cached.c_str(), NULL);    // Refresh the entry for LRU ordering
+    string placed = output + ".pfc-" + to_string(getpid());
+    unlink(placed.c_str());
+    if ((link(cached.c_str(), placed.c_str()) == 0 || copy_file(cached, placed)) && rename(placed.c_str(), output.c_str()) == 0) {
+      cache.hits++;
+      cache.save();
+      return true;
+    }
+    unlink(placed.c_str());
+  }
+  cache.misses++;
+  cache.save();
+  return false;
+}
+
+/**
+ * Stores a rendered image and evicts least recently used entries over the size limit
+ * An output with the same identity as before the run was not rendered by it and is never stored.
+ * @param key Cache key
+ * @param ouName Output filename without extension
+ * @param stamp Identity of the output before the run, from cache_stamp
+ */
+void
+cache_store(
+  const string& key,
+  const string& ouName,
+  const string& stamp
+) {
+  CacheInfo cache;
+  if (cache.dir.empty()) return;
+  string cached = cache.path(key), output = ouName + ".png";
+  struct stat info;
+  if (stat(output.c_str(), &info) != 0 || cache_stamp(ouName) == stamp) return;
+  unlink(cached.c_str());
+  if (link(output.c_str(), cached.c_str()) != 0 && !copy_file(output, cached)) return;
+
+  vector<pair<time_t, string>> entries;
+  long long total = 0;
+  DIR *dir = opendir(cache.dir.c_str());
+  if (!dir) return;
+  for (dirent *entry; (entry = readdir(dir)) != NULL;) {
+    string name = entry->d_name;
+    if (name.length() < 4 || name.substr(name.length() - 4) != ".png") continue;
+    if (stat((cache.dir + name).c_str(), &info) != 0) continue;
+    entries.push_back(make_pair(info.st_mtime, name));
+    total += info.st_size;
+  }
+  closedir(dir);
+
+  sort(entries.begin(), entries.end());
+  for (auto& entry: entries) {
+    if (total <= cache.limit) break;
+    if (cache.dir + entry.second == cached) continue;
+    if (stat((cache.dir + entry.second).c_str(), &info) != 0) continue;
+    unlink((cache.dir + entry.second).c_str());
+    total -= info.st_size;
+    cache.evictions++;
+  }
+  cache.save();
+}
+
+/**
+ * Prints output cache usage and hit-rate statistics
+ */
+void
+cache_report() {
+  CacheInfo cache;
+  int entries = 0;
+  long long total = 0;
+  DIR *dir = cache.dir.empty() ? NULL : opendir(cache.dir.c_str());
+  if (dir) {
+    struct stat info;
+    for (dirent *entry; (entry = readdir(dir)) != NULL;) {
+      string name = entry->d_name;
+      if (name.length() < 4 || name.substr(name.length() - 4) != ".png") continue;
+      if (stat((cache.dir + name).c_str(), &info) != 0) continue;
+      entries++, total += info.st_size;
+    }
+    closedir(dir);
+  }
+  long long lookups = cache.hits + cache.misses;
+  cout
+  << left << setw(15) << "Directory" << (cache.dir.empty() ? "none" : cache.dir) << endl
+  << left << setw(15) << "Entries" << entries << endl
+  << left << setw(15) << "Size" << fixed << setprecision(2) << total / 1048576.0 << " / " << cache.limit / 1048576.0 << " MiB" << endl
+  << left << setw(15) << "Hits" << cache.hits << endl
+  << left << setw(15) << "Misses" << cache.misses << endl
+  << left << setw(15) << "Evictions" << cache.evictions << endl
+  << left << setw(15) << "Hit rate" << (lookups ? 100.0 * cache.hits / lookups : 0.0) << "%" << endl;
+}
@@ -1,4 +1,11 @@
 #include "format.hpp"
+#include <atomic>
+#include <thread>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <cairo/cairo.h>
 
 /**
@@ -7,88 +14,87 @@
 DrawInfo drawinfo;
 
 /**
- * Reads line parameters from input stream
- * @param code The input file stream to read from
- * @param item The DrawItem to store the line parameters
- * Format: x1 y1 x2 y2 width color
+ * Placement of the commands on the output image, set with -r
  */
-void 
-input_line(
-  istream& code,
-  DrawItem *item
-) {
-  // Start point (params[0], params[1]) 
-  // End point (params[2], params[3])
-  for (int i = 0; i < 4; i++) {
-    code >> item->params[i];
-  }
-  // Width (params[6])
-  code >> item->params[6];
-  // Color 
-  code >> item->colorParams;
-  item->colorParams = item->colorParams.substr(1);
-}
+DrawPlace drawplace;
 
 /**
- * Reads circle parameters from input stream
- * @param code The input file stream to read from
- * @param item The DrawItem to store the circle parameters
- * Format: centerX centerY radius color
+ * Commands drawn and nanoseconds spent rasterizing per kind of command, measured with -H
  */
-void 
-input_circ(
-  istream& code,
-  DrawItem *item
-) {
-  // Center point (params[0], params[1]) 
-  for (int i = 0; i < 2; i++) {
-    code >> item->params[i];
-  }
-  // Radius (params[6])
-  code >> item->params[6];
-  // Color 
-  code >> item->colorParams;
-  item->colorParams = item->colorParams.substr(1);
-}
+bool heatmap;
+atomic<long long> rastercount[4], rastertime[4];
 
 /**
- * Reads triangle parameters from input stream
- * @param code The input file stream to read from
- * @param item The DrawItem to store the triangle parameters
- * Format: x1 y1 x2 y2 x3 y3 color
+ * Stores a batched drawing command as the commands it stands for
+ * The primitives of a batch are consecutive and share a color, so the fills of
+ * circles go through fill batching together.
+ * @param name Batch name ("circs", "poly")
+ * @param params Payload: x y radius per circle, or a width followed by x y per point
+ * @param num Number of values in the payload
+ * @param color Packed color
+ * @return false if the name is not a batch
  */
-void 
-input_tria(
-  istream& code,
-  DrawItem *item
+bool
+push_batch(
+  const string& name,
+  const double *params,
+  int num,
+  uint32_t color
 ) {
-  // Points (params[0-5])
-  for (int i = 0; i < 6; i++) {
-    code >> item->params[i];
-  }
-  // Color 
-  code >> item->colorParams;
-  item->colorParams = item->colorParams.substr(1);
+  double item[6];
+  if (name == "circs") {
+    for (int i = 0; i + 3 <= num; i += 3) {
+      memcpy(item, params + i, 3 * sizeof(double));
+      if (!drawplace.identity()) drawplace.apply(DRAW_CIRC, item);
+      drawinfo.push(DRAW_CIRC, item, color);
+    }
+  } else if (name == "poly") {
+    // Each pair of neighbouring points is one line, as a loop of draw line would give
+    for (int i = 1; i + 4 <= num; i += 2) {
+      memcpy(item, params + i, 4 * sizeof(double));
+      item[4] = params[0];
+      if (!drawplace.identity()) drawplace.apply(DRAW_LINE, item);
+      drawinfo.push(DRAW_LINE, item, color);
+    }
+  } else return false;
+  return true;
 }
 
 /**
- * Reads rectangle parameters from input stream
- * @param code The input file stream to read from
- * @param item The DrawItem to store the rectangle parameters
- * Format: x1 y1 x2 y2 color
+ * Reads the parameters of one drawing command from an input stream
+ * @param code The input stream to read from
+ * @param opt Shape name preceding the parameters
+ * Format: line x1 y1 x2 y2 width color
+ *         circ centerX centerY radius color
+ *         tria x1 y1 x2 y2 x3 y3 color
+ *         rect x1 y1 x2 y2 color
+ *         circs num x y radius ... color
+ *         poly num width x1 y1 x2 y2 ... color
+ * Batches give the number of payload values first.
  */
-void 
-input_rect(
+void
+input_item(
   istream& code,
-  DrawItem *item
+  const string& opt
 ) {
-  // Points (params[0-3])
-  for (int i = 0; i < 4; i++) {
-    code >> item->params[i];
+  uint8_t op = DrawInfo::op(opt);
+  if (opt == "circs" || opt == "poly") {
+    int num = 0;
+    code >> num;
+    vector<double> payload(max(num, 0));
+    for (double& value: payload) code >> value;
+    string color;
+    code >> color;
+    if (code) push_batch(opt, payload.data(), payload.size(), DrawInfo::color(color));
+    return;
   }
-  // Color 
-  code >> item->colorParams;
-  item->colorParams = item->colorParams.substr(1);
+  if (op == DRAW_NONE) return;
+  double params[6];
+  string color;
+  for (int i = 0; i < DrawInfo::paramNum[op]; i++) code >> params[i];
+  code >> color;
+  if (!drawplace.identity()) drawplace.apply(op, params);
+  if (code) drawinfo.push(op, params, DrawInfo::color(color));
 }
 
 /**
@@ -105,122 +111,1342 @@ input(
     cout << "Could not open file!" << endl;
   } else {
     string opt;
-    while (code >> opt) {
-      drawinfo.push_back((DrawItem) { opt });
-      if (opt == "line") input_line(code, &drawinfo.back());
-      if (opt == "circ") input_circ(code, &drawinfo.back());
-      if (opt == "tria") input_tria(code, &drawinfo.back());
-      if (opt == "rect") input_rect(code, &drawinfo.back());
-    }
+    while (code >> opt) input_item(code, opt);
     code.close();
   }
 }
 
+/**
+ * Replays an indexed binary archive from standard input
+ * A regular file is memory mapped, so chunks outside the image are never read
+ * @param width Width of the output image
+ * @param height Height of the output image
+ * @return false if standard input does not hold an archive
+ */
+bool
+input_archive(
+  int width,
+  int height
+) {
+  struct stat info;
+  if (fstat(0, &info) == 0 && S_ISREG(info.st_mode)) {
+    if (info.st_size == 0) return false;
+    void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, 0, 0);
+    if (data == MAP_FAILED) return false;
+    bool loaded = archive_load((const char*) data, info.st_size, drawplace, width, height, drawinfo);
+    munmap(data, info.st_size);
+    return loaded;
+  }
+  if (cin.peek() != archiveMagic[0]) return false;
+  string data((istreambuf_iterator<char>(cin)), istreambuf_iterator<char>());
+  return archive_load(data.data(), data.size(), drawplace, width, height, drawinfo);
+}
+
+/**
+ * Adds the number of commands of each shape in DrawInfo to a phase
+ * @param phase Phase name
+ */
+void
+stats_commands(
+  const string& phase
+) {
+  if (!stats_enabled()) return;
+  long long counts[4] = { 0, 0, 0, 0 };
+  for (uint8_t op: drawinfo.ops) counts[op]++;
+  for (int op = 0; op < 4; op++) stats_count(phase, DrawInfo::names[op], counts[op]);
+}
+
+/**
+ * Writes drawing commands in DrawInfo to a file
+ * Uses the same text format as the proxy output, so the file can be replayed
+ * @param fileName Name of the file to write commands to
+ */
+void
+output(
+  string fileName
+) {
+  FILE *code = fopen(fileName.c_str(), "w");
+  if (!code) {
+    cout << "Could not open file!" << endl;
+    return;
+  }
+  double params[6];
+  for (size_t i = 0; i < drawinfo.size(); i++) {
+    uint8_t op = drawinfo.ops[i];
+    drawinfo.params(i, params);
+    fprintf(code, "%s", DrawInfo::names[op]);
+    for (int k = 0; k < DrawInfo::paramNum[op]; k++) fprintf(code, " %.2lf", params[k]);
+    fprintf(code, " $%06x\n", drawinfo.colors[i]);
+  }
+  fclose(code);
+}
+
+/**
+ * Receives one drawing command from a proxy loaded as a shared object
+ * Parameters are laid out as in the text format
+ * @param user Unused user pointer
+ * @param name Shape name ("line", "circ", "tria", "rect") or batch name ("circs", "poly")
+ * @param params Shape parameters
+ * @param num Number of parameters
+ * @param color Color in "$rrggbb" format
+ */
+void
+sink_item(
+  void *user,
+  const char *name,
+  const double *params,
+  int num,
+  const char *color
+) {
+  if (push_batch(name, params, num, DrawInfo::color(color))) return;
+  uint8_t op = DrawInfo::op(name);
+  if (op == DRAW_NONE || num != DrawInfo::paramNum[op]) return;
+  double placed[6];
+  memcpy(placed, params, num * sizeof(double));
+  if (!drawplace.identity()) drawplace.apply(op, placed);
+  drawinfo.push(op, placed, DrawInfo::color(color));
+}
+
+/**
+ * Loads a proxy shared object and runs it, collecting its drawing commands
+ * @param fileName Path of the proxy shared object
+ * @return true if the proxy was loaded and executed
+ */
+bool
+load_proxy(
+  string fileName
+) {
+  void *handle = dlopen(fileName.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!handle) {
+    cout << "Could not load proxy: " << dlerror() << endl;
+    return false;
+  }
+  ProxyEntry entry = (ProxyEntry) dlsym(handle, "proxy_entry");
+  if (!entry) {
+    cout << "Could not find proxy entry: " << dlerror() << endl;
+    return false;
+  }
+  entry(sink_item, NULL);
+  return true;
+}
+
+/**
+ * Sets the source color of a command
+ * @param cr Cairo context to draw on
+ * @param color Packed 0xRRGGBB color
+ */
+void
+set_color(
+  cairo_t *cr,
+  uint32_t color
+) {
+  int r = (color >> 16) & 0xff, g = (color >> 8) & 0xff, b = color & 0xff;
+  cairo_set_source_rgb(cr, r / 255.0, g / 255.0, b / 255.0);
+}
+
 /**
  * Draws a line on the cairo surface
  * @param cr Cairo context to draw on
- * @param item DrawItem containing line parameters
+ * @param index Index of the line command in DrawInfo
  */
 void 
 draw_line(
   cairo_t *cr,
-  DrawItem *item
+  size_t index
 ) {
-  cairo_set_line_width(cr, item->params[6]);
+  double p[5];
+  drawinfo.params(index, p);
+  cairo_set_line_width(cr, p[4]);
+  set_color(cr, drawinfo.colors[index]);
     
-  int r, g, b;
-  sscanf(item->colorParams.c_str(), "%02x%02x%02x", &r, &g, &b);
-  cairo_set_source_rgb(cr, r / 255.0, g / 255.0, b / 255.0);
-    
-  cairo_move_to(cr, item->params[0], item->params[1]);
-  cairo_line_to(cr, item->params[2], item->params[3]);
+  cairo_move_to(cr, p[0], p[1]);
+  cairo_line_to(cr, p[2], p[3]);
   cairo_stroke(cr);
 }
 
 /**
- * Draws a circle on the cairo surface
+ * Adds a circle to the current path as a new sub-path
  * @param cr Cairo context to draw on
- * @param item DrawItem containing circle parameters
+ * @param p Circle parameters: center and radius
  */
-void 
-draw_circ(
+void
+path_circ(
   cairo_t *cr,
-  DrawItem *item
+  const double *p
 ) {
-  int r, g, b;
-  sscanf(item->colorParams.c_str(), "%02x%02x%02x", &r, &g, &b);
-  cairo_set_source_rgb(cr, r / 255.0, g / 255.0, b / 255.0);
-    
-  cairo_arc(
-    cr, 
-    item->params[0], 
-    item->params[1], 
-    item->params[6],
-    0, 
-    2 * M_PI
-  );
-  cairo_fill(cr);
+  cairo_new_sub_path(cr);
+  cairo_arc(cr, p[0], p[1], p[2], 0, 2 * M_PI);
 }
 
 /**
- * Draws a triangle on the cairo surface
+ * Adds a triangle to the current path
  * @param cr Cairo context to draw on
- * @param item DrawItem containing triangle parameters
+ * @param p Triangle parameters: three points
  */
-void 
-draw_tria(
+void
+path_tria(
   cairo_t *cr,
-  DrawItem *item
+  const double *p
 ) {
-  int r, g, b;
-  sscanf(item->colorParams.c_str(), "%02x%02x%02x", &r, &g, &b);
-  cairo_set_source_rgb(cr, r / 255.0, g / 255.0, b / 255.0);
-    
-  cairo_move_to(cr, item->params[0], item->params[1]);
-  cairo_line_to(cr, item->params[2], item->params[3]);
-  cairo_line_to(cr, item->params[4], item->params[5]);
+  cairo_move_to(cr, p[0], p[1]);
+  cairo_line_to(cr, p[2], p[3]);
+  cairo_line_to(cr, p[4], p[5]);
   cairo_close_path(cr);
-  cairo_fill(cr);
 }
 
 /**
- * Draws a rectangle on the cairo surface
+ * Adds a rectangle to the current path
+ * @param cr Cairo context to draw on
+ * @param p Rectangle parameters: two opposite corners
+ */
+void
+path_rect(
+  cairo_t *cr,
+  const double *p
+) {
+  cairo_rectangle(cr, p[0], p[1], p[2] - p[0], p[3] - p[1]);
+}
+
+/**
+ * Adds a fill command to the current path
  * @param cr Cairo context to draw on
- * @param item DrawItem containing rectangle parameters
+ * @param index Index of a circ, tria or rect command in DrawInfo
+ */
+void
+path_fill(
+  cairo_t *cr,
+  size_t index
+) {
+  double p[6];
+  drawinfo.params(index, p);
+  if (drawinfo.ops[index] == DRAW_CIRC) path_circ(cr, p);
+  if (drawinfo.ops[index] == DRAW_TRIA) path_tria(cr, p);
+  if (drawinfo.ops[index] == DRAW_RECT) path_rect(cr, p);
+}
+
+/**
+ * Draws a circle, triangle or rectangle on the cairo surface
+ * @param cr Cairo context to draw on
+ * @param index Index of the fill command in DrawInfo
  */
 void 
-draw_rect(
+draw_fill(
   cairo_t *cr,
-  DrawItem *item
+  size_t index
 ) {
-  int r, g, b;
-  sscanf(item->colorParams.c_str(), "%02x%02x%02x", &r, &g, &b);
-  cairo_set_source_rgb(cr, r / 255.0, g / 255.0, b / 255.0);
-    
-  cairo_rectangle(
-    cr, 
-    item->params[0], 
-    item->params[1],
-    item->params[2] - item->params[0],
-    item->params[3] - item->params[1]
-  );
+  set_color(cr, drawinfo.colors[index]);
+  path_fill(cr, index);
   cairo_fill(cr);
 }
 
 /**
- * Creates a PNG image with all shapes from DrawInfo
+ * Coarse grid of canvas cells fully covered by later opaque fills
+ */
+struct
+CoverGrid {
+  int cell;               // Cell edge in pixels
+  int cols, rows;
+  int width, height;      // Canvas size in pixels
+  vector<char> covered;
+};
+
+/**
+ * Checks whether cairo renders a command without entering an error state
+ * An error would stop all later drawing, so no command may be dropped for them
+ * @param index Command index
+ * @return true if all parameters are finite and widths and radii are not negative
+ */
+bool
+item_safe(
+  size_t index
+) {
+  uint8_t op = drawinfo.ops[index];
+  double p[6];
+  drawinfo.params(index, p);
+  for (int i = 0; i < DrawInfo::paramNum[op]; i++) if (!isfinite(p[i])) return false;
+  if ((op == DRAW_LINE && p[4] < 0) || (op == DRAW_CIRC && p[2] < 0)) return false;
+  return true;
+}
+
+/**
+ * Gets a bounding box of every pixel a command may touch
+ * @param index Command index
+ * @param box Receives x0, y0, x1, y1 in pixels
+ */
+void
+item_bounds(
+  size_t index,
+  double box[4]
+) {
+  uint8_t op = drawinfo.ops[index];
+  double p[6];
+  drawinfo.params(index, p);
+  int points = (op == DRAW_TRIA) ? 3 : (op == DRAW_CIRC) ? 1 : 2;
+  double pad = 1;   // Antialiasing reaches into the neighbouring pixel
+  if (op == DRAW_LINE) pad += p[4] / 2;
+  if (op == DRAW_CIRC) pad += p[2];
+  box[0] = box[2] = p[0], box[1] = box[3] = p[1];
+  for (int i = 1; i < points; i++) {
+    box[0] = min(box[0], p[2 * i]), box[2] = max(box[2], p[2 * i]);
+    box[1] = min(box[1], p[2 * i + 1]), box[3] = max(box[3], p[2 * i + 1]);
+  }
+  box[0] -= pad, box[1] -= pad, box[2] += pad, box[3] += pad;
+}
+
+/**
+ * Converts a coordinate to the 24.8 fixed point cairo builds paths with
+ * @param value Coordinate in pixels
+ * @return Coordinate in 1/256 pixels
+ */
+long long
+fixed_point(
+  double value
+) {
+  return (long long) nearbyint(value * 256);
+}
+
+/**
+ * Checks whether an opaque fill covers a whole rectangle of pixels
+ * Every pixel inside is then fully covered, with and without antialiasing
+ * @param index Index of a rect, circ or tria command
+ * @param x0 Left edge in pixels
+ * @param y0 Top edge in pixels
+ * @param x1 Right edge in pixels
+ * @param y1 Bottom edge in pixels
+ * @return true if the fill contains the rectangle
+ */
+bool
+item_contains(
+  size_t index,
+  int x0,
+  int y0,
+  int x1,
+  int y1
+) {
+  uint8_t op = drawinfo.ops[index];
+  double p[6];
+  drawinfo.params(index, p);
+  if (op == DRAW_RECT) {
+    // cairo_rectangle adds the fixed width to the fixed corner
+    long long ax = fixed_point(p[0]), bx = ax + fixed_point(p[2] - p[0]);
+    long long ay = fixed_point(p[1]), by = ay + fixed_point(p[3] - p[1]);
+    return min(ax, bx) <= x0 * 256LL && max(ax, bx) >= x1 * 256LL
+        && min(ay, by) <= y0 * 256LL && max(ay, by) >= y1 * 256LL;
+  }
+  if (op == DRAW_CIRC) {
+    // The flattened arc may lie inside the true circle by the tolerance of 0.1 pixels
+    double r = p[2] - 0.5;
+    if (r <= 0) return false;
+    double dx = max(fabs(x0 - p[0]), fabs(x1 - p[0])), dy = max(fabs(y0 - p[1]), fabs(y1 - p[1]));
+    return dx * dx + dy * dy <= r * r;
+  }
+  if (op == DRAW_TRIA) {
+    long long x[3], y[3];
+    for (int i = 0; i < 3; i++) {
+      if (fabs(p[2 * i]) > (1 << 20) || fabs(p[2 * i + 1]) > (1 << 20)) return false;   // Keeps the products exact
+      x[i] = fixed_point(p[2 * i]), y[i] = fixed_point(p[2 * i + 1]);
+    }
+    long long area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+    if (area == 0) return false;
+    long long cx[] = { x0 * 256LL, x1 * 256LL, x1 * 256LL, x0 * 256LL };
+    long long cy[] = { y0 * 256LL, y0 * 256LL, y1 * 256LL, y1 * 256LL };
+    for (int c = 0; c < 4; c++) {
+      for (int i = 0; i < 3; i++) {
+        int j = (i + 1) % 3;
+        long long side = (x[j] - x[i]) * (cy[c] - y[i]) - (y[j] - y[i]) * (cx[c] - x[i]);
+        if ((area > 0 && side < 0) || (area < 0 && side > 0)) return false;
+      }
+    }
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Gets the range of grid cells overlapping a bounding box
+ * @param grid Coverage grid
+ * @param box Bounding box in pixels
+ * @param range Receives the first and last column and row, empty if off the canvas
+ */
+void
+grid_range(
+  CoverGrid& grid,
+  double box[4],
+  int range[4]
+) {
+  range[0] = (int) max(0.0, floor(box[0] / grid.cell));
+  range[1] = (int) max(0.0, floor(box[1] / grid.cell));
+  range[2] = (int) min(grid.cols - 1.0, floor(box[2] / grid.cell));
+  range[3] = (int) min(grid.rows - 1.0, floor(box[3] / grid.cell));
+}
+
+/**
+ * Checks whether a command is hidden by the fills after it
+ * @param grid Coverage grid of the later fills
+ * @param index Command index
+ * @return true if every pixel the command may touch is covered or off the canvas
+ */
+bool
+grid_hides(
+  CoverGrid& grid,
+  size_t index
+) {
+  double box[4];
+  int range[4];
+  item_bounds(index, box);
+  grid_range(grid, box, range);
+  for (int row = range[1]; row <= range[3]; row++) {
+    for (int col = range[0]; col <= range[2]; col++) {
+      if (!grid.covered[row * grid.cols + col]) return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Marks the cells an opaque fill covers completely
+ * @param grid Coverage grid
+ * @param index Index of a rect, circ or tria command
+ */
+void
+grid_cover(
+  CoverGrid& grid,
+  size_t index
+) {
+  double box[4];
+  int range[4];
+  item_bounds(index, box);
+  grid_range(grid, box, range);
+  for (int row = range[1]; row <= range[3]; row++) {
+    for (int col = range[0]; col <= range[2]; col++) {
+      char& covered = grid.covered[row * grid.cols + col];
+      if (covered) continue;
+      // Only the part of a border cell inside the canvas has to be covered
+      int x0 = col * grid.cell, x1 = min(x0 + grid.cell, grid.width);
+      int y0 = row * grid.cell, y1 = min(y0 + grid.cell, grid.height);
+      covered = item_contains(index, x0, y0, x1, y1);
+    }
+  }
+}
+
+/**
+ * Drops commands that cannot change the image
+ * Walks the list back to front with a coarse coverage grid: a command whose pixels
+ * all lie in cells fully covered by later opaque fills is dropped. Without antialiasing,
+ * a command identical to the one before it paints the same pixels again and is dropped too.
+ * @param antialias Whether antialiasing is enabled
  * @param width Width of the output image
  * @param height Height of the output image
- * @param ouName Output filename
+ */
+void
+occlude(
+  bool antialias,
+  int width,
+  int height
+) {
+  for (size_t i = 0; i < drawinfo.size(); i++) if (!item_safe(i)) return;
+
+  CoverGrid grid;
+  grid.cell = 4;
+  while ((width + grid.cell - 1) / grid.cell > 2048 || (height + grid.cell - 1) / grid.cell > 2048) grid.cell *= 2;
+  grid.cols = (width + grid.cell - 1) / grid.cell, grid.rows = (height + grid.cell - 1) / grid.cell;
+  grid.width = width, grid.height = height;
+  grid.covered.assign((size_t) grid.cols * grid.rows, 0);
+
+  vector<char> keep(drawinfo.size(), 1);
+  long long occluded = 0, duplicate = 0;
+  for (int i = (int) drawinfo.size() - 1; i >= 0; i--) {
+    if (!antialias && i > 0 && drawinfo.same(i, i - 1)) {
+      keep[i] = 0, duplicate++;
+      continue;
+    }
+    if (grid_hides(grid, i)) {
+      keep[i] = 0, occluded++;
+      continue;
+    }
+    if (drawinfo.ops[i] != DRAW_LINE) grid_cover(grid, i);
+  }
+
+  if (getenv("PFC_VERBOSE")) {
+    fprintf(stderr, "pfc: \033[36m[Render]\033[0m dropped %lld occluded and %lld duplicate of %zu primitives\n", occluded, duplicate, drawinfo.size());
+  }
+  drawinfo.filter(keep);
+}
+
+/**
+ * Run of fills with one color, drawn as a single cairo path
+ */
+struct
+DrawBatch {
+  long long key;          // Color and path class, -1 for strokes, which are never merged
+  vector<size_t> items;   // Indices into drawinfo in drawing order
+  double box[4];          // Union of the member bounding boxes
+};
+
+/**
+ * Checks whether two bounding boxes share a pixel
+ * @param a First box as x0, y0, x1, y1
+ * @param b Second box as x0, y0, x1, y1
+ * @return true if the boxes overlap or touch
+ */
+bool
+boxes_overlap(
+  const double a[4],
+  const double b[4]
+) {
+  return !(a[2] < b[0] || b[2] < a[0] || a[3] < b[1] || b[3] < a[1]);
+}
+
+/**
+ * Checks whether a bounding box is apart from every member of a batch
+ * Large batches are only tested as a whole to bound the cost
+ * @param batch Batch to test
+ * @param box Bounding box in pixels
+ * @return true if no member may touch a pixel inside the box
+ */
+bool
+batch_disjoint(
+  DrawBatch& batch,
+  const double box[4]
+) {
+  if (!boxes_overlap(batch.box, box)) return true;
+  if (batch.items.size() > 32) return false;
+  double member[4];
+  for (size_t index: batch.items) {
+    item_bounds(index, member);
+    if (boxes_overlap(member, box)) return false;
+  }
+  return true;
+}
+
+/**
+ * Groups commands into batches of same-color fills
+ * A fill moves back to an earlier batch of its color when it shares no pixel with
+ * that batch or with any command drawn in between, so the image does not change.
+ * Rectangles are kept apart from other fills, as cairo rasterizes box-only paths separately.
+ * @param enabled Whether fills may be merged at all
+ * @return Batches in drawing order
+ */
+vector<DrawBatch>
+batch(
+  bool enabled
+) {
+  vector<DrawBatch> batches;
+  for (size_t i = 0; i < drawinfo.size(); i++) if (!item_safe(i)) enabled = false;
+
+  long long merged = 0;
+  for (size_t i = 0; i < drawinfo.size(); i++) {
+    uint8_t op = drawinfo.ops[i];
+    double box[4];
+    item_bounds(i, box);
+    long long key = (!enabled || op == DRAW_LINE) ? -1 : drawinfo.colors[i] | (op == DRAW_RECT ? 1LL << 32 : 0);
+
+    int target = -1;
+    for (int j = (int) batches.size() - 1; key >= 0 && j >= 0 && j >= (int) batches.size() - 16; j--) {
+      if (!batch_disjoint(batches[j], box)) break;
+      if (batches[j].key == key) {
+        target = j;
+        break;
+      }
+    }
+
+    if (target < 0) {
+      batches.push_back((DrawBatch) { key, { i }, { box[0], box[1], box[2], box[3] } });
+    } else {
+      DrawBatch& into = batches[target];
+      merged += (into.items.size() == 1) ? 2 : 1;
+      into.items.push_back(i);
+      into.box[0] = min(into.box[0], box[0]), into.box[1] = min(into.box[1], box[1]);
+      into.box[2] = max(into.box[2], box[2]), into.box[3] = max(into.box[3], box[3]);
+    }
+  }
+
+  if (getenv("PFC_VERBOSE")) {
+    fprintf(stderr, "pfc: \033[36m[Render]\033[0m %zu commands drawn in %zu batches, %lld fills merged\n", drawinfo.size(), batches.size(), merged);
+  }
+  return batches;
+}
+
+/**
+ * Draws one batch of commands, traced as a span with --trace
+ * @param cr Cairo context to draw on
+ * @param batch Batch to draw
+ */
+void
+draw_batch(
+  cairo_t *cr,
+  const DrawBatch& batch
+) {
+  static bool tracing = trace_enabled();
+  double start = (tracing || heatmap) ? trace_clock() : 0;
+  size_t first = batch.items[0];
+  if (drawinfo.ops[first] == DRAW_LINE) draw_line(cr, first);
+  else if (batch.items.size() == 1) draw_fill(cr, first);
+  else {
+    // Members share no pixel, so one fill composites exactly like separate fills
+    set_color(cr, drawinfo.colors[first]);
+    for (size_t index: batch.items) path_fill(cr, index);
+    cairo_fill(cr);
+  }
+  if (heatmap) {
+    rastercount[drawinfo.ops[first]] += batch.items.size();
+    rastertime[drawinfo.ops[first]] += (long long) ((trace_clock() - start) * 1000);
+  }
+  if (tracing) {
+    trace_span("batch", "rasterize", start,
+      "\"shape\": \"" + string(DrawInfo::names[drawinfo.ops[first]]) + "\", \"commands\": " + to_string(batch.items.size()));
+  }
+}
+
+/**
+ * Sorts batches into the stripes of the image their bounding boxes reach
+ * Batches of commands cairo cannot draw go to every stripe, so they stop drawing
+ * there exactly as they would on a single surface.
+ * @param batches Batches in drawing order
+ * @param subset Indices of the batches to sort, in drawing order
+ * @param axis 0 for columns, 1 for rows
+ * @param size Stripe size in pixels
+ * @param limit Image size along the axis
+ * @return Batch indices per stripe, in drawing order
+ */
+vector<vector<uint32_t>>
+batch_bins(
+  const vector<DrawBatch>& batches,
+  const vector<uint32_t>& subset,
+  int axis,
+  int size,
+  int limit
+) {
+  int count = (limit + size - 1) / size;
+  vector<vector<uint32_t>> bins(count);
+  for (uint32_t b: subset) {
+    const double *box = batches[b].box;
+    double first = 0, last = count - 1;
+    if (batches[b].items.size() > 1 || item_safe(batches[b].items[0])) {
+      if (!(box[axis + 2] >= 0 && box[axis] < limit)) continue;
+      first = max(first, floor(box[axis] / size)), last = min(last, floor(box[axis + 2] / size));
+    }
+    for (int k = first; k <= last; k++) bins[k].push_back(b);
+  }
+  return bins;
+}
+
+/**
+ * Renders the image in horizontal bands and streams each band into the output
+ * Every band gets a fresh context and draws only the batches whose bounding box
+ * reaches it.
+ * @param antialias Whether antialiasing is enabled
+ * @param width Width of the output image
+ * @param height Height of the output image
+ * @param rows Height of a band in pixels
+ * @param batches Batches in drawing order
+ * @param image Opened output image
+ */
+void
+draw_bands(
+  bool antialias,
+  int width,
+  int height,
+  int rows,
+  const vector<DrawBatch>& batches,
+  ImageStream& image
+) {
+  int count = (height + rows - 1) / rows;
+  vector<uint32_t> all(batches.size());
+  for (size_t b = 0; b < batches.size(); b++) all[b] = b;
+  vector<vector<uint32_t>> bands = batch_bins(batches, all, 1, rows, height);
+
+  cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, rows);
+  int stride = cairo_image_surface_get_stride(surface);
+  for (int k = 0; k < count; k++) {
+    cairo_surface_flush(surface);
+    memset(cairo_image_surface_get_data(surface), 0, (size_t) stride * rows);
+    cairo_surface_mark_dirty(surface);
+
+    stats_start("rasterize");
+    cairo_t *cr = cairo_create(surface);
+    if (!antialias) cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+    cairo_translate(cr, 0, -(double) k * rows);
+    for (uint32_t b: bands[k]) draw_batch(cr, batches[b]);
+    cairo_destroy(cr);
+    vector<uint32_t>().swap(bands[k]);
+    cairo_surface_flush(surface);
+    stats_stop("rasterize");
+
+    stats_start("encode");
+    image_rows(image, cairo_image_surface_get_data(surface), stride, rows);
+    stats_stop("encode");
+  }
+  cairo_surface_destroy(surface);
+
+  if (getenv("PFC_VERBOSE")) {
+    fprintf(stderr, "pfc: \033[36m[Render]\033[0m %d bands of %d rows, %.1f MiB per band\n", count, rows, (double) stride * rows / 1048576);
+  }
+}
+
+/**
+ * Renders a rectangle of the image into a pixel buffer
+ * The rectangle is cleared and gets its own cairo context, so it matches the same
+ * part of a whole-image render. Batches that miss the rectangle are skipped.
+ * @param antialias Whether antialiasing is enabled
+ * @param origin First pixel of the rectangle in the buffer
+ * @param stride Pixels between rows of the buffer
+ * @param x0 Left edge of the rectangle in the image
+ * @param y0 Top edge of the rectangle in the image
+ * @param width Width of the rectangle
+ * @param height Height of the rectangle
+ * @param batches Batches in drawing order
+ * @param subset Indices of the batches that may reach the rectangle, in drawing order
+ */
+void
+draw_region(
+  bool antialias,
+  uint32_t *origin,
+  int stride,
+  int x0,
+  int y0,
+  int width,
+  int height,
+  const vector<DrawBatch>& batches,
+  const vector<uint32_t>& subset
+) {
+  for (int y = 0; y < height; y++) memset(origin + (size_t) y * stride, 0, 4 * (size_t) width);
+  cairo_surface_t *surface = cairo_image_surface_create_for_data(
+    (unsigned char*) origin, CAIRO_FORMAT_ARGB32, width, height, 4 * stride);
+  cairo_t *cr = cairo_create(surface);
+  if (!antialias) cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+  cairo_translate(cr, -(double) x0, -(double) y0);
+  double area[4] = { (double) x0, (double) y0, (double) x0 + width, (double) y0 + height };
+  for (uint32_t b: subset) {
+    const DrawBatch& batch = batches[b];
+    bool safe = batch.items.size() > 1 || item_safe(batch.items[0]);
+    if (safe && !(batch.box[2] >= area[0] && batch.box[0] < area[2] && batch.box[3] >= area[1] && batch.box[1] < area[3])) continue;
+    draw_batch(cr, batch);
+  }
+  cairo_destroy(cr);
+  cairo_surface_flush(surface);
+  cairo_surface_destroy(surface);
+}
+
+/**
+ * One level of a Deep Zoom tile pyramid
+ * Only the current row of tiles is kept; it is written and halved into the
+ * next smaller level once it is complete.
+ */
+struct
+PyramidLevel {
+  int width, height;          // Level size in pixels
+  int rows;                   // Rows of the level received so far
+  int filled;                 // Rows in the current tile row
+  vector<uint32_t> pixels;    // Current tile row, width pixels per row
+};
+
+/**
+ * Writes the current tile row of a level and passes it on to the next smaller level
+ * @param levels All levels, the full resolution one last
+ * @param level Level to flush
+ * @param tile Tile size in pixels
+ * @param image Tile format and compression level
+ * @param directory Directory holding one subdirectory per level
+ */
+void
+pyramid_flush(
+  vector<PyramidLevel>& levels,
+  int level,
+  int tile,
+  const ImageStream& image,
+  const string& directory
+) {
+  PyramidLevel& at = levels[level];
+  int row = (at.rows - at.filled) / tile, columns = (at.width + tile - 1) / tile;
+  int threads = max(1u, min(thread::hardware_concurrency(), (unsigned) columns));
+  vector<thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.push_back(thread([&, t]() {
+      for (int column = t; column < columns; column += threads) {
+        double start = trace_clock();
+        ImageStream out = image;
+        string name = directory + to_string(level) + "/" + to_string(column) + "_" + to_string(row) + "." + ImageStream::names[image.format];
+        if (!image_open(out, name, min(tile, at.width - column * tile), at.filled)) continue;
+        image_rows(out, (const uint8_t*) &at.pixels[column * tile], 4 * at.width, at.filled);
+        image_close(out);
+        trace_span("write tile", "encode", start, "\"level\": " + to_string(level) + ", \"column\": " + to_string(column) + ", \"row\": " + to_string(row));
+      }
+    }));
+  }
+  for (thread& worker: workers) worker.join();
+
+  if (level > 0) {
+    PyramidLevel& next = levels[level - 1];
+    for (int y = 0; y < at.filled; y += 2) {
+      const uint32_t *top = &at.pixels[(size_t) y * at.width];
+      const uint32_t *bottom = (y + 1 < at.filled) ? top + at.width : top;
+      image_halve(top, bottom, at.width, &next.pixels[(size_t) next.filled * next.width]);
+      next.filled++, next.rows++;
+      if (next.filled == tile || next.rows == next.height) pyramid_flush(levels, level - 1, tile, image, directory);
+    }
+  }
+  at.filled = 0;
+}
+
+/**
+ * Renders the image as a Deep Zoom tile pyramid with a .dzi manifest
+ * Rows of full resolution tiles are rendered in parallel, each tile from the
+ * batches binned to it. Smaller levels are halved from the level above with a
+ * box filter as their rows arrive, so memory stays at about two tile rows of
+ * the full image.
+ * @param antialias Whether antialiasing is enabled
+ * @param width Width of the full image
+ * @param height Height of the full image
+ * @param tile Tile size in pixels, even
+ * @param batches Batches in drawing order
+ * @param image Tile format and compression level
+ * @param ouName Output name, for <ouName>.dzi and <ouName>_files/
+ * @return false if the manifest cannot be written
+ */
+bool
+draw_pyramid(
+  bool antialias,
+  int width,
+  int height,
+  int tile,
+  const vector<DrawBatch>& batches,
+  const ImageStream& image,
+  const string& ouName
+) {
+  int top = 0;
+  while ((1LL << top) < max(width, height)) top++;
+  string directory = ouName + "_files/";
+  mkdir(directory.c_str(), 0755);
+  vector<PyramidLevel> levels(top + 1);
+  long long tiles = 0;
+  for (int level = top; level >= 0; level--) {
+    PyramidLevel& at = levels[level];
+    at.width = (level == top) ? width : (levels[level + 1].width + 1) / 2;
+    at.height = (level == top) ? height : (levels[level + 1].height + 1) / 2;
+    at.rows = at.filled = 0;
+    at.pixels.resize((size_t) at.width * tile);
+    tiles += (long long) ((at.width + tile - 1) / tile) * ((at.height + tile - 1) / tile);
+    mkdir((directory + to_string(level)).c_str(), 0755);
+  }
+
+  vector<uint32_t> all(batches.size());
+  for (size_t b = 0; b < batches.size(); b++) all[b] = b;
+  vector<vector<uint32_t>> rows = batch_bins(batches, all, 1, tile, height);
+  PyramidLevel& full = levels[top];
+  int columns = (width + tile - 1) / tile;
+  for (size_t row = 0; row < rows.size(); row++) {
+    vector<vector<uint32_t>> cells = batch_bins(batches, rows[row], 0, tile, width);
+    vector<uint32_t>().swap(rows[row]);
+    int y0 = row * tile, tileHeight = min(tile, height - y0);
+
+    stats_start("rasterize");
+    int threads = max(1u, min(thread::hardware_concurrency(), (unsigned) columns));
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+      workers.push_back(thread([&, t]() {
+        for (int column = t; column < columns; column += threads) {
+          double start = trace_clock();
+          int x0 = column * tile;
+          draw_region(antialias, &full.pixels[x0], width, x0, y0, min(tile, width - x0), tileHeight, batches, cells[column]);
+          trace_span("tile", "rasterize", start, "\"column\": " + to_string(column) + ", \"row\": " + to_string(row));
+        }
+      }));
+    }
+    for (thread& worker: workers) worker.join();
+    stats_stop("rasterize");
+    full.filled = tileHeight, full.rows += tileHeight;
+    stats_start("encode");
+    pyramid_flush(levels, top, tile, image, directory);
+    stats_stop("encode");
+  }
+  stats_count("encode", "tiles", tiles);
+
+  if (getenv("PFC_VERBOSE")) {
+    fprintf(stderr, "pfc: \033[36m[Render]\033[0m pyramid of %d levels, %lld tiles of %d pixels\n", top + 1, tiles, tile);
+  }
+  FILE *manifest = fopen((ouName + ".dzi").c_str(), "w");
+  if (!manifest) return false;
+  fprintf(manifest, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+  fprintf(manifest, "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"%s\" Overlap=\"0\" TileSize=\"%d\">\n", ImageStream::names[image.format], tile);
+  fprintf(manifest, "  <Size Width=\"%d\" Height=\"%d\"/>\n", width, height);
+  fprintf(manifest, "</Image>\n");
+  return fclose(manifest) == 0;
+}
+
+/**
+ * Drops hidden commands and groups the rest into batches
+ * PFC_OCCLUDE=0 and PFC_BATCH=0 turn the passes off.
+ * @param antialias Whether antialiasing is enabled
+ * @param width Width of the output image
+ * @param height Height of the output image
+ * @return Batches in drawing order
+ */
+vector<DrawBatch>
+draw_batches(
+  bool antialias,
+  int width,
+  int height
+) {
+  stats_start("optimize");
+  size_t commands = drawinfo.size();
+  const char *occlusion = getenv("PFC_OCCLUDE");
+  if (!occlusion || strcmp(occlusion, "0")) occlude(antialias, width, height);
+
+  const char *batching = getenv("PFC_BATCH");
+  vector<DrawBatch> batches = batch(!batching || strcmp(batching, "0"));
+  stats_stop("optimize");
+  stats_count("optimize", "dropped", commands - drawinfo.size());
+  stats_count("optimize", "batches", batches.size());
+  return batches;
+}
+
+/**
+ * Counts the commands touching each pixel of a range of rows
+ * Every command is drawn alone on a scratch surface the size of its bounding box,
+ * and each pixel it leaves with some alpha is counted.
+ * @param antialias Whether antialiasing is enabled
+ * @param width Width of the image
+ * @param y0 First row of the range
+ * @param y1 Row after the range
+ * @param heat Counters of the whole image
+ * @param covered Receives the pixels covered per kind of command
+ */
+void
+heat_rows(
+  bool antialias,
+  int width,
+  int y0,
+  int y1,
+  uint32_t *heat,
+  long long covered[4]
+) {
+  vector<uint32_t> scratch;
+  for (size_t i = 0; i < drawinfo.size(); i++) {
+    if (!item_safe(i)) continue;
+    double box[4];
+    item_bounds(i, box);
+    if (box[2] < 0 || box[0] >= width || box[3] < y0 || box[1] >= y1) continue;
+    int left = max(0, (int) floor(box[0])), top = max(y0, (int) floor(box[1]));
+    int w = min(width, (int) ceil(box[2])) - left, h = min(y1, (int) ceil(box[3])) - top;
+    if (w <= 0 || h <= 0) continue;
+
+    scratch.assign((size_t) w * h, 0);
+    cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char*) scratch.data(), CAIRO_FORMAT_ARGB32, w, h, 4 * w);
+    cairo_t *cr = cairo_create(surface);
+    if (!antialias) cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+    cairo_translate(cr, -(double) left, -(double) top);
+    if (drawinfo.ops[i] == DRAW_LINE) draw_line(cr, i);
+    else draw_fill(cr, i);
+    cairo_destroy(cr);
+    cairo_surface_flush(surface);
+    cairo_surface_destroy(surface);
+
+    for (int y = 0; y < h; y++) {
+      const uint32_t *row = &scratch[(size_t) y * w];
+      uint32_t *into = heat + (size_t) (top + y) * width + left;
+      for (int x = 0; x < w; x++) {
+        if (row[x] >> 24) into[x]++, covered[drawinfo.ops[i]]++;
+      }
+    }
+  }
+}
+
+/**
+ * Writes an overdraw heatmap and reports the raster cost of each kind of command
+ * The heatmap shows how many commands touched each pixel on a logarithmic scale
+ * with black where no command drew, then purple for one command through red and
+ * orange to pale yellow for the most.
+ * @param antialias Whether antialiasing is enabled
+ * @param width Width of the image
+ * @param height Height of the image
+ * @param fileName PNG file to write
+ * @return false if the heatmap cannot be written
+ */
+bool
+draw_heatmap(
+  bool antialias,
+  int width,
+  int height,
+  const string& fileName
+) {
+  vector<uint32_t> heat((size_t) width * height);
+  int threads = max(1u, min(thread::hardware_concurrency(), (unsigned) height));
+  vector<long long> covered(4 * threads);   // Pixels covered per thread and kind
+  vector<thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.push_back(thread([&, t]() {
+      // Threads own disjoint rows, so the counters need no locking
+      heat_rows(antialias, width, (long long) height * t / threads, (long long) height * (t + 1) / threads, heat.data(), &covered[4 * t]);
+    }));
+  }
+  for (thread& worker: workers) worker.join();
+
+  uint32_t most = 0;
+  long long touched = 0, total = 0;
+  for (uint32_t count: heat) most = max(most, count), touched += count > 0, total += count;
+  const double stops[5][3] = { { 0, 0, 4 }, { 87, 16, 110 }, { 188, 55, 84 }, { 249, 142, 9 }, { 252, 255, 164 } };
+  for (uint32_t& pixel: heat) {
+    if (!pixel) {
+      pixel = 0xff000000;
+      continue;
+    }
+    double t = 1 + ((most > 1) ? log((double) pixel) / log((double) most) * 3 : 0);
+    int k = min(3, (int) t);
+    double f = t - k, rgb[3];
+    for (int c = 0; c < 3; c++) rgb[c] = stops[k][c] + (stops[k + 1][c] - stops[k][c]) * f;
+    pixel = 0xff000000 | ((uint32_t) lround(rgb[0]) << 16) | ((uint32_t) lround(rgb[1]) << 8) | (uint32_t) lround(rgb[2]);
+  }
+  ImageStream image;
+  remove(fileName.c_str());
+  bool written = image_open(image, fileName, width, height);
+  if (written) {
+    image_rows(image, (const uint8_t*) heat.data(), 4 * width, height);
+    written = image_close(image);
+  }
+
+  fprintf(stderr, "pfc: \033[36m[Heatmap]\033[0m %s: overdraw up to %u, %.2f on average over %.1f%% of the canvas\n",
+    fileName.c_str(), most, touched ? (double) total / touched : 0.0, 100.0 * touched / max(1LL, (long long) width * height));
+  fprintf(stderr, "pfc: \033[36m[Heatmap]\033[0m %-6s %12s %14s %12s %10s\n", "type", "commands", "pixels", "raster ms", "ns/pixel");
+  for (int op = 0; op < 4; op++) {
+    long long pixels = 0;
+    for (int t = 0; t < threads; t++) pixels += covered[4 * t + op];
+    if (!pixels && !rastercount[op]) continue;
+    fprintf(stderr, "pfc: \033[36m[Heatmap]\033[0m %-6s %12lld %14lld %12.3f %10.2f\n", DrawInfo::names[op],
+      (long long) rastercount[op], pixels, rastertime[op] / 1e6, pixels ? (double) rastertime[op] / pixels : 0.0);
+  }
+  return written;
+}
+
+/**
+ * Header of the pixels kept for incremental rendering, followed by cairo ARGB32 rows
+ */
+struct
+PixelState {
+  char magic[8];
+  int32_t width, height;
+  int32_t antialias;
+  int32_t reserved[3];
+};
+const char pixelMagic[8] = { 'P', 'F', 'C', 'P', 'I', 'X', 'L', '1' };
+
+/**
+ * Checks whether cairo draws every command of a list without entering an error state
+ * @param info Command list
+ * @return true if all coordinates are finite and widths and radii are not negative
+ */
+bool
+info_safe(
+  const DrawInfo& info
+) {
+  for (size_t i = 0; i < info.size(); i++) {
+    uint8_t op = info.ops[i];
+    const int32_t *fixed = info.fixed(i);
+    for (int k = 0; k < DrawInfo::paramNum[op]; k++) if (fixed[k] == DrawInfo::fixedNaN) return false;
+    if ((op == DRAW_LINE && fixed[4] < 0) || (op == DRAW_CIRC && fixed[2] < 0)) return false;
+  }
+  return true;
+}
+
+/**
+ * Finds the commands outside a longest common subsequence of two ranges
+ * Uses Myers' O(ND) diff, which stays cheap while the ranges differ in few commands.
+ * @param a Old command list
+ * @param a0 First command of the old range
+ * @param a1 Command after the old range
+ * @param b New command list
+ * @param b0 First command of the new range
+ * @param b1 Command after the new range
+ * @param maxEdits Number of differing commands to give up at
+ * @param aChanged Receives 1 for each old command that was removed, by offset in the range
+ * @param bChanged Receives 1 for each new command that was added, by offset in the range
+ * @return false if the ranges differ in more than maxEdits commands
+ */
+bool
+diff_commands(
+  const DrawInfo& a,
+  size_t a0,
+  size_t a1,
+  const DrawInfo& b,
+  size_t b0,
+  size_t b1,
+  int maxEdits,
+  vector<char>& aChanged,
+  vector<char>& bChanged
+) {
+  long long n = a1 - a0, m = b1 - b0, most = min((long long) maxEdits, n + m);
+  aChanged.assign(n, 1), bChanged.assign(m, 1);
+  vector<long long> reach(2 * most + 3, 0);    // Furthest x on each diagonal k, at index k + most + 1
+  vector<vector<long long>> trace;
+  long long offset = most + 1;
+  for (long long d = 0; d <= most; d++) {
+    trace.push_back(reach);
+    for (long long k = -d; k <= d; k += 2) {
+      long long x = (k == -d || (k != d && reach[offset + k - 1] < reach[offset + k + 1])) ? reach[offset + k + 1] : reach[offset + k - 1] + 1;
+      long long y = x - k;
+      while (x < n && y < m && a.same(a0 + x, b, b0 + y)) x++, y++;
+      reach[offset + k] = x;
+      if (x < n || y < m) continue;
+
+      // Walk back through the saved diagonals, marking the snakes as common
+      for (long long e = d; e >= 0; e--) {
+        long long kk = x - y, px = 0, py = 0;
+        if (e > 0) {
+          const vector<long long>& prior = trace[e];
+          long long pk = (kk == -e || (kk != e && prior[offset + kk - 1] < prior[offset + kk + 1])) ? kk + 1 : kk - 1;
+          px = prior[offset + pk], py = px - pk;
+        }
+        while (x > px && y > py) aChanged[--x] = 0, bChanged[--y] = 0;
+        x = px, y = py;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Marks the grid cells the changed commands of a range may touch
+ * @param info Command list
+ * @param first First command of the range
+ * @param changed Whether each command of the range changed
+ * @param cell Cell size in pixels
+ * @param cols Number of grid columns
+ * @param cells Dirty flag per cell, row by row
+ */
+void
+dirty_mark(
+  const DrawInfo& info,
+  size_t first,
+  const vector<char>& changed,
+  int cell,
+  int cols,
+  vector<char>& cells
+) {
+  int rows = cells.size() / cols;
+  for (size_t i = first; i < first + changed.size(); i++) {
+    if (!changed[i - first]) continue;
+    int64_t box[4];
+    archive_bounds(info.ops[i], info.fixed(i), box);
+    // One more pixel for antialiasing, as in item_bounds
+    double x0 = box[0] / 100.0 - 1, y0 = box[1] / 100.0 - 1, x1 = box[2] / 100.0 + 1, y1 = box[3] / 100.0 + 1;
+    if (x1 < 0 || y1 < 0 || x0 >= (double) cols * cell || y0 >= (double) rows * cell) continue;
+    int c0 = max(0.0, floor(x0 / cell)), c1 = min(cols - 1.0, floor(x1 / cell));
+    int r0 = max(0.0, floor(y0 / cell)), r1 = min(rows - 1.0, floor(y1 / cell));
+    for (int r = r0; r <= r1; r++) memset(&cells[(size_t) r * cols + c0], 1, c1 - c0 + 1);
+  }
+}
+
+/**
+ * Loads the commands of the previous run
+ * @param fileName Archive written by the previous run
+ * @param width Width of the output image
+ * @param height Height of the output image
+ * @param into Receives the commands
+ * @return false if there is no valid archive
+ */
+bool
+load_state(
+  const string& fileName,
+  int width,
+  int height,
+  DrawInfo& into
+) {
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat info;
+  bool loaded = false;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      DrawPlace place;
+      loaded = archive_load((const char*) data, info.st_size, place, width, height, into) && place.identity();
+      munmap(data, info.st_size);
+    }
+  }
+  close(fd);
+  return loaded;
+}
+
+/**
+ * Renders incrementally against the state of the previous run
+ * The previous commands and premultiplied pixels are kept next to the output as
+ * <ouName>.prev.draw and <ouName>.prev.pixels. The longest common prefix and suffix
+ * of the old and new command lists are unchanged; every other command, old or new,
+ * marks the 64 pixel cells its bounding box reaches. Only runs of marked cells are
+ * cleared and redrawn from the new commands that reach them, so the result equals
+ * a full render. An unchanged list leaves an existing output untouched. Without a
+ * usable state, or with a command cairo cannot draw, the whole image is redrawn.
+ * @param antialias Whether antialiasing is enabled
+ * @param width Width of the output image
+ * @param height Height of the output image
+ * @param image Output format and compression level
+ * @param ouName Output filename without extension
+ * @return false if the state cannot be kept, so a normal render is needed
+ */
+bool
+draw_incremental(
+  bool antialias,
+  int width,
+  int height,
+  ImageStream& image,
+  const string& ouName
+) {
+  string drawState = ouName + ".prev.draw", pixelState = ouName + ".prev.pixels";
+  string output = ouName + "." + ImageStream::names[image.format];
+  size_t bytes = sizeof(PixelState) + 4 * (size_t) width * height;
+  int fd = open(pixelState.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) return false;
+
+  // The commands are only valid together with pixels of the same canvas and mode
+  DrawInfo previous;
+  PixelState header;
+  struct stat info;
+  bool valid = fstat(fd, &info) == 0 && (size_t) info.st_size == bytes
+    && pread(fd, &header, sizeof(header), 0) == sizeof(header) && !memcmp(header.magic, pixelMagic, sizeof(pixelMagic))
+    && header.width == width && header.height == height && header.antialias == antialias
+    && load_state(drawState, width, height, previous);
+
+  stats_start("diff");
+  size_t prefix = 0, suffix = 0;
+  if (valid) {
+    size_t common = min(previous.size(), drawinfo.size());
+    while (prefix < common && drawinfo.same(prefix, previous, prefix)) prefix++;
+    while (suffix < common - prefix && drawinfo.same(drawinfo.size() - 1 - suffix, previous, previous.size() - 1 - suffix)) suffix++;
+  }
+  bool verbose = getenv("PFC_VERBOSE");
+  if (valid && prefix == drawinfo.size() && prefix == previous.size() && access(output.c_str(), F_OK) == 0) {
+    if (verbose) fprintf(stderr, "pfc: \033[36m[Render]\033[0m incremental: %zu commands unchanged, nothing redrawn\n", drawinfo.size());
+    stats_stop("diff");
+    close(fd);
+    return true;
+  }
+
+  const int cell = 64;
+  int cols = (width + cell - 1) / cell, rows = (height + cell - 1) / cell;
+  vector<char> cells((size_t) cols * rows, 1);
+  size_t changed = drawinfo.size();
+  if (valid && info_safe(drawinfo) && info_safe(previous)) {
+    vector<char> removed, added;
+    size_t oldEnd = previous.size() - suffix, newEnd = drawinfo.size() - suffix;
+    if (!diff_commands(previous, prefix, oldEnd, drawinfo, prefix, newEnd, 1024, removed, added)) {
+      removed.assign(oldEnd - prefix, 1), added.assign(newEnd - prefix, 1);
+    }
+    fill(cells.begin(), cells.end(), 0);
+    dirty_mark(previous, prefix, removed, cell, cols, cells);
+    dirty_mark(drawinfo, prefix, added, cell, cols, cells);
+    changed = count(removed.begin(), removed.end(), 1) + count(added.begin(), added.end(), 1);
+  }
+  previous = DrawInfo();
+  stats_stop("diff");
+  stats_count("diff", "changed", changed);
+
+  // The old list goes first, so a run that stops early leaves no state behind
+  remove(drawState.c_str());
+  if (!archive_write(drawState + ".next", width, height)) {
+    close(fd);
+    return false;
+  }
+  void *mapped = (ftruncate(fd, bytes) == 0) ? mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (mapped == MAP_FAILED) return false;
+  uint32_t *pixels = (uint32_t*) ((char*) mapped + sizeof(PixelState));
+
+  vector<DrawBatch> batches = draw_batches(antialias, width, height);
+  vector<uint32_t> all(batches.size());
+  for (size_t b = 0; b < batches.size(); b++) all[b] = b;
+  vector<vector<uint32_t>> bins = batch_bins(batches, all, 1, cell, height);
+  int regions = 0;
+  long long area = 0;
+  stats_start("rasterize");
+  for (int r = 0; r < rows; r++) {
+    for (int c = 0, end; c < cols; c = end) {
+      for (end = c; end < cols && cells[(size_t) r * cols + end]; end++);
+      if (end == c) {
+        end++;
+        continue;
+      }
+      int x0 = c * cell, y0 = r * cell, w = min(width, end * cell) - x0, h = min(height, y0 + cell) - y0;
+      draw_region(antialias, pixels + (size_t) y0 * width + x0, width, x0, y0, w, h, batches, bins[r]);
+      regions++, area += (long long) w * h;
+    }
+  }
+  stats_stop("rasterize");
+  stats_count("rasterize", "pixels", area);
+  memcpy(header.magic, pixelMagic, sizeof(pixelMagic));
+  header.width = width, header.height = height, header.antialias = antialias;
+  memset(header.reserved, 0, sizeof(header.reserved));
+  memcpy(mapped, &header, sizeof(header));
+
+  if (verbose) {
+    fprintf(stderr, "pfc: \033[36m[Render]\033[0m incremental: %zu commands changed, %d regions, %.1f%% of the canvas redrawn\n",
+      changed, regions, 100.0 * area / max(1LL, (long long) width * height));
+  }
+
+  // Replace rather than truncate, so hard links to cached images stay intact.
+  remove(output.c_str());
+  stats_start("encode");
+  bool written = image_open(image, output, width, height);
+  if (written) {
+    image_rows(image, (const uint8_t*) pixels, 4 * width, height);
+    written = image_close(image);
+  }
+  stats_stop("encode");
+  if (!written) cout << "Could not write image!" << endl;
+  munmap(mapped, bytes);
+  if (rename((drawState + ".next").c_str(), drawState.c_str()) != 0) remove((drawState + ".next").c_str());
+  return true;
+}
+
+/**
+ * Creates an image with all shapes from DrawInfo
+ * @param width Width of the output image
+ * @param height Height of the output image
+ * @param rows Band height for striped rendering, 0 to render the whole image at once
+ * @param tile Tile size of a Deep Zoom pyramid, 0 for a single image
+ * @param incremental Whether to redraw only what changed since the previous run
+ * @param image Output format and compression level
+ * @param ouName Output filename without extension, "-" for standard output
  */
 void 
 draw(
   bool antialias,
   int width,
   int height,
+  int rows,
+  int tile,
+  bool incremental,
+  ImageStream& image,
   string ouName
 ) {
 
+  if (incremental && tile == 0 && ouName != "-" && draw_incremental(antialias, width, height, image, ouName)) return;
+  vector<DrawBatch> batches = draw_batches(antialias, width, height);
+
+  if (tile > 0) {
+    if (!draw_pyramid(antialias, width, height, tile, batches, image, ouName)) cout << "Could not write pyramid!" << endl;
+    return;
+  }
+
+  // Replace rather than truncate, so hard links to cached images stay intact.
+  if (ouName != "-") {
+    ouName += string(".") + ImageStream::names[image.format];
+    remove(ouName.c_str());
+  }
+  if (!image_open(image, ouName, width, height)) {
+    cout << "Could not write image!" << endl;
+    return;
+  }
+
+  if (rows > 0 && rows < height) {
+    draw_bands(antialias, width, height, rows, batches, image);
+    stats_start("encode");
+    if (!image_close(image)) cout << "Could not write image!" << endl;
+    stats_stop("encode");
+    return;
+  }
+
+  stats_start("rasterize");
   cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
   cairo_t *cr = cairo_create(surface);
 
@@ -229,23 +1455,32 @@ draw(
   if (!antialias) cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
   cairo_fill(cr);
 
-  for (DrawItem item: drawinfo) {
-    if(item.itemName == "line") draw_line(cr, &item);
-    if(item.itemName == "circ") draw_circ(cr, &item);
-    if(item.itemName == "tria") draw_tria(cr, &item);
-    if(item.itemName == "rect") draw_rect(cr, &item);
-  }
+  for (DrawBatch& batch: batches) draw_batch(cr, batch);
+  cairo_surface_flush(surface);
+  stats_stop("rasterize");
 
-  ouName += ".png";
-  cairo_surface_write_to_png(surface, ouName.c_str());
+  stats_start("encode");
+  image_rows(image, cairo_image_surface_get_data(surface), cairo_image_surface_get_stride(surface), height);
+  if (!image_close(image)) cout << "Could not write image!" << endl;
+  stats_stop("encode");
 
   cairo_destroy(cr);
   cairo_surface_destroy(surface);
 }
 
+/**
+ * Images larger than this are rendered in bands of bandBytes unless -b is given
+ */
+const size_t bandLimit = 256 << 20;
+const size_t bandBytes = 64 << 20;
+
 bool antialias;
 int width, height;
+int rows = -1;
+int tile;
+bool incremental;
 string ouName;
+ImageStream image;
 
 int 
 main(
@@ -253,21 +1488,65 @@ main(
   char* argv[]
 ) {
 
-  if (argc < 5) exit(0);
-  width = abs(atoi(argv[1]));
-  height = abs(atoi(argv[2]));
-  ouName = string(argv[3]);
-  antialias = (argv[4][0] == 'a');
+  // pfc-draw <width> <height> <name> <mode> [proxy.so [commands.draw]]
+  //          [-w archive.draw] [-r x y w h] [-b rows] [-f format] [-z level] [-p tile] [-i] [-H]
+  vector<string> args;
+  string archive;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "-w" && i + 1 < argc) {
+      archive = argv[++i];
+    } else if (arg == "-b" && i + 1 < argc) {
+      rows = abs(atoi(argv[++i]));
+    } else if (arg == "-i") {
+      incremental = true;
+    } else if (arg == "-H") {
+      heatmap = true;
+    } else if (arg == "-p" && i + 1 < argc) {
+      tile = max(2, abs(atoi(argv[++i])) & ~1);
+    } else if (arg == "-f" && i + 1 < argc) {
+      image.format = max(0, ImageStream::parse(argv[++i]));
+    } else if (arg == "-z" && i + 1 < argc) {
+      image.level = min(9, abs(atoi(argv[++i])));
+    } else if (arg == "-r" && i + 4 < argc) {
+      drawplace.region = true;
+      drawplace.left = atof(argv[++i]), drawplace.top = atof(argv[++i]);
+      drawplace.width = atof(argv[++i]), drawplace.height = atof(argv[++i]);
+    } else args.push_back(arg);
+  }
+
+  if (args.size() < 4) exit(0);
+  width = abs(stoi(args[0]));
+  height = abs(stoi(args[1]));
+  ouName = args[2];
+  antialias = (args[3][0] == 'a');
 
-  string opt;
-  while (cin >> opt) {
-    drawinfo.push_back((DrawItem) { opt });
-    if (opt == "line") input_line(cin, &drawinfo.back());
-    if (opt == "circ") input_circ(cin, &drawinfo.back());
-    if (opt == "tria") input_tria(cin, &drawinfo.back());
-    if (opt == "rect") input_rect(cin, &drawinfo.back());
+  // A proxy loaded as a shared object runs in this process
+  string phase = (args.size() > 4) ? "execute" : "input";
+  stats_start(phase);
+  if (args.size() > 4) {
+    if (drawplace.region) drawplace.fit(width, height);
+    if (!load_proxy(args[4])) exit(1);
+    if (args.size() > 5) output(args[5]);
+  } else if (!input_archive(width, height)) {
+    if (drawplace.region) drawplace.fit(width, height);
+    string opt;
+    while (cin >> opt) input_item(cin, opt);
+  }
+  if (!archive.empty() && !archive_write(archive, width, height)) cout << "Could not write archive!" << endl;
+  stats_stop(phase);
+  stats_commands(phase);
+  if (drawinfo.clamped && getenv("PFC_VERBOSE")) {
+    fprintf(stderr, "pfc: \033[36m[Render]\033[0m %zu commands had coordinates beyond 21474836 pixels, clamped on each axis\n", drawinfo.clamped);
   }
 
-  draw(antialias, width, height, ouName);
+  if (rows < 0) rows = ((size_t) width * height * 4 > bandLimit) ? max((size_t) 1, bandBytes / (4 * (size_t) width)) : 0;
+  draw(antialias, width, height, rows, tile, incremental, image, ouName);
+  string heatName = (ouName == "-") ? "a.out" : ouName;
+  if (heatName.size() > 4 && heatName.compare(heatName.size() - 4, 4, ".png") == 0) heatName.resize(heatName.size() - 4);
+  if (heatmap && !draw_heatmap(antialias, width, height, heatName + ".heat.png")) {
+    cout << "Could not write heatmap!" << endl;
+  }
+  stats_flush("pfc-draw");
   return 0;
 }
\ No newline at end of file
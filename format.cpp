@@ -33,7 +33,7 @@ bool
 isDrawtype(
   int id
 ) {
-  return (keywords.id("line") <= id) && (id <= keywords.id("rectangle"));
+  return (keywords.id("line") <= id) && (id <= keywords.id("polyline"));
 }
 
 /**
@@ -218,4 +218,84 @@ error_name(
   string name
 ) {
   errorName = name;
-}
\ No newline at end of file
+}
+
+/**
+ * Feeds a string into a 64-bit FNV-1a hash
+ * A separator byte is mixed in after the string, so concatenations do not collide
+ * @param hash Current hash value
+ * @param str String to feed
+ * @return Updated hash value
+ */
+uint64_t
+hash_feed(
+  uint64_t hash,
+  const string& str
+) {
+  for (unsigned char c: str) hash = (hash ^ c) * 1099511628211ULL;
+  return (hash ^ 0xff) * 1099511628211ULL;
+}
+
+/**
+ * Formats a hash value as fixed-width hexadecimal
+ * @param hash Hash value
+ * @return 16-digit hexadecimal string
+ */
+string
+hash_string(
+  uint64_t hash
+) {
+  ostringstream oss; oss << hex << setw(16) << setfill('0') << hash;
+  return oss.str();
+}
+
+/**
+ * Power operator of the proxy prelude, kept bit-identical for the JIT and constant folding
+ * @param n Base
+ * @param k Exponent
+ * @return n to the power of k as float
+ */
+float
+runtime_power(
+  double n,
+  double k
+) {
+  bool neg = false;
+  if (k < 0) neg = true, k = -k;
+  long long ink = k;
+  double ans = std::pow(n, k - (double) ink);
+  while (ink) {
+    if (ink & 1) ans *= n;
+    n *= n;
+    ink >>= 1;
+  }
+  return neg ? (1.0 / ans) : ans;
+}
+
+/**
+ * Bounding box test of a drawing command against the canvas, kept identical to the proxy prelude
+ * Coordinates come in x, y pairs; NaN coordinates are always kept
+ * @param params Coordinate parameters
+ * @param num Number of coordinate parameters
+ * @param pad Extent of the shape beyond its coordinates (half line width, radius)
+ * @param width Canvas width in pixels
+ * @param height Canvas height in pixels
+ * @return false if the shape lies entirely off the canvas
+ */
+bool
+draw_visible(
+  const double *params,
+  int num,
+  double pad,
+  double width,
+  double height
+) {
+  for (int i = 0; i < num; i++) if (params[i] != params[i]) return true;
+  double x0 = params[0], x1 = params[0], y0 = params[1], y1 = params[1];
+  for (int i = 2; i + 1 < num; i += 2) {
+    x0 = fmin(x0, params[i]), x1 = fmax(x1, params[i]);
+    y0 = fmin(y0, params[i + 1]), y1 = fmax(y1, params[i + 1]);
+  }
+  pad += 1;   // Antialiasing and the rounding of the intermediate code
+  return !(x1 < -pad || y1 < -pad || x0 > width + pad || y0 > height + pad);
+}
@@ -7,6 +7,7 @@
 #include <vector>
 #include <string>
 #include <cstring>
+#include <cstdint>
 #include <cstdlib>
 #include <iomanip>
 #include <fstream>
@@ -22,18 +23,18 @@ using namespace std;
  */
 struct Keywords {
   unordered_map<string, int> exist;
-  static constexpr int tokenNum = 36;
+  static constexpr int tokenNum = 42;
   string list[tokenNum] = {
-    "def", "main", "return", "void", "int", "float", "vec", "for", "while", "if", "else",   // Keywords   (typeID  1 ~ 11)
-    "draw", "line", "circle", "triangle", "rectangle",                                      // Keywords   (typeID 12 ~ 16)
-    "+", "-", "*", "/", "^", "<", ">", "=", "<=", ">=", "==", "++", "--", "->",             // Operators  (typeID 17 ~ 30)
-    ",", ";", "(", ")", "{", "}"                                                            // Symbols    (typeID 31 ~ 36)
+    "def", "main", "return", "void", "int", "float", "vec", "len", "for", "pfor", "while", "if", "else",   // Keywords   (typeID  1 ~ 13)
+    "draw", "line", "circle", "triangle", "rectangle", "circles", "polyline",                              // Keywords   (typeID 14 ~ 20)
+    "+", "-", "*", "/", "^", "<", ">", "=", "<=", ">=", "==", "++", "--", "->",                            // Operators  (typeID 21 ~ 34)
+    ",", ";", "(", ")", "{", "}", "[", "]"                                                                 // Symbols    (typeID 35 ~ 42)
   };
 
-  // "[0-9]+"                 Integer     (typeID 37)
-  // "[0-9]+.[0-9]+"          Float       (typeID 38)
-  // "[a-zA-Z_][0-9a-zA-Z_]*" Identifier  (typeID 39)
-  // "$[0-9a-fA-F]{6}"        Color       (typeID 40)
+  // "[0-9]+"                 Integer     (typeID 43)
+  // "[0-9]+.[0-9]+"          Float       (typeID 44)
+  // "[a-zA-Z_][0-9a-zA-Z_]*" Identifier  (typeID 45)
+  // "$[0-9a-fA-F]{6}"        Color       (typeID 46)
 
   /**
    * Initializes the keyword map with all language keywords
@@ -55,10 +56,10 @@ struct Keywords {
     string str
   ) {
     if (exist[str]) return exist[str];
-    else if (str == "integer"   ) return 37;
-    else if (str == "float"     ) return 38;
-    else if (str == "identifier") return 39;
-    else if (str == "color"     ) return 40;
+    else if (str == "integer"   ) return 43;
+    else if (str == "float"     ) return 44;
+    else if (str == "identifier") return 45;
+    else if (str == "color"     ) return 46;
     else return 0;
   }
 };
@@ -87,6 +88,10 @@ FormItem {
   string typeDis;
   int line, column;
   int length, exceed;
+  string valueType;       // C++ type of the value ("int", "float", "double"), empty if unknown
+  bool constant = false;  // Value is known at compile time
+  double value = 0;       // Compile-time value, exact for int and float
+  string runtime;         // Unfolded expression of a folded constant, empty if content is unfolded
 
   /**
    * Default constructor
@@ -202,6 +207,7 @@ VariInfo {
   unordered_map<pair<string, int>, string, PairHash> map;
   //          name <-=====^  ^==--> numLayer
   vector<pair<string, int>> vec;
+  int declared = 0;   // Variables declared so far, including those out of scope
 
   /**
    * Adds a new variable to current scope
@@ -217,6 +223,7 @@ VariInfo {
   ) {
     map[make_pair(name, layer)] = type;
     vec.push_back(make_pair(name, layer));
+    declared++;
   }
 
   /**
@@ -236,6 +243,40 @@ VariInfo {
     return false;
   }
 
+  /**
+   * Gets the type of the innermost visible variable
+   * @param name Variable name
+   * @param layer Scope layer to start from
+   * @return Variable type, empty if undefined
+   */
+  string
+  type(
+    string name,
+    int layer
+  ) {
+    for (int i = layer; i >= 0; i--) {
+      if (map[make_pair(name, i)] != "") return map[make_pair(name, i)];
+    }
+    return "";
+  }
+
+  /**
+   * Gets the scope layer of the innermost visible variable
+   * @param name Variable name
+   * @param layer Scope layer to start from
+   * @return Scope layer, -1 if undefined
+   */
+  int
+  layer(
+    string name,
+    int layer
+  ) {
+    for (int i = layer; i >= 0; i--) {
+      if (map[make_pair(name, i)] != "") return i;
+    }
+    return -1;
+  }
+
   /**
    * Removes all variables from a scope layer
    * @param layer Scope layer to clear
@@ -273,6 +314,14 @@ VariInfo {
   }
 }; 
 
+/**
+ * Function parameter information
+ * Used during function declaration parsing
+ */
+struct ParaItem {
+  string type, paraName;
+};
+
 /**
  * Function declaration management
  * Tracks function signatures and parameter counts
@@ -280,6 +329,13 @@ VariInfo {
 struct
 FuncInfo {
   unordered_map<string, pair<int, bool>> map;
+  unordered_map<string, bool> impure;   // Function draws or calls an impure function
+  unordered_map<string, bool> writes;   // Function may write the elements of an array parameter
+  unordered_map<string, int> cost;      // Static cost estimate of one call
+  unordered_map<string, bool> memo;     // Calls are memoized
+  unordered_map<string, string> type;   // Return type
+  unordered_map<string, vector<ParaItem>> params;
+  unordered_map<string, int> inlineAt;  // Token index of the returned formula of inlinable functions, 0 if none
   vector<string> vec;
 
   /**
@@ -320,6 +376,19 @@ FuncInfo {
     return map[name].first;
   }
 
+  /**
+   * Checks if function is pure
+   * A pure function contains no draw statements, has no array parameters and calls only pure functions
+   * @param name Function name
+   * @return true if function is pure
+   */
+  bool
+  pure(
+    string name
+  ) {
+    return !impure[name];
+  }
+
   /**
    * Displays all defined functions
    * Prints function names and parameter counts
@@ -333,25 +402,351 @@ FuncInfo {
 }; 
 
 /**
- * Drawing command information
- * Stores parameters for various drawing operations
+ * Optimization switches and log
  */
-struct 
-DrawItem {
-  string itemName;      // Type of the shape ("line", "circ", "tria", "rect")
-  double params[7];     // Coordinate parameters as floating point
-  string colorParams;   // Color in hex format (e.g. "ff0000" for red)
+struct
+OptiInfo {
+  bool verbose;                 // Print the optimization log and runtime statistics
+  bool memoize = true;          // Memoize calls of costly pure functions
+  int memoThreshold = 64;       // Minimal static cost of a memoized function
+  int memoSize = 4096;          // Entries in the memo table of each function
+  bool inlining = true;         // Inline calls of single-return functions
+  int inlineThreshold = 32;     // Maximal tokens of an inlined formula
+  int inlineDepth = 4;          // Maximal nesting of inlined calls
+  int inlined;                  // Call sites inlined so far
+  bool fold = true;             // Fold constants and reduce the strength of operators
+  bool cull = true;             // Drop drawing commands that lie entirely off the canvas
+  int canvasWidth = -1;         // Canvas size seen by the culling test, negative if disabled
+  int canvasHeight = -1;
+  bool occlude = true;          // Let pfc-draw drop occluded and repeated commands
+  bool batch = true;            // Let pfc-draw merge same-color fills into one path
+  bool tasks = true;            // Run sibling calls that draw as parallel tasks
+  bool vectorize = true;        // Build element-wise array loops with the vectorizer
+  int taskThreshold = 256;      // Minimal static cost of a callee run as a task
+  bool profile;                 // Build the proxy with per-function and per-line counters
+
+  /**
+   * Disables an optimization by name
+   * @param name Optimization name
+   * @return false if the name is unknown
+   */
+  bool
+  disable(
+    string name
+  ) {
+    if (name == "memo") memoize = false;
+    else if (name == "inline") inlining = false;
+    else if (name == "fold") fold = false;
+    else if (name == "cull") cull = false;
+    else if (name == "occlude") occlude = false;
+    else if (name == "batch") batch = false;
+    else if (name == "tasks") tasks = false;
+    else if (name == "vector") vectorize = false;
+    else return false;
+    return true;
+  }
+
+  /**
+   * Prints a line of the optimization log in verbose mode
+   * @param message Log message
+   */
+  void
+  log(
+    string message
+  ) {
+    if (verbose) cout << "pfc: \033[36m[Optimization]\033[0m " << message << endl;
+  }
 };
-typedef vector<DrawItem> DrawInfo;
 
 /**
- * Function parameter information
- * Used during function declaration parsing
+ * Drawing command kinds, in the order of the draw-type keywords
  */
-struct ParaItem {
-  string type, paraName;
+enum DrawOp : uint8_t { DRAW_LINE, DRAW_CIRC, DRAW_TRIA, DRAW_RECT, DRAW_NONE };
+
+/**
+ * Drawing command storage
+ * Structure of arrays: each command takes an opcode byte, a packed 0xRRGGBB color and
+ * a slot in the coordinate column of its kind. Coordinates are fixed point in 1/100 pixel,
+ * the precision of the text format, so replaying a .draw file is exact within +-21474836 pixels.
+ * Each coordinate beyond that is clamped on its own axis, which moves the point and so
+ * changes slopes and shapes. Such commands are counted in clamped.
+ * Parameters are laid out as in the text format:
+ * line x1 y1 x2 y2 width, circ x y radius, tria x1 y1 x2 y2 x3 y3, rect x1 y1 x2 y2
+ */
+struct
+DrawInfo {
+  static constexpr int paramNum[4] = { 5, 3, 6, 4 };
+  static constexpr const char *names[4] = { "line", "circ", "tria", "rect" };
+  static constexpr int32_t fixedNaN = INT32_MIN;    // Stands for non-finite coordinates
+
+  vector<uint8_t> ops;          // Opcode of each command
+  vector<uint32_t> colors;      // Packed color of each command
+  vector<uint32_t> slots;       // Index into the coordinate column of the command's kind
+  vector<int32_t> coords[4];    // Coordinate columns per kind, paramNum values per slot
+  size_t clamped = 0;           // Commands with a coordinate clamped to the fixed point range
+
+  /**
+   * Gets the opcode of a shape name
+   * @param name Shape name ("line", "circ", "tria", "rect")
+   * @return Opcode, DRAW_NONE if unknown
+   */
+  static uint8_t
+  op(
+    const string& name
+  ) {
+    for (int i = 0; i < 4; i++) if (name == names[i]) return i;
+    return DRAW_NONE;
+  }
+
+  /**
+   * Parses a color in "$rrggbb" format
+   * @param color Color string
+   * @return Packed color
+   */
+  static uint32_t
+  color(
+    const string& color
+  ) {
+    return strtoul(color.c_str() + (color[0] == '$'), NULL, 16) & 0xffffff;
+  }
+
+  /**
+   * Gets the number of commands
+   * @return Number of commands
+   */
+  size_t
+  size() const {
+    return ops.size();
+  }
+
+  /**
+   * Appends a command
+   * Coordinates beyond the fixed point range are clamped to it, non-finite ones stored as NaN
+   * @param op Opcode
+   * @param params Parameters in text format order
+   * @param color Packed color
+   */
+  void
+  push(
+    uint8_t op,
+    const double *params,
+    uint32_t color
+  ) {
+    ops.push_back(op);
+    colors.push_back(color);
+    slots.push_back(coords[op].size() / paramNum[op]);
+    bool outside = false;
+    for (int i = 0; i < paramNum[op]; i++) {
+      double value = nearbyint(params[i] * 100);
+      outside |= isfinite(value) && fabs(value) > INT32_MAX;
+      if (!isfinite(value)) coords[op].push_back(fixedNaN);
+      else coords[op].push_back((int32_t) max((double) -INT32_MAX, min((double) INT32_MAX, value)));
+    }
+    clamped += outside;
+  }
+
+  /**
+   * Gets the fixed point parameters of a command
+   * @param index Command index
+   * @return Pointer to paramNum values in 1/100 pixel
+   */
+  const int32_t*
+  fixed(
+    size_t index
+  ) const {
+    return &coords[ops[index]][(size_t) slots[index] * paramNum[ops[index]]];
+  }
+
+  /**
+   * Reads the parameters of a command
+   * @param index Command index
+   * @param params Receives the parameters in text format order
+   */
+  void
+  params(
+    size_t index,
+    double *params
+  ) const {
+    const int32_t *fixed = this->fixed(index);
+    for (int i = 0; i < paramNum[ops[index]]; i++) params[i] = (fixed[i] == fixedNaN) ? NAN : fixed[i] / 100.0;
+  }
+
+  /**
+   * Appends all commands of another store
+   * @param other Store to append
+   */
+  void
+  append(
+    const DrawInfo& other
+  ) {
+    size_t base = ops.size(), used[4];
+    for (int op = 0; op < 4; op++) used[op] = coords[op].size() / paramNum[op];
+    ops.insert(ops.end(), other.ops.begin(), other.ops.end());
+    colors.insert(colors.end(), other.colors.begin(), other.colors.end());
+    slots.insert(slots.end(), other.slots.begin(), other.slots.end());
+    for (size_t i = base; i < ops.size(); i++) slots[i] += used[ops[i]];
+    for (int op = 0; op < 4; op++) coords[op].insert(coords[op].end(), other.coords[op].begin(), other.coords[op].end());
+    clamped += other.clamped;
+  }
+
+  /**
+   * Checks whether two commands are identical
+   * @param a First command index
+   * @param b Second command index
+   * @return true if kind, color and parameters match
+   */
+  bool
+  same(
+    size_t a,
+    size_t b
+  ) const {
+    return same(a, *this, b);
+  }
+
+  /**
+   * Checks whether a command equals a command of another list
+   * @param a Command index in this list
+   * @param other Other list
+   * @param b Command index in the other list
+   * @return true if kind, color and parameters match
+   */
+  bool
+  same(
+    size_t a,
+    const DrawInfo& other,
+    size_t b
+  ) const {
+    if (ops[a] != other.ops[b] || colors[a] != other.colors[b]) return false;
+    return !memcmp(fixed(a), other.fixed(b), paramNum[ops[a]] * sizeof(int32_t));
+  }
+
+  /**
+   * Removes commands in place, keeping the order of the rest
+   * @param keep Whether each command is kept
+   */
+  void
+  filter(
+    const vector<char>& keep
+  ) {
+    size_t kept = 0, used[4] = { 0, 0, 0, 0 };
+    for (size_t i = 0; i < ops.size(); i++) {
+      if (!keep[i]) continue;
+      uint8_t op = ops[i];
+      int num = paramNum[op];
+      // Slots only move towards the front, so nothing is overwritten before it is read
+      memmove(&coords[op][used[op] * num], &coords[op][(size_t) slots[i] * num], num * sizeof(int32_t));
+      ops[kept] = op, colors[kept] = colors[i], slots[kept] = used[op]++;
+      kept++;
+    }
+    ops.resize(kept), colors.resize(kept), slots.resize(kept);
+    for (int op = 0; op < 4; op++) coords[op].resize(used[op] * paramNum[op]);
+  }
+
+  /**
+   * Gets the memory held by the store
+   * @return Allocated bytes
+   */
+  size_t
+  bytes() const {
+    size_t total = ops.capacity() + colors.capacity() * 4 + slots.capacity() * 4;
+    for (int op = 0; op < 4; op++) total += coords[op].capacity() * 4;
+    return total;
+  }
 };
 
+/**
+ * Placement of replayed commands on the output image
+ * A source point (x, y) is drawn at ((x - left) * scale, (y - top) * scale)
+ */
+struct
+DrawPlace {
+  bool region = false;            // A source region was requested
+  double left = 0, top = 0;       // Source point at the image origin
+  double width = 0, height = 0;   // Size of the source region
+  double scale = 1;               // Image pixels per source pixel
+
+  /**
+   * Fits the source region into the image, keeping the aspect ratio
+   * @param imageWidth Width of the output image
+   * @param imageHeight Height of the output image
+   */
+  void
+  fit(
+    int imageWidth,
+    int imageHeight
+  ) {
+    if (width > 0 && height > 0) scale = min(imageWidth / width, imageHeight / height);
+  }
+
+  /**
+   * Checks whether placing commands changes their coordinates
+   * @return true if source and image coordinates coincide
+   */
+  bool
+  identity() const {
+    return left == 0 && top == 0 && scale == 1;
+  }
+
+  /**
+   * Maps the parameters of a command from source to image coordinates
+   * Widths and radii are scaled, points are moved and scaled
+   * @param op Opcode
+   * @param params Parameters in text format order, updated in place
+   */
+  void
+  apply(
+    uint8_t op,
+    double *params
+  ) const {
+    for (int i = 0; i < DrawInfo::paramNum[op]; i++) {
+      if ((op == DRAW_LINE && i == 4) || (op == DRAW_CIRC && i == 2)) params[i] *= scale;
+      else params[i] = (params[i] - ((i & 1) ? top : left)) * scale;
+    }
+  }
+};
+
+enum ImageFormat { IMAGE_PNG, IMAGE_PPM, IMAGE_PAM, IMAGE_QOI, IMAGE_ARGB };
+
+/**
+ * Incremental image encoder fed with rows of cairo ARGB32 pixels
+ * Formats: png, ppm (RGB over black), pam (RGBA), qoi, argb (cairo's native pixels)
+ */
+struct
+ImageStream {
+  static constexpr const char *names[5] = { "png", "ppm", "pam", "qoi", "argb" };
+  int format = IMAGE_PNG;
+  int level = -1;               // zlib level of PNG output, -1 for the default
+  FILE *file = NULL;
+  int width, height, rows;      // Image size and rows written so far
+  bool started;                 // PNG: the zlib header was written
+  uint32_t adler;               // PNG: checksum of the uncompressed stream
+  vector<uint8_t> prev;         // PNG: previous row, for the Up filter
+  uint32_t qoiIndex[64];        // QOI: recently seen pixels
+  uint32_t qoiLast;             // QOI: previous pixel
+  int qoiRun;                   // QOI: repeats of the previous pixel
+
+  /**
+   * Gets the format with the given name
+   * @param name Format name, which is also the file extension
+   * @return Format, or -1 for an unknown name
+   */
+  static int
+  parse(
+    const string& name
+  ) {
+    for (int i = 0; i < 5; i++) if (name == names[i]) return i;
+    return -1;
+  }
+};
+
+/**
+ * Callback receiving drawing commands from a proxy loaded as a shared object
+ * Arguments: user pointer, shape name, parameters, parameter count, color ("$rrggbb")
+ * Must match the DrawSink type in the proxy prelude
+ */
+typedef void (*DrawSink)(void*, const char*, const double*, int, const char*);
+typedef int (*ProxyEntry)(DrawSink, void*);
+
 bool isType(int);
 bool isNumber(int);
 bool isDrawtype(int);
@@ -368,8 +763,48 @@ void error_line(string, string, string&, int, int, int);
 void error_info(string, string);
 void error_name(string);
 
+const uint64_t HASH_SEED = 14695981039346656037ULL;
+uint64_t hash_feed(uint64_t, const string&);
+string hash_string(uint64_t);
+float runtime_power(double, double);
+bool draw_visible(const double*, int, double, double, double);
+
 void lexicalize(string, string, bool);
+bool check_boarder(int);
+bool check_inline(int, string, int);
+bool fold_constant(string, string&, double&, string, double);
 string& recognize(string, bool);
+bool execute_jit(const string&, string, bool);
+bool profile_report(const string&, const string&, const string&);
+
+bool private_dir(const string&);
+string user_dir();
+string cache_key(bool, int, int, int);
+string cache_stamp(const string&);
+bool cache_fetch(const string&, const string&);
+void cache_store(const string&, const string&, const string&);
+void cache_report();
+
+const char archiveMagic[8] = { 'P', 'F', 'C', 'D', 'R', 'A', 'W', '1' };
+bool archive_write(const string&, int, int);
+bool archive_load(const char*, size_t, DrawPlace&, int, int, DrawInfo&);
+void archive_bounds(uint8_t, const int32_t*, int64_t[4]);
+
+bool image_open(ImageStream&, const string&, int, int);
+void image_rows(ImageStream&, const uint8_t*, int, int);
+bool image_close(ImageStream&);
+void image_halve(const uint32_t*, const uint32_t*, int, uint32_t*);
+
+bool stats_enabled();
+void stats_start(const string&, const char* = NULL);
+void stats_stop(const string&);
+void stats_count(const string&, const string&, long long);
+void stats_flush(const string&);
+void stats_report(const string&, bool);
+bool trace_enabled();
+double trace_clock();
+void trace_span(const string&, const string&, double, const string& = "");
+bool trace_write(const string&, const string&);
 
 // Global variables
 extern Keywords keywords;   // Global keyword manager
@@ -377,5 +812,6 @@ extern LexiInfo lexiinfo;   // Global token storage
 extern VariInfo variinfo;   // Global variable manager
 extern FuncInfo funcinfo;   // Global function manager
 extern DrawInfo drawinfo;   // Global drawing command storage
+extern OptiInfo optiinfo;   // Global optimization switches
 
 #endif
\ No newline at end of file
@@ -0,0 +1,392 @@
+#include "format.hpp"
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Way of rendering a program whose pixels must match the reference
+ */
+struct
+GoldenBackend {
+  string name;
+  string flags;           // pfc options selecting the backend
+};
+
+/**
+ * Backends known to the harness. The reference is the plain cairo path, with
+ * every optimization off and the image drawn in one piece.
+ */
+const vector<GoldenBackend> goldenBackends = {
+  { "reference", "-N memo -N inline -N fold -N cull -N occlude -N batch -N tasks -b 0" },
+  { "default", "" },
+  { "jit", "-j" },
+  { "shared", "-m" },
+  { "bands", "-b 37" },
+  { "archive", "-D" },
+};
+
+/**
+ * Result of comparing two ARGB buffers
+ */
+struct
+GoldenDiff {
+  long long differ = 0;   // Pixels that are not identical
+  long long beyond = 0;   // Pixels with a channel off by more than the tolerance
+  int most = 0;           // Largest channel difference
+};
+
+/**
+ * Compares two buffers of cairo ARGB32 pixels
+ * Four pixels are compared per step: identical blocks are skipped at once, and
+ * otherwise the channel differences come from two saturating subtractions.
+ * @param expected Expected pixels
+ * @param actual Rendered pixels
+ * @param count Number of pixels
+ * @param tolerance Largest channel difference still accepted
+ * @param delta Receives the largest channel difference of every pixel, NULL if not needed
+ * @return Counts of differing pixels
+ */
+GoldenDiff
+golden_compare(
+  const uint32_t *expected,
+  const uint32_t *actual,
+  size_t count,
+  int tolerance,
+  uint8_t *delta
+) {
+  GoldenDiff diff;
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128(), limit = _mm_set1_epi8((char) tolerance);
+  for (; i + 4 <= count; i += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i*) (expected + i)), b = _mm_loadu_si128((const __m128i*) (actual + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, b)) == 0xffff) {
+      if (delta) memset(delta + i, 0, 4);
+      continue;
+    }
+    __m128i channel = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+    int same = _mm_movemask_epi8(_mm_cmpeq_epi32(channel, zero));
+    int inside = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_subs_epu8(channel, limit), zero));
+    diff.differ += 4 - __builtin_popcount(same) / 4;
+    diff.beyond += 4 - __builtin_popcount(inside) / 4;
+    uint8_t bytes[16];
+    _mm_storeu_si128((__m128i*) bytes, channel);
+    for (int k = 0; k < 4; k++) {
+      int largest = max(max(bytes[4 * k], bytes[4 * k + 1]), max(bytes[4 * k + 2], bytes[4 * k + 3]));
+      diff.most = max(diff.most, largest);
+      if (delta) delta[i + k] = largest;
+    }
+  }
+#endif
+  for (; i < count; i++) {
+    int largest = 0;
+    for (int k = 0; k < 32; k += 8) largest = max(largest, abs((int) ((expected[i] >> k) & 0xff) - (int) ((actual[i] >> k) & 0xff)));
+    diff.differ += largest > 0;
+    diff.beyond += largest > tolerance;
+    diff.most = max(diff.most, largest);
+    if (delta) delta[i] = largest;
+  }
+  return diff;
+}
+
+/**
+ * Writes a diff image as PNG
+ * Matching pixels show the expected image dimmed to grey, pixels within the
+ * tolerance are yellow and pixels beyond it red, brighter for larger differences.
+ * @param fileName PNG file
+ * @param expected Expected pixels
+ * @param delta Largest channel difference of every pixel
+ * @param width Image width
+ * @param height Image height
+ * @param tolerance Largest channel difference still accepted
+ * @return false if the image cannot be written
+ */
+bool
+golden_diff_image(
+  const string& fileName,
+  const vector<uint32_t>& expected,
+  const vector<uint8_t>& delta,
+  int width,
+  int height,
+  int tolerance
+) {
+  vector<uint32_t> pixels(expected.size());
+  for (size_t i = 0; i < pixels.size(); i++) {
+    uint32_t p = expected[i];
+    uint32_t grey = (((p >> 16) & 0xff) * 77 + ((p >> 8) & 0xff) * 150 + (p & 0xff) * 29) >> 9;
+    uint32_t bright = 128 + delta[i] / 2;
+    if (!delta[i]) pixels[i] = 0xff000000 | (grey << 16) | (grey << 8) | grey;
+    else if (delta[i] <= tolerance) pixels[i] = 0xff000000 | (bright << 16) | (bright << 8);
+    else pixels[i] = 0xff000000 | (bright << 16);
+  }
+  ImageStream image;
+  if (!image_open(image, fileName, width, height)) return false;
+  image_rows(image, (const uint8_t*) pixels.data(), 4 * width, height);
+  return image_close(image);
+}
+
+/**
+ * Reads the item counts of the proxy or JIT execute phase from a PFC_STATS file
+ * @param fileName Phase file, as written by stats_flush and the proxy
+ * @param counts Receives item counts summed over the execute rows
+ * @return false if no process reported an execute phase
+ */
+bool
+golden_stats(
+  const string& fileName,
+  map<string, long long>& counts
+) {
+  fstream file(fileName, ios::in);
+  string line;
+  bool found = false;
+  while (getline(file, line)) {
+    // process, phase, begin, wall, cpu, rss and item=count pairs
+    istringstream fields(line);
+    string process, phase, item;
+    getline(fields, process, '\t');
+    getline(fields, phase, '\t');
+    // pfc-draw runs shared objects in an execute phase of its own, without memo counts
+    if (phase != "execute" || process == "pfc-draw") continue;
+    for (int i = 0; i < 4; i++) getline(fields, item, '\t');
+    found = true;
+    while (fields >> item) {
+      size_t equal = item.find('=');
+      if (equal != string::npos) counts[item.substr(0, equal)] += atoll(item.c_str() + equal + 1);
+    }
+  }
+  return found;
+}
+
+/**
+ * Renders a program as raw ARGB pixels through pfc
+ * @param source Program
+ * @param backend Backend to render with
+ * @param width Image width
+ * @param height Image height
+ * @param flags Options given to every backend
+ * @param base Output name without extension
+ * @param pixels Receives the pixels
+ * @param counts Receives the item counts of the execute phase, empty if none was reported
+ * @return false if pfc did not write a complete image
+ */
+bool
+golden_render(
+  const string& source,
+  const GoldenBackend& backend,
+  int width,
+  int height,
+  const string& flags,
+  const string& base,
+  vector<uint32_t>& pixels,
+  map<string, long long>& counts
+) {
+  string command = "PFC_STATS=" + base + ".stats pfc " + backend.flags + " " + flags + " -f argb -s " + to_string(width) + " " + to_string(height)
+    + " -o " + base + " " + source + " > " + base + ".log 2>&1";
+  system(command.c_str());
+  fstream file(base + ".argb", ios::in | ios::binary);
+  pixels.assign((size_t) width * height, 0);
+  bool complete = file.is_open() && file.read((char*) pixels.data(), 4 * pixels.size()).gcount() == (streamsize) (4 * pixels.size());
+  file.close();
+  remove((base + ".argb").c_str());
+  remove((base + ".draw").c_str());
+  counts.clear();
+  golden_stats(base + ".stats", counts);
+  remove((base + ".stats").c_str());
+  if (complete) remove((base + ".log").c_str());
+  return complete;
+}
+
+/**
+ * Checks the execute statistics of a render against those of another backend
+ * Every backend runs the program once, so drawn and culled primitives add up to the
+ * same total. Memo lookups are reported next to them, and none without memoization.
+ * @param counts Execute items of the render, empty if it reported none
+ * @param baseline Execute items of the first render of the program that reported them
+ * @param memo Whether the backend memoizes
+ * @return Failure description, empty if the statistics are consistent
+ */
+string
+golden_check_stats(
+  map<string, long long>& counts,
+  map<string, long long>& baseline,
+  bool memo
+) {
+  if (counts.empty()) return "";
+  if (!counts.count("memo_hits") || !counts.count("memo_misses")) return "execute stats lack memo_hits and memo_misses";
+  if (!memo && counts["memo_hits"] + counts["memo_misses"]) return "memo lookups reported with memoization off";
+  long long total = counts["line"] + counts["circ"] + counts["tria"] + counts["rect"] + counts["culled"];
+  long long expected = baseline["line"] + baseline["circ"] + baseline["tria"] + baseline["rect"] + baseline["culled"];
+  if (total != expected) return "execute stats count " + to_string(total) + " primitives instead of " + to_string(expected);
+  return "";
+}
+
+/**
+ * Gets the name of a program without directory and extension
+ * @param source Program path
+ * @return Stem
+ */
+string
+golden_stem(
+  const string& source
+) {
+  string stem = source.substr(source.find_last_of('/') + 1);
+  return stem.substr(0, stem.rfind(".pf") == string::npos ? stem.size() : stem.rfind(".pf"));
+}
+
+/**
+ * Golden-image regression harness
+ * Renders every program of the corpus through the reference and the selected
+ * backends, and compares the pixels. With -g, reference images are kept as
+ * golden files and later runs compare against them; -u rewrites them.
+ * Usage: pfc-golden [-g dir] [-u] [-b backend,...] [-t tolerance] [-s width height] [-a] [-j jobs] [-o dir] file.pf...
+ */
+int
+main(
+  int argc,
+  char* argv[]
+) {
+  string goldenDir, diffDir = ".", flags, chosen;
+  bool update = false;
+  int tolerance = 0, width = 600, height = 600;
+  int jobs = max(1u, thread::hardware_concurrency());
+  vector<string> sources;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "-g" && i + 1 < argc) goldenDir = argv[++i];
+    else if (arg == "-u") update = true;
+    else if (arg == "-b" && i + 1 < argc) chosen = argv[++i];
+    else if (arg == "-t" && i + 1 < argc) tolerance = min(255, abs(atoi(argv[++i])));
+    else if (arg == "-s" && i + 2 < argc) width = max(1, abs(atoi(argv[++i]))), height = max(1, abs(atoi(argv[++i])));
+    else if (arg == "-a") flags += " -a";
+    else if (arg == "-j" && i + 1 < argc) jobs = max(1, atoi(argv[++i]));
+    else if (arg == "-o" && i + 1 < argc) diffDir = argv[++i];
+    else sources.push_back(arg);
+  }
+  if (sources.empty()) {
+    cerr << "Usage: pfc-golden [-g dir] [-u] [-b backend,...] [-t tolerance] [-s width height] [-a] [-j jobs] [-o dir] file.pf..." << endl;
+    cerr << "Backends:";
+    for (const GoldenBackend& backend: goldenBackends) cerr << " " << backend.name;
+    cerr << endl;
+    return 2;
+  }
+
+  vector<GoldenBackend> backends;
+  for (size_t i = 1; i < goldenBackends.size(); i++) {
+    if (chosen.empty() || ("," + chosen + ",").find("," + goldenBackends[i].name + ",") != string::npos) backends.push_back(goldenBackends[i]);
+  }
+  if (backends.empty()) {
+    cerr << "pfc-golden: no known backend in " << chosen << endl;
+    return 2;
+  }
+  if (!goldenDir.empty()) mkdir(goldenDir.c_str(), 0755);
+  mkdir(diffDir.c_str(), 0755);
+  string workDir = "/tmp/pfc_golden_" + to_string(getpid());
+  mkdir(workDir.c_str(), 0755);
+
+  // Expected images, from the golden files or rendered with the reference backend
+  vector<vector<uint32_t>> expected(sources.size());
+  vector<char> ready(sources.size());   // Not vector<bool>, whose packed bits would race between workers
+  vector<vector<map<string, long long>>> counts(sources.size(), vector<map<string, long long>>(backends.size() + 1));
+  mutex printLock;
+  atomic<size_t> next(0);
+  vector<thread> workers;
+  for (int t = 0; t < jobs; t++) {
+    workers.push_back(thread([&]() {
+      for (size_t i; (i = next++) < sources.size(); ) {
+        string size = to_string(width) + "x" + to_string(height) + (flags.empty() ? "" : "a");
+        string goldenName = goldenDir + "/" + golden_stem(sources[i]) + "." + size + ".argb";
+        if (!goldenDir.empty() && !update) {
+          fstream golden(goldenName, ios::in | ios::binary);
+          expected[i].assign((size_t) width * height, 0);
+          if (golden.is_open() && golden.read((char*) expected[i].data(), 4 * expected[i].size()).gcount() == (streamsize) (4 * expected[i].size())) {
+            ready[i] = true;
+            continue;
+          }
+        }
+        string base = workDir + "/" + to_string(i) + ".reference";
+        ready[i] = golden_render(sources[i], goldenBackends[0], width, height, flags, base, expected[i], counts[i][0]);
+        lock_guard<mutex> guard(printLock);
+        if (!ready[i]) {
+          cout << "pfc-golden: \033[31mcannot render\033[0m " << sources[i] << " with reference, see " << base << ".log" << endl;
+        } else if (!goldenDir.empty()) {
+          fstream golden(goldenName, ios::out | ios::trunc | ios::binary);
+          golden.write((const char*) expected[i].data(), 4 * expected[i].size());
+          cout << "pfc-golden: wrote " << goldenName << endl;
+        }
+      }
+    }));
+  }
+  for (thread& worker: workers) worker.join();
+
+  // Every program and backend pair renders and compares independently
+  atomic<int> passed(0), failed(0);
+  next = 0;
+  workers.clear();
+  size_t tasks = sources.size() * backends.size();
+  for (int t = 0; t < jobs; t++) {
+    workers.push_back(thread([&]() {
+      for (size_t task; (task = next++) < tasks; ) {
+        size_t i = task / backends.size(), b = task % backends.size();
+        const GoldenBackend& backend = backends[b];
+        if (!ready[i]) continue;
+        string base = workDir + "/" + to_string(i) + "." + backend.name;
+        vector<uint32_t> actual;
+        if (!golden_render(sources[i], backend, width, height, flags, base, actual, counts[i][b + 1])) {
+          failed++;
+          lock_guard<mutex> guard(printLock);
+          cout << "pfc-golden: \033[31mFAIL\033[0m " << sources[i] << " [" << backend.name << "]: no image, see " << base << ".log" << endl;
+          continue;
+        }
+        vector<uint8_t> delta(actual.size());
+        GoldenDiff diff = golden_compare(expected[i].data(), actual.data(), actual.size(), tolerance, delta.data());
+        string diffName = diffDir + "/" + golden_stem(sources[i]) + "." + backend.name + ".diff.png";
+        if (diff.beyond) {
+          golden_diff_image(diffName, expected[i], delta, width, height, tolerance);
+          failed++;
+        } else {
+          remove(diffName.c_str());
+          passed++;
+        }
+        lock_guard<mutex> guard(printLock);
+        if (diff.beyond) {
+          size_t first = 0;
+          while (delta[first] <= tolerance) first++;
+          cout << "pfc-golden: \033[31mFAIL\033[0m " << sources[i] << " [" << backend.name << "]: " << diff.beyond << " pixels off by up to "
+            << diff.most << ", first at " << first % width << "," << first / width << ", see " << diffName << endl;
+        } else if (diff.differ) {
+          cout << "pfc-golden: \033[32mok\033[0m   " << sources[i] << " [" << backend.name << "]: " << diff.differ << " pixels within " << tolerance << endl;
+        } else {
+          cout << "pfc-golden: \033[32mok\033[0m   " << sources[i] << " [" << backend.name << "]" << endl;
+        }
+      }
+    }));
+  }
+  for (thread& worker: workers) worker.join();
+  rmdir(workDir.c_str());
+
+  // Statistics are compared once every backend of a program has rendered
+  for (size_t i = 0; i < sources.size(); i++) {
+    size_t first = 0;
+    while (first < counts[i].size() && counts[i][first].empty()) first++;
+    if (first == counts[i].size()) continue;
+    for (size_t b = 0; b < counts[i].size(); b++) {
+      const GoldenBackend& backend = b ? backends[b - 1] : goldenBackends[0];
+      string problem = golden_check_stats(counts[i][b], counts[i][first], backend.flags.find("-N memo") == string::npos);
+      if (problem.empty()) continue;
+      failed++;
+      cout << "pfc-golden: \033[31mFAIL\033[0m " << sources[i] << " [" << backend.name << "]: " << problem << endl;
+    }
+  }
+
+  int missing = count(ready.begin(), ready.end(), 0);
+  cout << "pfc-golden: " << passed << " passed, " << failed << " failed";
+  if (missing) cout << ", " << missing << " programs without a reference";
+  cout << endl;
+  return (failed || missing) ? 1 : 0;
+}
@@ -0,0 +1,371 @@
+#include "format.hpp"
+#include <thread>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Converts a row of cairo ARGB32 pixels to straight RGBA bytes
+ * Colors are unpremultiplied with rounding, the way cairo writes PNG files.
+ * @param pixel First pixel of the row
+ * @param width Number of pixels
+ * @param rgba Receives 4 bytes per pixel
+ */
+void
+image_unpremultiply(
+  const uint32_t *pixel,
+  int width,
+  uint8_t *rgba
+) {
+  for (int x = 0; x < width; x++, rgba += 4) {
+    uint32_t a = pixel[x] >> 24, r = (pixel[x] >> 16) & 0xff, g = (pixel[x] >> 8) & 0xff, b = pixel[x] & 0xff;
+    if (a == 0) {
+      rgba[0] = rgba[1] = rgba[2] = rgba[3] = 0;
+    } else {
+      rgba[0] = (r * 255 + a / 2) / a, rgba[1] = (g * 255 + a / 2) / a;
+      rgba[2] = (b * 255 + a / 2) / a, rgba[3] = a;
+    }
+  }
+}
+
+/**
+ * Halves two rows of cairo ARGB32 pixels into one with a 2x2 box filter
+ * Each output channel is the rounded mean (a + b + c + d + 2) / 4 of premultiplied
+ * values. An odd last column is paired with itself.
+ * @param top Upper source row
+ * @param bottom Lower source row, the upper one again for an odd last row
+ * @param width Number of source pixels
+ * @param out Receives (width + 1) / 2 pixels
+ */
+void
+image_halve(
+  const uint32_t *top,
+  const uint32_t *bottom,
+  int width,
+  uint32_t *out
+) {
+  int x = 0;
+#ifdef __SSE2__
+  // Four source pixels of both rows become two output pixels per step
+  const __m128i zero = _mm_setzero_si128(), two = _mm_set1_epi16(2);
+  for (; x + 4 <= width; x += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i*) (top + x)), b = _mm_loadu_si128((const __m128i*) (bottom + x));
+    __m128i low = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+    __m128i high = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+    low = _mm_add_epi16(low, _mm_srli_si128(low, 8));
+    high = _mm_add_epi16(high, _mm_srli_si128(high, 8));
+    __m128i sum = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(low, high), two), 2);
+    _mm_storel_epi64((__m128i*) (out + x / 2), _mm_packus_epi16(sum, zero));
+  }
+#endif
+  for (; x < width; x += 2) {
+    int next = min(x + 1, width - 1);
+    uint32_t pixel = 0;
+    for (int k = 0; k < 32; k += 8) {
+      uint32_t sum = ((top[x] >> k) & 0xff) + ((top[next] >> k) & 0xff) + ((bottom[x] >> k) & 0xff) + ((bottom[next] >> k) & 0xff);
+      pixel |= ((sum + 2) >> 2) << k;
+    }
+    out[x / 2] = pixel;
+  }
+}
+
+/**
+ * Writes one PNG chunk with its length and checksum
+ * @param file Output file
+ * @param type Four-letter chunk type
+ * @param data Chunk contents
+ * @param size Size of the contents in bytes
+ */
+void
+png_chunk(
+  FILE *file,
+  const char *type,
+  const uint8_t *data,
+  size_t size
+) {
+  uint8_t length[4] = { (uint8_t) (size >> 24), (uint8_t) (size >> 16), (uint8_t) (size >> 8), (uint8_t) size };
+  uLong crc = crc32(crc32(0, NULL, 0), (const Bytef*) type, 4);
+  if (size) crc = crc32(crc, data, size);
+  uint8_t check[4] = { (uint8_t) (crc >> 24), (uint8_t) (crc >> 16), (uint8_t) (crc >> 8), (uint8_t) crc };
+  fwrite(length, 1, 4, file);
+  fwrite(type, 1, 4, file);
+  if (size) fwrite(data, 1, size, file);
+  fwrite(check, 1, 4, file);
+}
+
+/**
+ * Compresses rows of an image into one PNG segment
+ * Segments are raw deflate streams ending on a byte boundary after a sync flush,
+ * so independently compressed segments concatenate into one valid stream.
+ * @param image Encoder state
+ * @param data First pixel of the first row of the block
+ * @param stride Bytes between rows
+ * @param first First row of the segment within the block
+ * @param last Row after the segment
+ * @param packed Receives the compressed segment
+ * @param adler Receives the Adler-32 checksum of the filtered rows
+ */
+void
+png_segment(
+  const ImageStream& image,
+  const uint8_t *data,
+  int stride,
+  int first,
+  int last,
+  vector<uint8_t>& packed,
+  uint32_t& adler
+) {
+  size_t rowBytes = 4 * (size_t) image.width;
+  vector<uint8_t> prev(rowBytes), cur(rowBytes), line(rowBytes + 1);
+  if (first == 0) prev = image.prev;
+  else image_unpremultiply((const uint32_t*) (data + (size_t) (first - 1) * stride), image.width, prev.data());
+
+  z_stream zs = z_stream();
+  deflateInit2(&zs, image.level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+  packed.resize(deflateBound(&zs, (last - first) * (rowBytes + 1)) + 64);
+  zs.next_out = packed.data();
+  zs.avail_out = packed.size();
+  adler = adler32(0, NULL, 0);
+  for (int y = first; y < last; y++) {
+    image_unpremultiply((const uint32_t*) (data + (size_t) y * stride), image.width, cur.data());
+    line[0] = 2;    // Up filter
+    for (size_t i = 0; i < rowBytes; i++) line[i + 1] = cur[i] - prev[i];
+    adler = adler32(adler, line.data(), line.size());
+    zs.next_in = line.data();
+    zs.avail_in = line.size();
+    deflate(&zs, Z_NO_FLUSH);
+    swap(prev, cur);
+  }
+  deflate(&zs, Z_SYNC_FLUSH);
+  packed.resize(packed.size() - zs.avail_out);
+  deflateEnd(&zs);
+}
+
+/**
+ * Compresses a block of rows on all cores and appends it to the PNG stream
+ * @param image Encoder state
+ * @param data First pixel of the first row
+ * @param stride Bytes between rows
+ * @param count Number of rows
+ */
+void
+png_rows(
+  ImageStream& image,
+  const uint8_t *data,
+  int stride,
+  int count
+) {
+  size_t rowBytes = 4 * (size_t) image.width + 1;
+  int per = max((size_t) 1, ((size_t) 1 << 20) / rowBytes);    // About 1 MiB of rows per segment
+  int segments = (count + per - 1) / per;
+  vector<vector<uint8_t>> packed(segments);
+  vector<uint32_t> adlers(segments);
+  int threads = max(1u, min(thread::hardware_concurrency(), (unsigned) segments));
+  vector<thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.push_back(thread([&, t]() {
+      for (int s = t; s < segments; s += threads) {
+        double start = trace_clock();
+        png_segment(image, data, stride, s * per, min(count, (s + 1) * per), packed[s], adlers[s]);
+        trace_span("deflate", "encode", start, "\"rows\": " + to_string(min(count, (s + 1) * per) - s * per));
+      }
+    }));
+  }
+  for (thread& worker: workers) worker.join();
+
+  for (int s = 0; s < segments; s++) {
+    if (!image.started) {
+      const uint8_t header[2] = { 0x78, 0x01 };    // zlib header, 32 KiB window
+      packed[s].insert(packed[s].begin(), header, header + 2);
+      image.started = true;
+    }
+    png_chunk(image.file, "IDAT", packed[s].data(), packed[s].size());
+    size_t length = (size_t) (min(count, (s + 1) * per) - s * per) * rowBytes;
+    image.adler = adler32_combine(image.adler, adlers[s], length);
+  }
+  image_unpremultiply((const uint32_t*) (data + (size_t) (count - 1) * stride), image.width, image.prev.data());
+}
+
+/**
+ * Appends rows to a QOI stream
+ * @param image Encoder state
+ * @param data First pixel of the first row
+ * @param stride Bytes between rows
+ * @param count Number of rows
+ */
+void
+qoi_rows(
+  ImageStream& image,
+  const uint8_t *data,
+  int stride,
+  int count
+) {
+  vector<uint8_t> rgba(4 * (size_t) image.width), out;
+  out.reserve(5 * (size_t) image.width + 1);
+  for (int y = 0; y < count; y++) {
+    image_unpremultiply((const uint32_t*) (data + (size_t) y * stride), image.width, rgba.data());
+    out.clear();
+    for (int x = 0; x < image.width; x++) {
+      const uint8_t *p = &rgba[4 * x];
+      uint32_t pixel = (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+      if (pixel == image.qoiLast) {
+        if (++image.qoiRun == 62) out.push_back(0xc0 | 61), image.qoiRun = 0;
+        continue;
+      }
+      if (image.qoiRun) out.push_back(0xc0 | (image.qoiRun - 1)), image.qoiRun = 0;
+
+      int hash = (p[0] * 3 + p[1] * 5 + p[2] * 7 + p[3] * 11) % 64;
+      uint32_t last = image.qoiLast;
+      image.qoiLast = pixel;
+      if (image.qoiIndex[hash] == pixel) {
+        out.push_back(hash);
+        continue;
+      }
+      image.qoiIndex[hash] = pixel;
+      if ((last & 0xff) != p[3]) {
+        out.insert(out.end(), { 0xff, p[0], p[1], p[2], p[3] });
+        continue;
+      }
+      int8_t dr = p[0] - (last >> 24), dg = p[1] - ((last >> 16) & 0xff), db = p[2] - ((last >> 8) & 0xff);
+      int8_t drg = dr - dg, dbg = db - dg;
+      if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+        out.push_back(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+      } else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+        out.push_back(0x80 | (dg + 32));
+        out.push_back((drg + 8) << 4 | (dbg + 8));
+      } else {
+        out.insert(out.end(), { 0xfe, p[0], p[1], p[2] });
+      }
+    }
+    fwrite(out.data(), 1, out.size(), image.file);
+  }
+}
+
+/**
+ * Starts an image file that is filled row by row
+ * The format comes from the stream, so images larger than memory can be written
+ * in bands. The file name "-" writes to standard output.
+ * @param image Encoder state with format and level set
+ * @param fileName Output path
+ * @param width Image width in pixels
+ * @param height Image height in pixels
+ * @return false if the file cannot be created
+ */
+bool
+image_open(
+  ImageStream& image,
+  const string& fileName,
+  int width,
+  int height
+) {
+  image.file = (fileName == "-") ? stdout : fopen(fileName.c_str(), "wb");
+  if (!image.file) return false;
+  image.width = width, image.height = height, image.rows = 0;
+
+  if (image.format == IMAGE_PNG) {
+    image.prev.assign(4 * (size_t) width, 0);
+    image.adler = adler32(0, NULL, 0);
+    image.started = false;
+    const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    uint8_t header[13] = {
+      (uint8_t) (width >> 24), (uint8_t) (width >> 16), (uint8_t) (width >> 8), (uint8_t) width,
+      (uint8_t) (height >> 24), (uint8_t) (height >> 16), (uint8_t) (height >> 8), (uint8_t) height,
+      8, 6, 0, 0, 0     // 8-bit RGBA, deflate, adaptive filtering, no interlace
+    };
+    fwrite(signature, 1, 8, image.file);
+    png_chunk(image.file, "IHDR", header, sizeof(header));
+  }
+  if (image.format == IMAGE_PPM) fprintf(image.file, "P6\n%d %d\n255\n", width, height);
+  if (image.format == IMAGE_PAM) {
+    fprintf(image.file, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", width, height);
+  }
+  if (image.format == IMAGE_QOI) {
+    memset(image.qoiIndex, 0, sizeof(image.qoiIndex));
+    image.qoiLast = 0x000000ff, image.qoiRun = 0;
+    uint8_t header[14] = {
+      'q', 'o', 'i', 'f',
+      (uint8_t) (width >> 24), (uint8_t) (width >> 16), (uint8_t) (width >> 8), (uint8_t) width,
+      (uint8_t) (height >> 24), (uint8_t) (height >> 16), (uint8_t) (height >> 8), (uint8_t) height,
+      4, 0              // RGBA, sRGB
+    };
+    fwrite(header, 1, sizeof(header), image.file);
+  }
+  return true;
+}
+
+/**
+ * Appends rows of a cairo ARGB32 image to the output
+ * Rows beyond the image height are ignored.
+ * @param image Encoder state
+ * @param data First pixel of the first row
+ * @param stride Bytes between rows
+ * @param count Number of rows
+ */
+void
+image_rows(
+  ImageStream& image,
+  const uint8_t *data,
+  int stride,
+  int count
+) {
+  count = min(count, image.height - image.rows);
+  if (count <= 0) return;
+  image.rows += count;
+
+  if (image.format == IMAGE_PNG) png_rows(image, data, stride, count);
+  if (image.format == IMAGE_QOI) qoi_rows(image, data, stride, count);
+  if (image.format == IMAGE_PPM || image.format == IMAGE_PAM) {
+    // PPM has no alpha channel, so it keeps the colors composited over black
+    vector<uint8_t> rgba(4 * (size_t) image.width);
+    for (int y = 0; y < count; y++) {
+      const uint32_t *pixel = (const uint32_t*) (data + (size_t) y * stride);
+      if (image.format == IMAGE_PAM) {
+        image_unpremultiply(pixel, image.width, rgba.data());
+        fwrite(rgba.data(), 4, image.width, image.file);
+        continue;
+      }
+      for (int x = 0; x < image.width; x++) {
+        rgba[3 * x] = pixel[x] >> 16, rgba[3 * x + 1] = pixel[x] >> 8, rgba[3 * x + 2] = pixel[x];
+      }
+      fwrite(rgba.data(), 3, image.width, image.file);
+    }
+  }
+  if (image.format == IMAGE_ARGB) {
+    for (int y = 0; y < count; y++) fwrite(data + (size_t) y * stride, 4, image.width, image.file);
+  }
+}
+
+/**
+ * Finishes the image, padding missing rows with transparent pixels
+ * @param image Encoder state
+ * @return true if the whole file was written
+ */
+bool
+image_close(
+  ImageStream& image
+) {
+  vector<uint8_t> blank(4 * (size_t) image.width, 0);
+  while (image.rows < image.height) image_rows(image, blank.data(), 0, 1);
+
+  if (image.format == IMAGE_PNG) {
+    // Header if no row was written, an empty final stored block, then the checksum
+    vector<uint8_t> tail;
+    if (!image.started) tail.insert(tail.end(), { 0x78, 0x01 });
+    uint32_t adler = image.adler;
+    tail.insert(tail.end(), { 0x01, 0x00, 0x00, 0xff, 0xff });
+    tail.insert(tail.end(), { (uint8_t) (adler >> 24), (uint8_t) (adler >> 16), (uint8_t) (adler >> 8), (uint8_t) adler });
+    png_chunk(image.file, "IDAT", tail.data(), tail.size());
+    png_chunk(image.file, "IEND", NULL, 0);
+  }
+  if (image.format == IMAGE_QOI) {
+    if (image.qoiRun) fputc(0xc0 | (image.qoiRun - 1), image.file);
+    const uint8_t end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    fwrite(end, 1, 8, image.file);
+  }
+
+  bool written = !ferror(image.file);
+  if (image.file == stdout) return fflush(stdout) == 0 && written;
+  if (fclose(image.file) != 0) written = false;
+  return written;
+}
@@ -0,0 +1,1360 @@
+#include "format.hpp"
+#include <deque>
+#include <map>
+#include <sys/mman.h>
+
+/**
+ * In-memory x86-64 JIT backend
+ * Lowers the token stream straight to machine code in one pass, mirroring recognize().
+ * Values follow the C++ semantics of the proxy: int (eax), float (xmm0, single) and
+ * double (xmm0, double, from float literals and draw casts).
+ *
+ * Register usage:
+ *   eax / xmm0   accumulator holding the value of the last expression
+ *   ecx / xmm1   left operand popped from the stack by binary operators
+ *   rbp          frame pointer, locals at [rbp - 8k], parameters at [rbp + 16 + 8k]
+ *   rbx          saves rsp while calling C helpers on a 16-byte aligned stack
+ */
+
+enum { JIT_VOID, JIT_INT, JIT_FLT, JIT_DBL };
+
+/**
+ * Thrown when the program uses something the JIT does not lower
+ * The caller falls back to the g++ proxy, which reports what g++ would
+ */
+struct
+JitDecline {
+  string reason;
+};
+
+/**
+ * Local variable or parameter of the function being compiled
+ */
+struct
+JitVari {
+  string name;
+  int offset;   // Displacement from rbp
+  int kind;
+};
+
+/**
+ * Compiled function signature and position in the code buffer
+ */
+struct
+JitFunc {
+  int offset;
+  int kind;
+  vector<int> params;
+  int memo;     // Index of the memo table, -1 if calls are not memoized
+};
+
+/**
+ * Constant most recently loaded into the accumulator
+ * Its code can be replaced while nothing has been emitted after it (end equals the code position)
+ */
+struct
+JitConst {
+  int start, end;
+  int kind;
+  double value;
+};
+
+/**
+ * Bounded memo table of a pure function
+ * Keys are the low 32 bits of the parameter slots, which hold the whole int or float value
+ */
+struct
+JitMemo {
+  int num;                  // Parameters per key
+  vector<uint32_t> keys;
+  vector<uint32_t> values;
+  vector<bool> used;
+};
+
+/**
+ * Growable machine code buffer
+ */
+struct
+JitCode {
+  vector<unsigned char> bytes;
+
+  /**
+   * Appends raw bytes
+   * @param list Bytes to append
+   */
+  void
+  put(
+    initializer_list<int> list
+  ) {
+    for (int b: list) bytes.push_back(b);
+  }
+
+  /**
+   * Appends a little-endian 32-bit immediate
+   * @param value Immediate value
+   */
+  void
+  imm32(
+    uint32_t value
+  ) {
+    for (int i = 0; i < 4; i++) bytes.push_back(value >> (8 * i));
+  }
+
+  /**
+   * Appends a little-endian 64-bit immediate
+   * @param value Immediate value
+   */
+  void
+  imm64(
+    uint64_t value
+  ) {
+    for (int i = 0; i < 8; i++) bytes.push_back(value >> (8 * i));
+  }
+
+  /**
+   * Gets the current position in the buffer
+   * @return Offset of the next byte
+   */
+  int
+  pos() {
+    return bytes.size();
+  }
+
+  /**
+   * Points a rel32 field at a target position
+   * @param at Offset of the rel32 field
+   * @param target Offset the field should jump to
+   */
+  void
+  patch(
+    int at,
+    int target
+  ) {
+    uint32_t rel = target - (at + 4);
+    for (int i = 0; i < 4; i++) bytes[at + i] = rel >> (8 * i);
+  }
+};
+
+JitCode jitcode;
+deque<JitVari> jitvari;    // Deque, so references survive variables bound by inlined calls
+unordered_map<string, JitFunc> jitfunc;
+list<string> jitcolor;     // Color strings referenced by absolute address
+int jitSlots;              // Local slots used by the current function
+string jitName;            // Name of the current function
+int jitKind;               // Return kind of the current function
+int jitInline;             // Inlined calls enclosing the current token
+int jitMemo;               // Memo table of the current function, -1 if none
+FILE *jitOut;              // Stream receiving drawing commands
+vector<JitMemo> jitmemo;
+JitConst jitconst = { -1, -1, JIT_VOID, 0 };
+uint32_t jitMemoValue;     // Value found by the last memo lookup
+long long jitMemoHits, jitMemoMisses;
+long long jitDrawCount, jitDrawCulled;
+long long jitShapeCount[4];  // Drawn commands of each shape
+map<int, pair<long long, long long>> jitDrawSites;   // Drawn and culled commands of each draw statement
+
+const char *jitShapeName[] = { "line", "circ", "tria", "rect" };
+const int jitShapeParam[] = { 5, 3, 6, 4 };
+
+/**
+ * Runtime sink for draw statements
+ * Writes the same text line as the proxy prelude and culls the same off-canvas commands
+ * @param stack Parameters as pushed by the JIT, last parameter first
+ * @param shape Shape index into jitShapeName
+ * @param color Color in "$rrggbb" format
+ * @param site Source line of the draw statement
+ */
+void
+jit_runtime_draw(
+  const double *stack,
+  int shape,
+  const char *color,
+  int site
+) {
+  int num = jitShapeParam[shape];
+  double params[7];
+  for (int i = 0; i < num; i++) params[i] = stack[num - 1 - i];
+  bool visible = optiinfo.canvasWidth < 0;
+  if (!visible) {
+    int coords = (shape == 0) ? 4 : (shape == 1) ? 2 : num;
+    double pad = (shape == 0) ? fabs(params[4]) / 2 : (shape == 1) ? fabs(params[2]) : 0;
+    visible = draw_visible(params, coords, pad, optiinfo.canvasWidth, optiinfo.canvasHeight);
+  }
+  if (optiinfo.verbose) (visible ? jitDrawSites[site].first : jitDrawSites[site].second)++;
+  if (!visible) {
+    jitDrawCulled++;
+    return;
+  }
+  jitDrawCount++, jitShapeCount[shape]++;
+  fprintf(jitOut, "%s", jitShapeName[shape]);
+  for (int i = 0; i < num; i++) fprintf(jitOut, " %.2lf", params[i]);
+  fprintf(jitOut, " %s\n", color);
+}
+
+/**
+ * Gets the memo table slot of a parameter list
+ * @param memo Memo table
+ * @param params Parameter slots of the frame, last parameter first
+ * @return Slot index
+ */
+int
+jit_memo_slot(
+  JitMemo& memo,
+  const uint64_t *params
+) {
+  uint64_t hash = HASH_SEED;
+  for (int i = 0; i < memo.num; i++) {
+    uint64_t bits = (uint32_t) params[i] * 0xff51afd7ed558ccdULL;   // High half depends on every key bit
+    hash = (hash ^ (bits >> 32)) * 1099511628211ULL;
+  }
+  return (hash ^ (hash >> 32)) % memo.used.size();
+}
+
+/**
+ * Runtime memo lookup at the entry of a memoized function
+ * @param params Parameter slots of the frame
+ * @param id Memo table index
+ * @return 1 with the value in jitMemoValue on a hit, 0 on a miss
+ */
+int
+jit_runtime_memo_find(
+  const uint64_t *params,
+  int id
+) {
+  JitMemo& memo = jitmemo[id];
+  int slot = jit_memo_slot(memo, params);
+  bool equal = memo.used[slot];
+  for (int i = 0; i < memo.num && equal; i++) equal = (memo.keys[slot * memo.num + i] == (uint32_t) params[i]);
+  if (equal) {
+    jitMemoValue = memo.values[slot], jitMemoHits++;
+    return 1;
+  }
+  jitMemoMisses++;
+  return 0;
+}
+
+/**
+ * Runtime memo store at a return of a memoized function
+ * @param params Parameter slots of the frame
+ * @param id Memo table index
+ * @param value Bits of the returned value
+ * @return The value, so it can be moved back into the accumulator
+ */
+uint32_t
+jit_runtime_memo_put(
+  const uint64_t *params,
+  int id,
+  uint32_t value
+) {
+  JitMemo& memo = jitmemo[id];
+  int slot = jit_memo_slot(memo, params);
+  for (int i = 0; i < memo.num; i++) memo.keys[slot * memo.num + i] = params[i];
+  memo.values[slot] = value, memo.used[slot] = true;
+  return value;
+}
+
+/**
+ * Abandons JIT compilation
+ * @param reason Why the program cannot be lowered
+ */
+void
+jit_decline(
+  string reason
+) {
+  throw JitDecline { reason };
+}
+
+/**
+ * Consumes an expected token
+ * @param index Current token index
+ * @param content Expected token content
+ */
+void
+jit_expect(
+  int& index,
+  string content
+) {
+  if (index >= lexiinfo.size() || lexiinfo[index].content != content) {
+    jit_decline("unexpected token at line " + to_string(index < lexiinfo.size() ? lexiinfo[index].line : 0));
+  }
+  index++;
+}
+
+/**
+ * Gets the value kind of a type keyword
+ * @param type Type keyword
+ * @return Value kind
+ */
+int
+jit_type(
+  string type
+) {
+  if (type == "int") return JIT_INT;
+  if (type == "float") return JIT_FLT;
+  if (type == "void") return JIT_VOID;
+  jit_decline("type " + type + " is not supported");
+  return JIT_VOID;
+}
+
+/**
+ * Looks up a variable in the current function
+ * @param name Variable name
+ * @return Variable information
+ */
+JitVari&
+jit_find(
+  string name
+) {
+  for (int i = jitvari.size() - 1; i >= 0; i--) {
+    if (jitvari[i].name == name) return jitvari[i];
+  }
+  jit_decline("unknown variable " + name);
+  return jitvari.back();
+}
+
+/**
+ * Emits a call to a C helper on a 16-byte aligned stack
+ * @param func Helper address
+ */
+void
+jit_helper(
+  void *func
+) {
+  jitcode.put({ 0x48, 0xB8 }); jitcode.imm64((uint64_t) func);   // mov rax, func
+  jitcode.put({ 0x48, 0x89, 0xE3 });                              // mov rbx, rsp
+  jitcode.put({ 0x48, 0x83, 0xE4, 0xF0 });                        // and rsp, -16
+  jitcode.put({ 0xFF, 0xD0 });                                    // call rax
+  jitcode.put({ 0x48, 0x89, 0xDC });                              // mov rsp, rbx
+}
+
+/**
+ * Gets the C++ type name of a value kind
+ * @param kind Value kind
+ * @return Type name as used by fold_constant
+ */
+string
+jit_type_name(
+  int kind
+) {
+  return (kind == JIT_INT) ? "int" : (kind == JIT_FLT) ? "float" : (kind == JIT_DBL) ? "double" : "void";
+}
+
+/**
+ * Checks if the accumulator holds a constant whose code can be replaced
+ * @param start Position the constant must start at, -1 for any
+ * @return true if the last emitted code loads jitconst
+ */
+bool
+jit_is_const(
+  int start = -1
+) {
+  return optiinfo.fold && jitconst.end == jitcode.pos() && (start < 0 || jitconst.start == start);
+}
+
+/**
+ * Drops emitted code back to a position
+ * @param pos Position to truncate the code buffer to
+ */
+void
+jit_rewind(
+  int pos
+) {
+  jitcode.bytes.resize(pos);
+  jitconst.end = -1;
+}
+
+/**
+ * Loads a constant into the accumulator
+ * @param kind Kind of the constant
+ * @param value Value of the constant, exact for its kind
+ * @return Kind of the constant
+ */
+int
+jit_constant(
+  int kind,
+  double value
+) {
+  int start = jitcode.pos();
+  if (kind == JIT_INT) {
+    jitcode.put({ 0xB8 }); jitcode.imm32((int32_t) value);               // mov eax, imm32
+  } else if (kind == JIT_FLT) {
+    float single = value;
+    uint32_t bits; memcpy(&bits, &single, 4);
+    jitcode.put({ 0xB8 }); jitcode.imm32(bits);                          // mov eax, imm32
+    jitcode.put({ 0x66, 0x0F, 0x6E, 0xC0 });                             // movd xmm0, eax
+  } else {
+    uint64_t bits; memcpy(&bits, &value, 8);
+    jitcode.put({ 0x48, 0xB8 }); jitcode.imm64(bits);                    // mov rax, imm64
+    jitcode.put({ 0x66, 0x48, 0x0F, 0x6E, 0xC0 });                       // movq xmm0, rax
+  }
+  jitconst = { start, jitcode.pos(), kind, value };
+  return kind;
+}
+
+/**
+ * Converts the accumulator between value kinds
+ * @param from Current kind
+ * @param to Target kind
+ * @return Target kind
+ */
+int
+jit_convert(
+  int from,
+  int to
+) {
+  if (from == JIT_VOID || to == JIT_VOID) jit_decline("void value used in an expression");
+  if (from == to) return to;
+  if (jit_is_const()) {
+    double value = jitconst.value;
+    if (to != JIT_INT || (value > INT32_MIN - 1.0 && value < INT32_MAX + 1.0)) {
+      jit_rewind(jitconst.start);
+      return jit_constant(to, (to == JIT_INT) ? trunc(value) : (to == JIT_FLT) ? (float) value : value);
+    }
+  }
+  if (from == JIT_INT && to == JIT_FLT) jitcode.put({ 0xF3, 0x0F, 0x2A, 0xC0 });   // cvtsi2ss xmm0, eax
+  if (from == JIT_INT && to == JIT_DBL) jitcode.put({ 0xF2, 0x0F, 0x2A, 0xC0 });   // cvtsi2sd xmm0, eax
+  if (from == JIT_FLT && to == JIT_DBL) jitcode.put({ 0xF3, 0x0F, 0x5A, 0xC0 });   // cvtss2sd xmm0, xmm0
+  if (from == JIT_DBL && to == JIT_FLT) jitcode.put({ 0xF2, 0x0F, 0x5A, 0xC0 });   // cvtsd2ss xmm0, xmm0
+  if (from == JIT_FLT && to == JIT_INT) jitcode.put({ 0xF3, 0x0F, 0x2C, 0xC0 });   // cvttss2si eax, xmm0
+  if (from == JIT_DBL && to == JIT_INT) jitcode.put({ 0xF2, 0x0F, 0x2C, 0xC0 });   // cvttsd2si eax, xmm0
+  return to;
+}
+
+/**
+ * Pushes the accumulator onto the stack as an 8-byte slot
+ * @param kind Kind of the accumulator
+ */
+void
+jit_push(
+  int kind
+) {
+  if (kind == JIT_VOID) jit_decline("void value used in an expression");
+  if (kind == JIT_INT) jitcode.put({ 0x50 });                                        // push rax
+  else {
+    jitcode.put({ 0x48, 0x83, 0xEC, 0x08 });                                         // sub rsp, 8
+    if (kind == JIT_FLT) jitcode.put({ 0xF3, 0x0F, 0x11, 0x04, 0x24 });              // movss [rsp], xmm0
+    else jitcode.put({ 0xF2, 0x0F, 0x11, 0x04, 0x24 });                              // movsd [rsp], xmm0
+  }
+}
+
+/**
+ * Pops a stack slot into the secondary register (ecx or xmm1)
+ * @param kind Kind of the slot
+ */
+void
+jit_pop(
+  int kind
+) {
+  if (kind == JIT_INT) jitcode.put({ 0x59 });                                        // pop rcx
+  else {
+    if (kind == JIT_FLT) jitcode.put({ 0xF3, 0x0F, 0x10, 0x0C, 0x24 });              // movss xmm1, [rsp]
+    else jitcode.put({ 0xF2, 0x0F, 0x10, 0x0C, 0x24 });                              // movsd xmm1, [rsp]
+    jitcode.put({ 0x48, 0x83, 0xC4, 0x08 });                                         // add rsp, 8
+  }
+}
+
+/**
+ * Pops the left operand and brings both operands to their common kind
+ * @param left Kind of the pushed left operand
+ * @param right Kind of the accumulator
+ * @return Common kind (ecx/xmm1 = left, eax/xmm0 = right)
+ */
+int
+jit_operands(
+  int left,
+  int right
+) {
+  if (left == JIT_VOID || right == JIT_VOID) jit_decline("void value used in an expression");
+  int kind = max(left, right);
+  jit_convert(right, kind);
+  jit_pop(left);
+  if (left == JIT_INT && kind == JIT_FLT) jitcode.put({ 0xF3, 0x0F, 0x2A, 0xC9 });   // cvtsi2ss xmm1, ecx
+  if (left == JIT_INT && kind == JIT_DBL) jitcode.put({ 0xF2, 0x0F, 0x2A, 0xC9 });   // cvtsi2sd xmm1, ecx
+  if (left == JIT_FLT && kind == JIT_DBL) jitcode.put({ 0xF3, 0x0F, 0x5A, 0xC9 });   // cvtss2sd xmm1, xmm1
+  return kind;
+}
+
+/**
+ * Emits an arithmetic operator on the pushed left operand and the accumulator
+ * @param op Operator ("+", "-", "*", "/")
+ * @param left Kind of the left operand
+ * @param right Kind of the right operand
+ * @return Kind of the result
+ */
+int
+jit_arith(
+  string op,
+  int left,
+  int right
+) {
+  int kind = jit_operands(left, right);
+  if (kind == JIT_INT) {
+    if (op == "+") jitcode.put({ 0x01, 0xC8 });                          // add eax, ecx
+    if (op == "-") jitcode.put({ 0x29, 0xC1, 0x89, 0xC8 });              // sub ecx, eax; mov eax, ecx
+    if (op == "*") jitcode.put({ 0x0F, 0xAF, 0xC1 });                    // imul eax, ecx
+    if (op == "/") jitcode.put({ 0x91, 0x99, 0xF7, 0xF9 });              // xchg eax, ecx; cdq; idiv ecx
+  } else {
+    int prefix = (kind == JIT_FLT) ? 0xF3 : 0xF2;
+    if (op == "+") jitcode.put({ prefix, 0x0F, 0x58, 0xC8 });            // addss/addsd xmm1, xmm0
+    if (op == "-") jitcode.put({ prefix, 0x0F, 0x5C, 0xC8 });            // subss/subsd xmm1, xmm0
+    if (op == "*") jitcode.put({ prefix, 0x0F, 0x59, 0xC8 });            // mulss/mulsd xmm1, xmm0
+    if (op == "/") jitcode.put({ prefix, 0x0F, 0x5E, 0xC8 });            // divss/divsd xmm1, xmm0
+    jitcode.put({ 0x0F, 0x28, 0xC1 });                                   // movaps xmm0, xmm1
+  }
+  return kind;
+}
+
+/**
+ * Emits a binary operator, folding constants and lowering int "*" and "/" by powers of two to shifts
+ * The division keeps the rounding toward zero of idiv by biasing negative dividends.
+ * @param op Operator ("+", "-", "*", "/")
+ * @param left Kind of the pushed left operand
+ * @param right Kind of the accumulator
+ * @param leftConst Left operand if it was a constant when pushed, NULL otherwise
+ * @param operand Position right after the push of the left operand
+ * @param line Source line for the optimization log
+ * @return Kind of the result
+ */
+int
+jit_binary(
+  string op,
+  int left,
+  int right,
+  JitConst *leftConst,
+  int operand,
+  int line
+) {
+  if (!jit_is_const(operand)) return jit_arith(op, left, right);
+
+  string type = jit_type_name(left);
+  double value = leftConst ? leftConst->value : 0;
+  if (leftConst && fold_constant(op, type, value, jit_type_name(right), jitconst.value)) {
+    jit_rewind(leftConst->start);
+    return jit_constant(type == "int" ? JIT_INT : type == "float" ? JIT_FLT : JIT_DBL, value);
+  }
+
+  int shift = 0, divisor = (right == JIT_INT) ? jitconst.value : 0;
+  while (shift < 30 && (1 << shift) < divisor) shift++;
+  if (left == JIT_INT && (op == "*" || op == "/") && divisor >= 2 && (1 << shift) == divisor) {
+    jit_rewind(operand - 1);                                             // Drop push rax and the constant
+    if (op == "*") {
+      jitcode.put({ 0xC1, 0xE0, shift });                                // shl eax, shift
+    } else {
+      jitcode.put({ 0x89, 0xC2, 0xC1, 0xFA, 0x1F });                     // mov edx, eax; sar edx, 31
+      jitcode.put({ 0xC1, 0xEA, 32 - shift });                           // shr edx, 32 - shift
+      jitcode.put({ 0x01, 0xD0, 0xC1, 0xF8, shift });                    // add eax, edx; sar eax, shift
+    }
+    optiinfo.log("line " + to_string(line) + ": int " + op + " " + to_string(divisor) + " lowered to a shift.");
+    return JIT_INT;
+  }
+  return jit_arith(op, left, right);
+}
+
+/**
+ * Emits a comparison of the pushed left operand and the accumulator
+ * Floating comparisons are false on NaN, as in C++
+ * @param op Comparison operator ("<", ">", "<=", ">=", "==")
+ * @param left Kind of the left operand
+ * @param right Kind of the right operand
+ */
+void
+jit_compare(
+  string op,
+  int left,
+  int right
+) {
+  int kind = jit_operands(left, right);
+  if (kind == JIT_INT) {
+    jitcode.put({ 0x39, 0xC1 });                                         // cmp ecx, eax
+    if (op == "<" ) jitcode.put({ 0x0F, 0x9C, 0xC0 });                   // setl al
+    if (op == ">" ) jitcode.put({ 0x0F, 0x9F, 0xC0 });                   // setg al
+    if (op == "<=") jitcode.put({ 0x0F, 0x9E, 0xC0 });                   // setle al
+    if (op == ">=") jitcode.put({ 0x0F, 0x9D, 0xC0 });                   // setge al
+    if (op == "==") jitcode.put({ 0x0F, 0x94, 0xC0 });                   // sete al
+  } else {
+    if (kind == JIT_DBL) jitcode.put({ 0x66 });
+    if (op == "<" || op == "<=") jitcode.put({ 0x0F, 0x2E, 0xC1 });      // ucomiss xmm0, xmm1
+    else jitcode.put({ 0x0F, 0x2E, 0xC8 });                              // ucomiss xmm1, xmm0
+    if (op == "<" || op == ">") jitcode.put({ 0x0F, 0x97, 0xC0 });       // seta al
+    if (op == "<=" || op == ">=") jitcode.put({ 0x0F, 0x93, 0xC0 });     // setae al
+    if (op == "==") jitcode.put({ 0x0F, 0x94, 0xC0, 0x0F, 0x9B, 0xC1, 0x20, 0xC8 });   // sete al; setnp cl; and al, cl
+  }
+  jitcode.put({ 0x0F, 0xB6, 0xC0 });                                     // movzx eax, al
+}
+
+/**
+ * Turns the accumulator into 0 or 1 by comparing it with zero
+ * @param kind Kind of the accumulator
+ */
+void
+jit_truth(
+  int kind
+) {
+  if (kind == JIT_VOID) jit_decline("void value used as a condition");
+  if (kind == JIT_INT) jitcode.put({ 0x85, 0xC0, 0x0F, 0x95, 0xC0 });    // test eax, eax; setne al
+  else {
+    jitcode.put({ 0x0F, 0x57, 0xC9 });                                   // xorps xmm1, xmm1
+    if (kind == JIT_DBL) jitcode.put({ 0x66 });
+    jitcode.put({ 0x0F, 0x2E, 0xC1 });                                   // ucomiss xmm0, xmm1
+    jitcode.put({ 0x0F, 0x95, 0xC0, 0x0F, 0x9A, 0xC1, 0x08, 0xC8 });     // setne al; setp cl; or al, cl
+  }
+  jitcode.put({ 0x0F, 0xB6, 0xC0 });                                     // movzx eax, al
+}
+
+/**
+ * Emits a conditional jump taken when eax is zero
+ * @return Offset of the rel32 field to patch
+ */
+int
+jit_jump_zero() {
+  jitcode.put({ 0x85, 0xC0, 0x0F, 0x84 });                               // test eax, eax; jz rel32
+  jitcode.imm32(0);
+  return jitcode.pos() - 4;
+}
+
+/**
+ * Emits an unconditional jump
+ * @return Offset of the rel32 field to patch
+ */
+int
+jit_jump() {
+  jitcode.put({ 0xE9 });                                                 // jmp rel32
+  jitcode.imm32(0);
+  return jitcode.pos() - 4;
+}
+
+/**
+ * Loads a variable into the accumulator
+ * @param vari Variable to load
+ * @return Kind of the variable
+ */
+int
+jit_load(
+  JitVari& vari
+) {
+  if (vari.kind == JIT_INT) jitcode.put({ 0x8B, 0x85 });                 // mov eax, [rbp + disp]
+  else jitcode.put({ 0xF3, 0x0F, 0x10, 0x85 });                          // movss xmm0, [rbp + disp]
+  jitcode.imm32(vari.offset);
+  return vari.kind;
+}
+
+/**
+ * Stores the accumulator into a variable, converting it first
+ * @param vari Variable to store into
+ * @param kind Kind of the accumulator
+ * @return Kind of the variable
+ */
+int
+jit_store(
+  JitVari& vari,
+  int kind
+) {
+  jit_convert(kind, vari.kind);
+  if (vari.kind == JIT_INT) jitcode.put({ 0x89, 0x85 });                 // mov [rbp + disp], eax
+  else jitcode.put({ 0xF3, 0x0F, 0x11, 0x85 });                          // movss [rbp + disp], xmm0
+  jitcode.imm32(vari.offset);
+  return vari.kind;
+}
+
+/**
+ * Emits an increment or decrement of a variable
+ * @param vari Variable to modify
+ * @param op "++" or "--"
+ * @param prefix Whether the new value is the result
+ * @return Kind of the variable
+ */
+int
+jit_indecrement(
+  JitVari& vari,
+  string op,
+  bool prefix
+) {
+  jit_load(vari);
+  if (vari.kind == JIT_INT) {
+    jitcode.put({ 0x89, 0xC1 });                                         // mov ecx, eax
+    if (op == "++") jitcode.put({ 0x83, 0xC1, 0x01 });                   // add ecx, 1
+    else jitcode.put({ 0x83, 0xE9, 0x01 });                              // sub ecx, 1
+    jitcode.put({ 0x89, 0x8D }); jitcode.imm32(vari.offset);             // mov [rbp + disp], ecx
+    if (prefix) jitcode.put({ 0x89, 0xC8 });                             // mov eax, ecx
+  } else {
+    jitcode.put({ 0x0F, 0x28, 0xC8 });                                   // movaps xmm1, xmm0
+    jitcode.put({ 0xB9 }); jitcode.imm32(0x3F800000);                    // mov ecx, 1.0f
+    jitcode.put({ 0x66, 0x0F, 0x6E, 0xD1 });                             // movd xmm2, ecx
+    if (op == "++") jitcode.put({ 0xF3, 0x0F, 0x58, 0xCA });             // addss xmm1, xmm2
+    else jitcode.put({ 0xF3, 0x0F, 0x5C, 0xCA });                        // subss xmm1, xmm2
+    jitcode.put({ 0xF3, 0x0F, 0x11, 0x8D }); jitcode.imm32(vari.offset); // movss [rbp + disp], xmm1
+    if (prefix) jitcode.put({ 0x0F, 0x28, 0xC1 });                       // movaps xmm0, xmm1
+  }
+  return vari.kind;
+}
+
+int jit_formula(int&, bool = false);
+int jit_power(int&);
+void jit_block(int&);
+
+/**
+ * Lowers an inlined call, as reco_inline does for the proxy
+ * Arguments are stored into fresh frame slots bound to the parameter names,
+ * then the returned formula of the function is lowered in place
+ * @param index Token index of the opening parenthesis
+ * @param name Name of the inlined function
+ * @return Return kind of the function
+ */
+int
+jit_inline(
+  int& index,
+  string name
+) {
+  JitFunc& func = jitfunc[name];
+  vector<ParaItem>& params = funcinfo.params[name];
+  vector<JitVari> bound;
+
+  jit_expect(index, "(");
+  while (lexiinfo[index].lexiID != keywords.id(")")) {
+    if (lexiinfo[index].lexiID == keywords.id(",")) index++;
+    else {
+      if (bound.size() >= params.size()) jit_decline("wrong number of arguments to " + name);
+      bound.push_back((JitVari) { params[bound.size()].paraName, -8 * ++jitSlots, func.params[bound.size()] });
+      jit_store(bound.back(), jit_formula(index));
+    }
+  }
+  jit_expect(index, ")");
+
+  int scope = jitvari.size(), at = funcinfo.inlineAt[name];
+  jitvari.insert(jitvari.end(), bound.begin(), bound.end());
+  jitInline++;
+  int kind = jit_convert(jit_formula(at), func.kind);
+  jitInline--;
+  jitvari.resize(scope);
+  return kind;
+}
+
+/**
+ * Lowers a function call, pushing arguments converted to parameter types
+ * @param index Current token index
+ * @return Return kind of the function
+ */
+int
+jit_call(
+  int& index
+) {
+  bool inlined = check_inline(index, jitName, jitInline);
+  string name = lexiinfo[index++].content;
+  if (!jitfunc.count(name)) jit_decline("unknown function " + name);
+  if (inlined) return jit_inline(index, name);
+  JitFunc func = jitfunc[name];
+  int numParam = 0;
+
+  jit_expect(index, "(");
+  while (lexiinfo[index].lexiID != keywords.id(")")) {
+    if (lexiinfo[index].lexiID == keywords.id(",")) index++;
+    else {
+      if (numParam >= func.params.size()) jit_decline("wrong number of arguments to " + name);
+      int kind = jit_formula(index);
+      jit_push(jit_convert(kind, func.params[numParam++]));
+    }
+  }
+  jit_expect(index, ")");
+
+  jitcode.put({ 0xE8 }); jitcode.imm32(0);                               // call rel32
+  jitcode.patch(jitcode.pos() - 4, func.offset);
+  if (numParam) {
+    jitcode.put({ 0x48, 0x81, 0xC4 }); jitcode.imm32(8 * numParam);      // add rsp, 8n
+  }
+  return func.kind;
+}
+
+/**
+ * Lowers a single operand: parenthesized formula, call, variable or number
+ * @param index Current token index
+ * @return Kind of the operand
+ */
+int
+jit_operand(
+  int& index
+) {
+  LexiItem& item = lexiinfo[index];
+
+  if (item.lexiID == keywords.id("(")) {
+    index++;
+    int kind = jit_formula(index);
+    jit_expect(index, ")");
+    return kind;
+  }
+
+  if (isInDeOperator(item.lexiID)) {
+    index++;
+    if (lexiinfo[index].lexiID != keywords.id("identifier")) jit_decline("increment of a non-variable");
+    return jit_indecrement(jit_find(lexiinfo[index++].content), item.content, true);
+  }
+
+  if (item.lexiID == keywords.id("identifier")) {
+    if (lexiinfo[index + 1].lexiID == keywords.id("(")) return jit_call(index);
+    JitVari& vari = jit_find(lexiinfo[index++].content);
+    if (isInDeOperator(lexiinfo[index].lexiID)) {
+      return jit_indecrement(vari, lexiinfo[index++].content, false);
+    }
+    return jit_load(vari);
+  }
+
+  if (item.lexiID == keywords.id("integer")) {
+    long long value = stoll(item.content);
+    if (value > INT32_MAX) jit_decline("integer literal out of range");
+    index++;
+    return jit_constant(JIT_INT, value);
+  }
+
+  if (item.lexiID == keywords.id("float")) {
+    index++;
+    return jit_constant(JIT_DBL, stod(item.content));
+  }
+
+  jit_decline("unexpected token in formula at line " + to_string(item.line));
+  return JIT_VOID;
+}
+
+/**
+ * Lowers the right-associative power chain following a base already in the accumulator
+ * Matches reco_power: a ^ b ^ c is Power(a, Power(b, c)) and yields float
+ * @param index Current token index
+ * @param kind Kind of the base
+ * @return Kind of the result
+ */
+int
+jit_power_rest(
+  int& index,
+  int kind
+) {
+  if (lexiinfo[index].lexiID != keywords.id("^")) return kind;
+  index++;
+  kind = jit_convert(kind, JIT_DBL);
+  JitConst base = jitconst;
+  bool baseConst = jit_is_const();
+  jit_push(kind);
+  int operand = jitcode.pos();
+  int exponent = jit_power(index);
+
+  if (jit_is_const(operand)) {
+    string type = "double";
+    double value = base.value, k = jitconst.value;
+    if (baseConst && fold_constant("^", type, value, jit_type_name(exponent), k)) {
+      jit_rewind(base.start);
+      return jit_constant(JIT_FLT, value);
+    }
+    if (k >= 1 && k <= 4 && k == (int) k) {                              // Square-and-multiply steps of Power
+      jit_rewind(operand);
+      jitcode.put({ 0xF2, 0x0F, 0x10, 0x04, 0x24 });                     // movsd xmm0, [rsp]
+      jitcode.put({ 0x48, 0x83, 0xC4, 0x08 });                           // add rsp, 8
+      if (k == 2 || k == 4) jitcode.put({ 0xF2, 0x0F, 0x59, 0xC0 });     // mulsd xmm0, xmm0
+      if (k == 4) jitcode.put({ 0xF2, 0x0F, 0x59, 0xC0 });               // mulsd xmm0, xmm0
+      if (k == 3) {
+        jitcode.put({ 0x66, 0x0F, 0x28, 0xC8 });                         // movapd xmm1, xmm0
+        jitcode.put({ 0xF2, 0x0F, 0x59, 0xC9 });                         // mulsd xmm1, xmm1
+        jitcode.put({ 0xF2, 0x0F, 0x59, 0xC1 });                         // mulsd xmm0, xmm1
+      }
+      jitcode.put({ 0xF2, 0x0F, 0x5A, 0xC0 });                           // cvtsd2ss xmm0, xmm0
+      return JIT_FLT;
+    }
+  }
+
+  jit_convert(exponent, JIT_DBL);
+  jitcode.put({ 0xF2, 0x0F, 0x10, 0xC8 });                               // movsd xmm1, xmm0
+  jitcode.put({ 0xF2, 0x0F, 0x10, 0x04, 0x24 });                         // movsd xmm0, [rsp]
+  jitcode.put({ 0x48, 0x83, 0xC4, 0x08 });                               // add rsp, 8
+  jit_helper((void*) runtime_power);
+  return JIT_FLT;
+}
+
+/**
+ * Lowers an operand together with any power chain it starts
+ * @param index Current token index
+ * @return Kind of the result
+ */
+int
+jit_power(
+  int& index
+) {
+  return jit_power_rest(index, jit_operand(index));
+}
+
+/**
+ * Lowers a chain of "*" and "/" following a term already in the accumulator
+ * @param index Current token index
+ * @param kind Kind of the accumulator
+ * @return Kind of the result
+ */
+int
+jit_term(
+  int& index,
+  int kind
+) {
+  while (lexiinfo[index].lexiID == keywords.id("*") || lexiinfo[index].lexiID == keywords.id("/")) {
+    int line = lexiinfo[index].line;
+    string op = lexiinfo[index++].content;
+    JitConst left = jitconst;
+    bool leftConst = jit_is_const();
+    jit_push(kind);
+    int operand = jitcode.pos();
+    int right = jit_power(index);
+    kind = jit_binary(op, kind, right, leftConst ? &left : NULL, operand, line);
+  }
+  return kind;
+}
+
+/**
+ * Lowers a formula with the precedence of the emitted C++ code
+ * Only the first operand may carry a unary sign, as in reco_formula_inner
+ * @param index Current token index
+ * @param castFirst Whether the first operand is cast to double, like draw arguments
+ * @return Kind of the result
+ */
+int
+jit_formula(
+  int& index,
+  bool castFirst
+) {
+  string sign;
+  if (lexiinfo[index].lexiID == keywords.id("+") || lexiinfo[index].lexiID == keywords.id("-")) {
+    sign = lexiinfo[index++].content;
+  }
+
+  int kind = jit_operand(index);
+  if (sign == "-" && jit_is_const() && (kind != JIT_INT || jitconst.value > INT32_MIN)) {
+    jit_rewind(jitconst.start);
+    jit_constant(kind, -jitconst.value);
+  } else if (sign == "-") {
+    if (kind == JIT_INT) jitcode.put({ 0xF7, 0xD8 });                    // neg eax
+    if (kind == JIT_FLT) {
+      jitcode.put({ 0x66, 0x0F, 0x7E, 0xC0 });                           // movd eax, xmm0
+      jitcode.put({ 0x35 }); jitcode.imm32(0x80000000);                  // xor eax, sign
+      jitcode.put({ 0x66, 0x0F, 0x6E, 0xC0 });                           // movd xmm0, eax
+    }
+    if (kind == JIT_DBL) {
+      jitcode.put({ 0x66, 0x48, 0x0F, 0x7E, 0xC0 });                     // movq rax, xmm0
+      jitcode.put({ 0x48, 0x0F, 0xBA, 0xF8, 0x3F });                     // btc rax, 63
+      jitcode.put({ 0x66, 0x48, 0x0F, 0x6E, 0xC0 });                     // movq xmm0, rax
+    }
+    if (kind == JIT_VOID) jit_decline("void value used in an expression");
+  }
+  kind = jit_power_rest(index, kind);
+  if (castFirst) kind = jit_convert(kind, JIT_DBL);
+
+  kind = jit_term(index, kind);
+  while (lexiinfo[index].lexiID == keywords.id("+") || lexiinfo[index].lexiID == keywords.id("-")) {
+    int line = lexiinfo[index].line;
+    string op = lexiinfo[index++].content;
+    JitConst left = jitconst;
+    bool leftConst = jit_is_const();
+    jit_push(kind);
+    int operand = jitcode.pos();
+    int right = jit_term(index, jit_power(index));
+    kind = jit_binary(op, kind, right, leftConst ? &left : NULL, operand, line);
+  }
+
+  if (check_boarder(index)) jit_decline("unexpected token in formula at line " + to_string(lexiinfo[index].line));
+  return kind;
+}
+
+/**
+ * Lowers a condition, leaving 0 or 1 in eax
+ * An "=" condition assigns and tests the assigned value, as in C++
+ * @param index Current token index
+ */
+void
+jit_condition(
+  int& index
+) {
+  if (
+    lexiinfo[index].lexiID == keywords.id("identifier") &&
+    lexiinfo[index + 1].lexiID == keywords.id("=")
+  ) {
+    JitVari& vari = jit_find(lexiinfo[index].content);
+    index += 2;
+    jit_truth(jit_store(vari, jit_formula(index)));
+    return;
+  }
+
+  int left = jit_formula(index);
+  jit_push(left);
+  if (!isCompOperator(lexiinfo[index].lexiID)) jit_decline("missing comparison operator");
+  string op = lexiinfo[index++].content;
+  if (op == "=") jit_decline("assignment to a non-variable");
+  jit_compare(op, left, jit_formula(index));
+}
+
+/**
+ * Lowers comma-separated formulas and assignment chains up to ";"
+ * @param index Current token index
+ */
+void
+jit_multiformula(
+  int& index
+) {
+  while (lexiinfo[index].lexiID != keywords.id(";")) {
+    vector<JitVari*> targets;
+    while (
+      lexiinfo[index].lexiID == keywords.id("identifier") &&
+      lexiinfo[index + 1].lexiID == keywords.id("=")
+    ) {
+      targets.push_back(&jit_find(lexiinfo[index].content));
+      index += 2;
+    }
+    int kind = jit_formula(index);
+    for (int i = targets.size() - 1; i >= 0; i--) kind = jit_store(*targets[i], kind);
+    if (lexiinfo[index].lexiID == keywords.id(",")) index++;
+    else if (lexiinfo[index].lexiID != keywords.id(";")) jit_decline("assignment to a non-variable");
+  }
+  jit_expect(index, ";");
+}
+
+/**
+ * Lowers a variable definition, giving each variable a new frame slot
+ * Variables without initializer start at zero
+ * @param index Current token index
+ */
+void
+jit_define(
+  int& index
+) {
+  int kind = jit_type(lexiinfo[index++].content);
+  if (kind == JIT_VOID) jit_decline("void variable");
+
+  while (lexiinfo[index].lexiID != keywords.id(";")) {
+    if (lexiinfo[index + 1].lexiID == keywords.id("[")) jit_decline("array variable");
+    jitvari.push_back((JitVari) { lexiinfo[index++].content, -8 * ++jitSlots, kind });
+    int slot = jitvari.size() - 1;
+    if (lexiinfo[index].lexiID == keywords.id("=")) {
+      index++;
+      int value = jit_formula(index);
+      jit_store(jitvari[slot], value);
+    } else {
+      jitcode.put({ 0xC7, 0x85 }); jitcode.imm32(jitvari[slot].offset); jitcode.imm32(0);   // mov dword [rbp + disp], 0
+    }
+    if (lexiinfo[index].lexiID == keywords.id(",")) index++;
+  }
+  jit_expect(index, ";");
+}
+
+/**
+ * Lowers a draw statement into a call of the runtime sink
+ * @param index Current token index
+ */
+void
+jit_drawstmt(
+  int& index
+) {
+  jit_expect(index, "draw");
+  int shape = lexiinfo[index].lexiID - keywords.id("line");
+  if (shape > DRAW_RECT) jit_decline("batched draw");
+  int vecNumber = (shape == 0) ? 2 : (shape == 1) ? 1 : (shape == 2) ? 3 : 2;
+  bool hasParam = (shape <= 1);
+  index++;
+
+  jit_expect(index, "(");
+  for (int i = 0; i < vecNumber; i++) {
+    jit_expect(index, "vec");
+    jit_expect(index, "(");
+    jit_push(jit_formula(index, true));
+    jit_expect(index, ",");
+    jit_push(jit_formula(index, true));
+    jit_expect(index, ")");
+    jit_expect(index, ",");
+  }
+  if (hasParam) {
+    jit_push(jit_formula(index, true));
+    jit_expect(index, ",");
+  }
+
+  jitcolor.push_back(lexiinfo[index++].content);
+  jitcode.put({ 0x48, 0x89, 0xE7 });                                     // mov rdi, rsp
+  jitcode.put({ 0xBE }); jitcode.imm32(shape);                           // mov esi, shape
+  jitcode.put({ 0x48, 0xBA }); jitcode.imm64((uint64_t) jitcolor.back().c_str());   // mov rdx, color
+  jitcode.put({ 0xB9 }); jitcode.imm32(lexiinfo[index - 1].line);      // mov ecx, site
+  jit_helper((void*) jit_runtime_draw);
+  jitcode.put({ 0x48, 0x81, 0xC4 }); jitcode.imm32(8 * jitShapeParam[shape]);       // add rsp, 8n
+
+  jit_expect(index, ")");
+  jit_expect(index, ";");
+}
+
+/**
+ * Lowers a return statement
+ * @param index Current token index
+ */
+void
+jit_return(
+  int& index
+) {
+  jit_expect(index, "return");
+  if (lexiinfo[index].lexiID != keywords.id(";")) {
+    if (jitKind == JIT_VOID) jit_decline("return with a value in a void function");
+    jit_convert(jit_formula(index), jitKind);
+    if (jitMemo >= 0) {
+      if (jitKind == JIT_INT) jitcode.put({ 0x89, 0xC2 });              // mov edx, eax
+      else jitcode.put({ 0x66, 0x0F, 0x7E, 0xC2 });                      // movd edx, xmm0
+      jitcode.put({ 0x48, 0x8D, 0x7D, 0x10 });                           // lea rdi, [rbp + 16]
+      jitcode.put({ 0xBE }); jitcode.imm32(jitMemo);                     // mov esi, memo
+      jit_helper((void*) jit_runtime_memo_put);
+      if (jitKind == JIT_FLT) jitcode.put({ 0x66, 0x0F, 0x6E, 0xC0 });   // movd xmm0, eax
+    }
+  }
+  jit_expect(index, ";");
+  jitcode.put({ 0xC9, 0xC3 });                                           // leave; ret
+}
+
+/**
+ * Lowers an if statement with optional else and else-if branches
+ * @param index Current token index
+ */
+void
+jit_if(
+  int& index
+) {
+  jit_expect(index, "if");
+  jit_expect(index, "(");
+  jit_condition(index);
+  jit_expect(index, ")");
+  int toElse = jit_jump_zero();
+  jit_block(index);
+
+  if (lexiinfo[index].lexiID == keywords.id("else")) {
+    index++;
+    int toEnd = jit_jump();
+    jitcode.patch(toElse, jitcode.pos());
+    if (lexiinfo[index].lexiID == keywords.id("if")) jit_if(index);
+    else jit_block(index);
+    jitcode.patch(toEnd, jitcode.pos());
+  } else jitcode.patch(toElse, jitcode.pos());
+}
+
+/**
+ * Lowers a while loop
+ * @param index Current token index
+ */
+void
+jit_while(
+  int& index
+) {
+  jit_expect(index, "while");
+  jit_expect(index, "(");
+  int loop = jitcode.pos();
+  jit_condition(index);
+  jit_expect(index, ")");
+  int toEnd = jit_jump_zero();
+  jit_block(index);
+  jitcode.patch(jit_jump(), loop);
+  jitcode.patch(toEnd, jitcode.pos());
+}
+
+/**
+ * Lowers a for loop, or a pfor loop, which compiled code runs serially
+ * The step is emitted before the body, so the loop enters at the condition
+ * @param index Current token index
+ */
+void
+jit_for(
+  int& index
+) {
+  int scope = jitvari.size();
+  jit_expect(index, lexiinfo[index].content == "pfor" ? "pfor" : "for");
+  jit_expect(index, "(");
+  if (!isType(lexiinfo[index].lexiID)) jit_decline("for loop without definition");
+  jit_define(index);
+
+  int toCond = jit_jump();
+  int step = jitcode.pos();
+  int condIndex = index;
+  while (lexiinfo[index].lexiID != keywords.id(";")) index++;
+  index++;
+  while (lexiinfo[index].lexiID != keywords.id(")")) {
+    jit_formula(index);
+    if (lexiinfo[index].lexiID == keywords.id(",")) index++;
+  }
+  jit_expect(index, ")");
+  int bodyIndex = index;
+
+  jitcode.patch(toCond, jitcode.pos());
+  jit_condition(condIndex);
+  int toEnd = jit_jump_zero();
+  jit_block(bodyIndex);
+  jitcode.patch(jit_jump(), step);
+  jitcode.patch(toEnd, jitcode.pos());
+
+  index = bodyIndex;
+  jitvari.resize(scope);
+}
+
+/**
+ * Lowers a block, dropping its variables at the end
+ * @param index Current token index
+ */
+void
+jit_block(
+  int& index
+) {
+  int scope = jitvari.size();
+  jit_expect(index, "{");
+  while (lexiinfo[index].lexiID != keywords.id("}")) {
+    int id = lexiinfo[index].lexiID;
+    if (id == keywords.id("draw")) jit_drawstmt(index);
+    else if (id == keywords.id("for") || id == keywords.id("pfor")) jit_for(index);
+    else if (id == keywords.id("while")) jit_while(index);
+    else if (id == keywords.id("if")) jit_if(index);
+    else if (id == keywords.id("return")) jit_return(index);
+    else if (isType(id)) jit_define(index);
+    else jit_multiformula(index);
+  }
+  jit_expect(index, "}");
+  jitvari.resize(scope);
+}
+
+/**
+ * Lowers a function definition
+ * @param index Current token index
+ */
+void
+jit_function(
+  int& index
+) {
+  jit_expect(index, "def");
+  string name = lexiinfo[index++].content;
+  JitFunc func;
+  func.offset = jitcode.pos();
+
+  jitvari.clear();
+  jit_expect(index, "(");
+  while (lexiinfo[index].lexiID != keywords.id(")")) {
+    if (lexiinfo[index].lexiID == keywords.id(",")) index++;
+    else {
+      int kind = jit_type(lexiinfo[index++].content);
+      if (kind == JIT_VOID) jit_decline("void parameter");
+      if (lexiinfo[index + 1].lexiID == keywords.id("[")) jit_decline("array parameter");
+      func.params.push_back(kind);
+      jitvari.push_back((JitVari) { lexiinfo[index++].content, 0, kind });
+    }
+  }
+  jit_expect(index, ")");
+  for (int i = 0; i < func.params.size(); i++) jitvari[i].offset = 16 + 8 * (func.params.size() - 1 - i);
+
+  jit_expect(index, "->");
+  func.kind = (name == "main") ? JIT_INT : jit_type(lexiinfo[index].content);
+  index++;
+  func.memo = -1;
+  if (funcinfo.memo[name]) {
+    func.memo = jitmemo.size();
+    jitmemo.push_back(JitMemo());
+    jitmemo.back().num = func.params.size();
+    jitmemo.back().keys.resize(optiinfo.memoSize * func.params.size());
+    jitmemo.back().values.resize(optiinfo.memoSize);
+    jitmemo.back().used.resize(optiinfo.memoSize);
+  }
+  jitfunc[name] = func;
+  jitName = name;
+  jitKind = func.kind;
+  jitMemo = func.memo;
+  jitSlots = 0;
+
+  jitcode.put({ 0x55, 0x48, 0x89, 0xE5 });                               // push rbp; mov rbp, rsp
+  jitcode.put({ 0x48, 0x81, 0xEC }); jitcode.imm32(0);                   // sub rsp, frame
+  int frame = jitcode.pos() - 4;
+  if (jitMemo >= 0) {
+    jitcode.put({ 0x48, 0x8D, 0x7D, 0x10 });                             // lea rdi, [rbp + 16]
+    jitcode.put({ 0xBE }); jitcode.imm32(jitMemo);                       // mov esi, memo
+    jit_helper((void*) jit_runtime_memo_find);
+    int toBody = jit_jump_zero();
+    jitcode.put({ 0x48, 0xB8 }); jitcode.imm64((uint64_t) &jitMemoValue);   // mov rax, &jitMemoValue
+    if (jitKind == JIT_INT) jitcode.put({ 0x8B, 0x00 });                 // mov eax, [rax]
+    else jitcode.put({ 0xF3, 0x0F, 0x10, 0x00 });                        // movss xmm0, [rax]
+    jitcode.put({ 0xC9, 0xC3 });                                         // leave; ret
+    jitcode.patch(toBody, jitcode.pos());
+  }
+  jit_block(index);
+  jitcode.put({ 0x31, 0xC0, 0xC9, 0xC3 });                               // xor eax, eax; leave; ret
+
+  uint32_t size = (8 * jitSlots + 15) & ~15;
+  for (int i = 0; i < 4; i++) jitcode.bytes[frame + i] = size >> (8 * i);
+}
+
+/**
+ * Compiles the whole program and maps it as executable code
+ * @return Entry point running main, or NULL if the JIT declined
+ */
+void
+(*jit_compile())() {
+  jitcode = JitCode();
+  jitfunc.clear();
+  jitcolor.clear();
+  jitmemo.clear();
+  try {
+    int index = 0;
+    while (index < lexiinfo.size()) jit_function(index);
+    if (!jitfunc.count("main")) jit_decline("no main function");
+  } catch (JitDecline& decline) {
+    cout << "pfc: \033[35m[JIT Note]\033[0m " << decline.reason << ", running the proxy instead." << endl;
+    return NULL;
+  }
+
+  int entry = jitcode.pos();
+  jitcode.put({ 0x53, 0xE8 }); jitcode.imm32(0);                         // push rbx; call main
+  jitcode.patch(jitcode.pos() - 4, jitfunc["main"].offset);
+  jitcode.put({ 0x5B, 0xC3 });                                           // pop rbx; ret
+
+  size_t size = jitcode.pos();
+  stats_count("compile", "bytes", size);
+  void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) error_info("[Compiler Error]", "Cannot allocate JIT code buffer.");
+  memcpy(memory, jitcode.bytes.data(), size);
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    error_info("[Compiler Error]", "Cannot make JIT code buffer executable.");
+  }
+  return (void (*)()) ((char*) memory + entry);
+}
+
+/**
+ * Runs the program through the JIT and processes its drawing commands
+ * @param ouName Output filename
+ * @param drawCMD Drawing command to execute
+ * @param drawcode Whether to save drawing commands to file
+ * @return false if the JIT declined and the proxy should be used
+ */
+bool
+execute_jit(
+  const string& ouName,
+  string drawCMD,
+  bool drawcode
+) {
+  stats_start("compile");
+  void (*entry)() = jit_compile();
+  stats_stop("compile");
+  if (!entry) return false;
+
+  jitOut = drawcode ? fopen((ouName + ".draw").c_str(), "w") : popen(drawCMD.c_str(), "w");
+  if (!jitOut) error_info("[Compiler Error]", "Cannot open drawing command stream.");
+  stats_start("execute");
+  entry();
+  fflush(jitOut);
+  stats_stop("execute");
+  for (int shape = 0; shape < 4; shape++) stats_count("execute", jitShapeName[shape], jitShapeCount[shape]);
+  stats_count("execute", "culled", jitDrawCulled);
+  stats_count("execute", "memo_hits", jitMemoHits);
+  stats_count("execute", "memo_misses", jitMemoMisses);
+  if (optiinfo.verbose && (jitMemoHits || jitMemoMisses)) {
+    fprintf(stderr, "pfc: \033[36m[Runtime]\033[0m memo hits %lld, misses %lld\n", jitMemoHits, jitMemoMisses);
+  }
+  if (optiinfo.verbose && optiinfo.canvasWidth >= 0) {
+    fprintf(stderr, "pfc: \033[36m[Runtime]\033[0m culled %lld of %lld primitives\n", jitDrawCulled, jitDrawCount + jitDrawCulled);
+  }
+  for (auto& site: jitDrawSites) {
+    if (site.second.first == 0) fprintf(stderr, "pfc: \033[36m[Runtime]\033[0m draw at line %d produced only off-canvas primitives (%lld culled)\n", site.first, site.second.second);
+  }
+  double start = trace_clock();
+  if (drawcode) {
+    fclose(jitOut);
+    system((drawCMD + " < " + ouName + ".draw").c_str());
+    trace_span("run pfc-draw", "process", start);
+  } else {
+    pclose(jitOut);
+    trace_span("wait pfc-draw", "process", start);
+  }
+  return true;
+}
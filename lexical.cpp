@@ -22,13 +22,13 @@ keywordDis(
   string str
 ) {
   int id = keywords.id(str);
-  if (id <= 16) return "Keyword";
-  if (id <= 30) return "Operator";
-  if (id <= 36) return "Symbol";
-  if (id == 37) return "Integer";
-  if (id == 38) return "Float";
-  if (id == 39) return "Identifier";
-  if (id == 40) return "Color";
+  if (id <= 20) return "Keyword";
+  if (id <= 34) return "Operator";
+  if (id <= 42) return "Symbol";
+  if (id == 43) return "Integer";
+  if (id == 44) return "Float";
+  if (id == 45) return "Identifier";
+  if (id == 46) return "Color";
   return "";
 }
 
@@ -1,9 +1,12 @@
 #include "format.hpp"
+#include <unistd.h>
+#include <sys/stat.h>
 
 Keywords keywords;
 LexiInfo lexiinfo;
 VariInfo variinfo;
 FuncInfo funcinfo;
+OptiInfo optiinfo;
 
 /**
  * Displays help information and usage instructions
@@ -20,10 +23,27 @@ showHelp() {
   printf("  -h                            Show this help message and exit.                                                 \n");
   printf("  -o <filename>                 Set the output image file name to <filename>.                                    \n");
   printf("  -d                            Generate intermediate code.                                                      \n");
+  printf("  -D                            Generate intermediate code as an indexed binary archive.                         \n");
   printf("  -c                            Generate proxy code (C++).                                                       \n");
   printf("  -l                            Generate lexical analysis results.                                               \n");
   printf("  -a                            Enable antialiasing mode.                                                        \n");
+  printf("  -k                            Reuse the cached image of an identical program and image size.                   \n");
+  printf("  -K                            Show output cache statistics and exit.                                           \n");
+  printf("  -j                            Run the program with the built-in x86-64 JIT instead of g++.                     \n");
+  printf("  -m                            Load the proxy into pfc-draw as a shared object instead of piping its output.    \n");
+  printf("  -i                            Redraw only the regions that changed since the previous run with -i.             \n");
+  printf("  -v                            Print the optimization log and runtime statistics.                               \n");
+  printf("  -H                            Write an overdraw heatmap to <name>.heat.png and report the raster cost per type.\n");
+  printf("  -P                            Profile the program per function and source line into <filename>.prof.           \n");
+  printf("  -t, --stats                   Print time, CPU time, peak memory and item counts of every phase.                \n");
+  printf("  --stats=json                  Print the phase profile as JSON.                                                 \n");
+  printf("  --trace <file>                Write a Chrome trace of pfc, the compiler, the proxy and pfc-draw to <file>.     \n");
+  printf("  -N <name>                     Disable optimization (memo, inline, fold, cull, occlude, batch, tasks, vector).  \n");
   printf("  -s <width> <height>           Set the image height and width to <width> and <height>.                          \n");
+  printf("  -b <rows>                     Render in horizontal bands of <rows> pixels, 0 for the whole image at once.      \n");
+  printf("  -f <format>                   Write the image as png, ppm, pam, qoi or argb (raw cairo pixels).                \n");
+  printf("  -z <level>                    Set the PNG compression level from 0 (fastest) to 9 (smallest).                  \n");
+  printf("  -p <tile>                     Write a Deep Zoom tile pyramid with <tile> pixel tiles instead of one image.     \n");
   printf("                                                                                                                 \n");
   printf("\033[33mExamples:\033[0m                                                                                         \n");
   printf("  pfc -h                        Display help information.                                                        \n");
@@ -32,6 +52,7 @@ showHelp() {
   printf("  pfc -c input.pf               Generate proxy code in C++ from \"input.pf\".                                    \n");
   printf("  pfc -l input.pf               Show the results of lexical analysis for \"input.pf\".                           \n");
   printf("  pfc -s 800 600 input.pf       Set the image dimensions to 800x600 (width x height) and compile \"input.pf\".   \n");
+  printf("  pfc -k input.pf               Compile \"input.pf\", or reuse its cached image if nothing changed.              \n");
   printf("                                                                                                                 \n");
   printf("\033[33mDescription:\033[0m                                                                                      \n");
   printf("  pfc is a powerful compiler that reads image description code and generates images.                             \n");
@@ -44,13 +65,24 @@ showHelp() {
 
 /**
  * Generates a random filename for temporary proxy files
+ * The process id keeps runs started in the same second, as pfc-golden starts them, apart.
  * @return String containing randomly generated filename
  */
 string
 random_filename() {
-  srand(time(NULL) + 114514);
+  srand(time(NULL) + getpid());
   ostringstream index; index << setw(5) << setfill('0') << to_string(rand() % 100000);
-  return "proxy_" + index.str();
+  return "proxy_" + to_string(getpid()) + "_" + index.str();
+}
+
+/**
+ * Gets the extra g++ flags of the proxy
+ * @return Flags with a leading space, or an empty string
+ */
+string
+proxy_flags() {
+  return string(optiinfo.verbose ? " -DPFC_VERBOSE" : "") + (stats_enabled() || trace_enabled() ? " -DPFC_STATS" : "")
+    + (optiinfo.profile ? " -DPFC_PROFILE" : "");
 }
 
 /**
@@ -79,20 +111,83 @@ execute_proxy(
   if (failTime >= 5) error_info("[Compiler Error]", "Cannot create temporary proxy file.");
   else {
     proxy << content; proxy.close();
-    system(("g++ " + proxyName + ".cpp -o " + proxyName).c_str());
+    stats_start("compile", "g++");
+    system(("g++" + proxy_flags() + " " + proxyName + ".cpp -o " + proxyName).c_str());
+    stats_stop("compile");
+    double start = trace_clock();
     if (drawcode) {
       system((proxyName + " > " + ouName + ".draw").c_str());
+      trace_span("run proxy", "process", start);
+      start = trace_clock();
       system((drawCMD + " < " + ouName + ".draw").c_str());
-    } else system((proxyName + " | " + drawCMD).c_str());
+      trace_span("run pfc-draw", "process", start);
+    } else {
+      system((proxyName + " | " + drawCMD).c_str());
+      trace_span("run proxy | pfc-draw", "process", start);
+    }
     system(("rm -f " + proxyName + ".cpp " + proxyName).c_str());
   }
 }
 
+/**
+ * Checks whether a cached shared object may be loaded
+ * @param fileName Path of the shared object
+ * @return true if it is a regular file owned by the caller that nobody else can write
+ */
+bool
+shared_trusted(
+  const string& fileName
+) {
+  struct stat info;
+  if (lstat(fileName.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) return false;
+  return info.st_uid == geteuid() && !(info.st_mode & 022);
+}
+
+/**
+ * Builds generated proxy code as a shared object and lets pfc-draw load it
+ * The object is named after a hash of the proxy code and kept in the per-user
+ * directory, so rendering an unchanged program again skips the g++ step entirely.
+ * pfc-draw runs the object's code, so it is only reused when the caller owns it.
+ * @param content Proxy code content to build
+ * @param ouName Output filename
+ * @param drawCMD Drawing command to execute
+ * @param drawcode Whether to save drawing commands to file
+ */
+void
+execute_shared(
+  const string& content,
+  const string& ouName,
+  string drawCMD,
+  bool drawcode
+) {
+  string tempDir = user_dir();
+  if (tempDir.empty()) error_info("[Compiler Error]", "Cannot create a private directory for shared objects.");
+  string proxyName = tempDir + "proxy_" + hash_string(hash_feed(hash_feed(HASH_SEED, content), proxy_flags()));
+  if (!shared_trusted(proxyName + ".so")) {
+    unlink((proxyName + ".so").c_str());
+    fstream proxy(proxyName + ".cpp", ios::out | ios::trunc);
+    if (!proxy.is_open()) error_info("[Compiler Error]", "Cannot create temporary proxy file.");
+    proxy << content; proxy.close();
+    stats_start("compile", "g++");
+    int status = system(("g++ -shared -fPIC -DPFC_SHARED" + proxy_flags() + " " + proxyName + ".cpp -o " + proxyName + ".tmp.so").c_str());
+    stats_stop("compile");
+    system(("rm -f " + proxyName + ".cpp").c_str());
+    if (status != 0) error_info("[Compiler Error]", "Cannot build proxy shared object.");
+    rename((proxyName + ".tmp.so").c_str(), (proxyName + ".so").c_str());
+  }
+  drawCMD += " " + proxyName + ".so";
+  if (drawcode) drawCMD += " " + ouName + ".draw";
+  double start = trace_clock();
+  system(drawCMD.c_str());
+  trace_span("run pfc-draw", "process", start);
+}
+
 /**
  * Constructs drawing command string
  * @param width Image width in pixels
  * @param height Image height in pixels
  * @param ouName Output filename
+ * @param options Further pfc-draw options, each starting with a space
  * @return Formatted drawing command string
  */
 string
@@ -100,9 +195,10 @@ drawCMD(
   bool antialias,
   int width,
   int height,
-  string ouName
+  string ouName,
+  string options
 ) {
-  return "pfc-draw " + to_string(width) + " " + to_string(height) + " " + ouName + " " + (antialias ? "antialias" : "none");
+  return "pfc-draw " + to_string(width) + " " + to_string(height) + " " + ouName + " " + (antialias ? "antialias" : "none") + options;
 }
 
 string inName;
@@ -110,10 +206,34 @@ string ouName = "a.out";
 
 bool antialias; 
 int width = 200, height = 200;
+int band = -1;   // Band height for striped rendering, -1 for automatic
+int level = -1;  // zlib level of PNG output, -1 for the default
+int tile;        // Tile size of a Deep Zoom pyramid, 0 for a single image
+string format = "png";
 
 bool drawcode;   // Generate drawing commands file
+bool archived;   // Store drawing commands as a binary archive
 bool cprxcode;   // Generate proxy code
 bool lexicode;   // Generate lexical analysis output
+bool outcache;   // Reuse cached output images
+bool sharedobj;  // Load proxy as a shared object
+bool jitmode;    // Run the program with the JIT
+bool redraw;     // Redraw only what changed since the previous run
+bool heatmap;    // Write an overdraw heatmap
+bool stats;      // Print the phase profile
+bool statsJson;  // Print the phase profile as JSON
+string traceName; // Trace file, empty for no trace
+
+/**
+ * Prints the phase profile and writes the trace once the run is complete
+ */
+void
+finish() {
+  // Without -t, the phases go to the PFC_STATS file of the caller, as those of pfc-draw do
+  if (stats) stats_report("pfc", statsJson);
+  else stats_flush("pfc");
+  if (!trace_write("pfc", traceName)) error_info("[Compiler Error]", "Cannot write trace file " + traceName + ".");
+}
 
 int 
 main(
@@ -123,7 +243,13 @@ main(
 
   int index = 1;
   while (index < argc) {
-    if (argv[index][0] == '-') {
+    if (!strcmp(argv[index], "--stats") || !strcmp(argv[index], "--stats=json")) {
+      stats = true;
+      statsJson = argv[index][7] == '=';
+    } else if (!strcmp(argv[index], "--trace")) {
+      if (index + 1 < argc) traceName = argv[++index];
+      else error_info("[Compiler Error]", "No filename after --trace option.");
+    } else if (argv[index][0] == '-') {
       for (int i = 1; i < strlen(argv[index]); i++) {
         bool outTag = false;
         switch (argv[index][i]) {
@@ -133,6 +259,9 @@ main(
           case 'd': // -d
             drawcode = true;
             break;
+          case 'D': // -D
+            drawcode = archived = true;
+            break;
           case 'c': // -c
             cprxcode = true;
             break;
@@ -142,12 +271,73 @@ main(
           case 'a': // -a
             antialias = true;
             break;
+          case 'k': // -k
+            outcache = true;
+            break;
+          case 'j': // -j
+            jitmode = true;
+            break;
+          case 'm': // -m
+            sharedobj = true;
+            break;
+          case 'i': // -i
+            redraw = true;
+            break;
+          case 'v': // -v
+            optiinfo.verbose = true;
+            break;
+          case 't': // -t
+            stats = true;
+            break;
+          case 'H': // -H
+            heatmap = true;
+            break;
+          case 'P': // -P
+            optiinfo.profile = true;
+            break;
+          case 'N': // -N <name>
+            if (index + 1 < argc) {
+              if (!optiinfo.disable(argv[++index])) {
+                error_info("[Compiler Error]", "Unknown optimization " + string(argv[index]) + " after -N option.");
+              }
+              outTag = true;
+            } else error_info("[Compiler Error]", "No optimization name after -N option.");
+            break;
+          case 'K': // -K
+            cache_report();
+            exit(0);
+            break;
           case 'o': // -o <filename>
             if (index + 1 < argc) {
               ouName = string(argv[++index]);
               outTag = true;
             } else error_info("[Compiler Error]", "No filename after -o option.");
             break;
+          case 'b': // -b <rows>
+            if (index + 1 < argc) {
+              band = abs(stoi(argv[++index]));
+              outTag = true;
+            } else error_info("[Compiler Error]", "No band height after -b option.");
+            break;
+          case 'p': // -p <tile>
+            if (index + 1 < argc) {
+              tile = abs(stoi(argv[++index]));
+              outTag = true;
+            } else error_info("[Compiler Error]", "No tile size after -p option.");
+            break;
+          case 'f': // -f <format>
+            if (index + 1 < argc) {
+              format = string(argv[++index]);
+              if (ImageStream::parse(format) < 0) error_info("[Compiler Error]", "Unknown image format " + format + " after -f option.");
+              outTag = true;
+            } else error_info("[Compiler Error]", "No image format after -f option.");
+            break;
+          case 'z': // -z <level>
+            if (index + 1 < argc) {
+              level = min(9, abs(stoi(argv[++index])));
+              outTag = true;
+            } else error_info("[Compiler Error]", "No compression level after -z option.");
+            break;
           case 's': // -s <width> <height>
             if (index + 2 < argc) {
               width = abs(stoi(argv[++index]));
@@ -169,8 +359,78 @@ main(
 
   if (inName.empty()) error_info("[Compiler Error]", "Input filename empty.");
     
+  if (stats) {
+    // Every process of the run appends its phases to this file
+    string statsName = "/tmp/pfc_stats_" + to_string(getpid());
+    FILE *file = fopen(statsName.c_str(), "w");
+    if (!file) error_info("[Compiler Error]", "Cannot create stats file " + statsName + ".");
+    fclose(file);
+    setenv("PFC_STATS", statsName.c_str(), 1);
+  }
+  if (!traceName.empty()) {
+    // Spans are gathered here and written to the trace file at the end
+    string eventName = "/tmp/pfc_trace_" + to_string(getpid());
+    FILE *file = fopen(eventName.c_str(), "w");
+    if (!file) error_info("[Compiler Error]", "Cannot create trace file " + eventName + ".");
+    fclose(file);
+    setenv("PFC_TRACE", eventName.c_str(), 1);
+  }
+
   error_name(inName);
+  stats_start("lex");
   lexicalize(inName, ouName, lexicode);
+  stats_stop("lex");
+  stats_count("lex", "tokens", lexiinfo.size());
+
+  // Intermediate outputs need the later phases, so they always miss the cache.
+  // Only single PNG files are cached.
+  string cacheKey, cacheStamp;
+  if (format != "png" || ouName == "-" || tile > 0 || optiinfo.profile || heatmap) outcache = false;
+  if (optiinfo.profile) {
+    // Inlined calls would vanish from the profile, and the JIT has no counters
+    optiinfo.inlining = false;
+    if (jitmode) cout << "pfc: \033[35m[JIT Note]\033[0m profiling, running the proxy instead." << endl;
+    jitmode = false;
+    setenv("PFC_PROFILE", ("/tmp/pfc_profile_" + to_string(getpid())).c_str(), 1);
+  }
+  if (outcache) {
+    cacheKey = cache_key(antialias, width, height, level);
+    cacheStamp = cache_stamp(ouName);
+    if (!drawcode && !cprxcode && cache_fetch(cacheKey, ouName)) {
+      finish();
+      return 0;
+    }
+  }
+
+  // Parsing and proxy generation are a single pass
+  stats_start("parse/codegen");
   string& content = recognize(ouName, cprxcode);
-  execute_proxy(content, ouName, drawCMD(antialias, width, height, ouName), drawcode);
+  stats_stop("parse/codegen");
+  stats_count("parse/codegen", "functions", funcinfo.vec.size());
+  stats_count("parse/codegen", "variables", variinfo.declared);
+  stats_count("parse/codegen", "bytes", content.size());
+  if (optiinfo.cull) {
+    // Read by the proxy prelude at startup, so executables and shared objects agree.
+    optiinfo.canvasWidth = width, optiinfo.canvasHeight = height;
+    setenv("PFC_CANVAS", (to_string(width) + " " + to_string(height)).c_str(), 1);
+  }
+  if (optiinfo.verbose) setenv("PFC_VERBOSE", "1", 1);
+  if (!optiinfo.occlude) setenv("PFC_OCCLUDE", "0", 1);
+  if (!optiinfo.batch) setenv("PFC_BATCH", "0", 1);
+  string options;
+  if (archived) options += " -w " + ouName + ".draw";
+  if (band >= 0) options += " -b " + to_string(band);
+  if (format != "png") options += " -f " + format;
+  if (level >= 0) options += " -z " + to_string(level);
+  if (tile > 0) options += " -p " + to_string(tile);
+  if (redraw) options += " -i";
+  if (heatmap) options += " -H";
+  bool executed = jitmode && execute_jit(ouName, drawCMD(antialias, width, height, ouName, options), drawcode);
+  if (!executed && sharedobj) execute_shared(content, ouName, drawCMD(antialias, width, height, ouName, options), drawcode);
+  else if (!executed) execute_proxy(content, ouName, drawCMD(antialias, width, height, ouName, options), drawcode);
+  if (optiinfo.profile && !profile_report(inName, (ouName == "-") ? inName : ouName, getenv("PFC_PROFILE"))) {
+    error_info("[Compiler Error]", "The program wrote no profile.");
+  }
+  if (outcache) cache_store(cacheKey, ouName, cacheStamp);
+  finish();
 }
\ No newline at end of file
@@ -0,0 +1,127 @@
+#include "format.hpp"
+#include <unistd.h>
+
+/**
+ * Drawing command as stored before DrawInfo became a structure of arrays
+ * Kept only to measure the old layout against the current one
+ */
+struct
+LegacyItem {
+  string itemName;      // Type of the shape ("line", "circ", "tria", "rect")
+  double params[7];     // Coordinate parameters as floating point
+  string colorParams;   // Color in hex format (e.g. "ff0000" for red)
+};
+
+/**
+ * Gets the resident memory of the process
+ * @return Resident bytes
+ */
+long long
+resident() {
+  long long pages = 0, resident = 0;
+  fstream statm("/proc/self/statm", ios::in);
+  statm >> pages >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Generates the parameters of a pseudo-random command
+ * @param seed Generator state
+ * @param params Receives the parameters
+ * @return Opcode of the command
+ */
+uint8_t
+random_item(
+  uint64_t& seed,
+  double *params
+) {
+  seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  uint8_t op = seed >> 62;
+  for (int i = 0; i < DrawInfo::paramNum[op]; i++) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    params[i] = (seed >> 40) % 400000 / 100.0;
+  }
+  return op;
+}
+
+/**
+ * Prints one row of the benchmark table
+ * @param layout Layout name
+ * @param count Number of commands
+ * @param bytes Bytes held by the container
+ * @param rss Growth of resident memory in bytes
+ * @param seconds Time to fill the container
+ */
+void
+report(
+  string layout,
+  long long count,
+  double bytes,
+  double rss,
+  double seconds
+) {
+  cout
+  << left << setw(12) << layout
+  << right << setw(12) << fixed << setprecision(1) << bytes / count
+  << setw(12) << rss / count
+  << setw(12) << bytes / 1048576
+  << setw(10) << setprecision(3) << seconds << endl;
+}
+
+/**
+ * Memory benchmark of the drawing command store
+ * Fills the legacy layout and DrawInfo with the same pseudo-random commands
+ * Usage: pfc-memory [count]
+ */
+int
+main(
+  int argc,
+  char* argv[]
+) {
+  long long count = (argc > 1) ? atoll(argv[1]) : 10000000;
+  double params[6];
+  char color[8];
+
+  cout
+  << left << setw(12) << "Layout"
+  << right << setw(12) << "Bytes/cmd" << setw(12) << "RSS/cmd" << setw(12) << "MiB" << setw(10) << "Seconds" << endl;
+
+  {
+    uint64_t seed = 1;
+    long long before = resident();
+    clock_t start = clock();
+    vector<LegacyItem> legacy;
+    for (long long i = 0; i < count; i++) {
+      uint8_t op = random_item(seed, params);
+      snprintf(color, sizeof(color), "%06llx", (unsigned long long) (seed & 0xffffff));
+      legacy.push_back((LegacyItem) { DrawInfo::names[op] });
+      // The old store kept width and radius in params[6]
+      int num = DrawInfo::paramNum[op], last = (op <= DRAW_CIRC) ? num - 1 : num;
+      for (int k = 0; k < last; k++) legacy.back().params[k] = params[k];
+      if (last < num) legacy.back().params[6] = params[last];
+      legacy.back().colorParams = color;
+    }
+    double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+    double bytes = legacy.capacity() * sizeof(LegacyItem);
+    for (LegacyItem& item: legacy) {
+      // Strings beyond the small string buffer own a heap block
+      if (item.itemName.capacity() > 15) bytes += item.itemName.capacity() + 1;
+      if (item.colorParams.capacity() > 15) bytes += item.colorParams.capacity() + 1;
+    }
+    report("legacy", count, bytes, resident() - before, seconds);
+  }
+
+  {
+    uint64_t seed = 1;
+    long long before = resident();
+    clock_t start = clock();
+    DrawInfo store;
+    for (long long i = 0; i < count; i++) {
+      uint8_t op = random_item(seed, params);
+      store.push(op, params, seed & 0xffffff);
+    }
+    double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+    report("DrawInfo", count, store.bytes(), resident() - before, seconds);
+  }
+  return 0;
+}
@@ -0,0 +1,125 @@
+#include "format.hpp"
+#include <map>
+
+/**
+ * Counters of one source line, as written by the profiling build of the proxy
+ */
+struct
+ProfileLineItem {
+  long long hits;         // Statements started on the line, calls for a def line
+  long long iterations;   // Loop iterations, for a loop header
+  long long draws;        // Commands drawn
+  long long time;         // Self time in nanoseconds
+};
+
+/**
+ * Formats a counter of the listing, leaving zeros blank
+ * @param value Counter
+ * @param width Column width
+ * @return Padded column
+ */
+string
+profile_column(
+  long long value,
+  int width
+) {
+  ostringstream column;
+  column << right << setw(width);
+  if (value) column << value;
+  else column << "";
+  return column.str();
+}
+
+/**
+ * Writes the results of the profiling build of the proxy
+ * <name>.prof lists the functions by self time, followed by the source annotated
+ * with statement hits, loop iterations, draws and self time per line.
+ * <name>.folded holds the self time of every call stack in microseconds, one
+ * "main;f;g time" line per stack, the input of flame graph tools.
+ * @param inName Source file
+ * @param name Output name without extension
+ * @param rawName Counters written by the proxy
+ * @return false if the proxy wrote no counters
+ */
+bool
+profile_report(
+  const string& inName,
+  const string& name,
+  const string& rawName
+) {
+  fstream raw(rawName, ios::in);
+  if (!raw.is_open()) return false;
+  map<int, ProfileLineItem> lines;
+  vector<long long> calls(funcinfo.vec.size()), self(funcinfo.vec.size()), draws(funcinfo.vec.size());
+  vector<pair<int, int>> nodes(1, make_pair(-1, -1));   // Parent and function of each call stack
+  vector<long long> nodeTime(1);
+  string kind;
+  while (raw >> kind) {
+    if (kind == "L") {
+      int line;
+      ProfileLineItem item;
+      raw >> line >> item.hits >> item.iterations >> item.draws >> item.time;
+      lines[line] = item;
+    } else if (kind == "F") {
+      size_t id;
+      long long c, s, d;
+      raw >> id >> c >> s >> d;
+      if (id < calls.size()) calls[id] = c, self[id] = s, draws[id] = d;
+    } else if (kind == "N") {
+      size_t id;
+      int parent, func;
+      long long time;
+      raw >> id >> parent >> func >> time;
+      if (id >= nodes.size()) nodes.resize(id + 1), nodeTime.resize(id + 1);
+      nodes[id] = make_pair(parent, func), nodeTime[id] = time;
+    } else break;
+  }
+  raw.close();
+  remove(rawName.c_str());
+
+  long long total = 0;
+  for (long long time: self) total += time;
+  double percent = total ? 100.0 / total : 0;
+
+  fstream listing(name + ".prof", ios::out | ios::trunc);
+  if (!listing.is_open()) return false;
+  listing << "Profile of " << inName << ": " << fixed << setprecision(3) << total / 1e6 << " ms in " << funcinfo.vec.size() << " functions" << endl << endl;
+  listing << left << setw(24) << "function" << right << setw(12) << "calls" << setw(12) << "self ms" << setw(8) << "self%" << setw(12) << "draws" << endl;
+  vector<size_t> order(funcinfo.vec.size());
+  for (size_t i = 0; i < order.size(); i++) order[i] = i;
+  stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return self[a] > self[b]; });
+  for (size_t i: order) {
+    listing << left << setw(24) << funcinfo.vec[i] << right << setw(12) << calls[i] << setw(12) << setprecision(3) << self[i] / 1e6
+      << setw(7) << setprecision(1) << self[i] * percent << "%" << setw(12) << draws[i] << endl;
+  }
+  bool memoized = false;
+  for (auto& memo: funcinfo.memo) memoized = memoized || memo.second;
+  if (memoized) listing << endl << "Calls answered by a memo table are not counted." << endl;
+
+  listing << endl << right << setw(10) << "hits" << setw(10) << "iters" << setw(10) << "draws" << setw(12) << "self ms" << setw(8) << "self%" << "  line" << endl;
+  fstream source(inName, ios::in);
+  string text;
+  for (int number = 1; getline(source, text); number++) {
+    ProfileLineItem item = lines.count(number) ? lines[number] : ProfileLineItem { 0, 0, 0, 0 };
+    listing << profile_column(item.hits, 10) << profile_column(item.iterations, 10) << profile_column(item.draws, 10);
+    if (item.time) listing << setw(12) << setprecision(3) << item.time / 1e6 << setw(7) << setprecision(1) << item.time * percent << "%";
+    else listing << setw(20) << "";
+    listing << setw(6) << number << "  " << text << endl;
+  }
+  listing.close();
+
+  fstream folded(name + ".folded", ios::out | ios::trunc);
+  if (!folded.is_open()) return false;
+  for (size_t id = 1; id < nodes.size(); id++) {
+    long long micro = nodeTime[id] / 1000;
+    if (micro <= 0) continue;
+    string stack;
+    for (int at = id; at > 0 && nodes[at].second >= 0 && nodes[at].second < (int) funcinfo.vec.size(); at = nodes[at].first) {
+      stack = funcinfo.vec[nodes[at].second] + (stack.empty() ? "" : ";") + stack;
+    }
+    folded << stack << " " << micro << endl;
+  }
+  folded.close();
+  cout << "pfc: \033[36m[Profile]\033[0m wrote " << name << ".prof and " << name << ".folded" << endl;
+  return true;
+}
@@ -0,0 +1,343 @@
+#include "format.hpp"
+#include <mutex>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+/**
+ * Resource use of one phase of a run
+ * A phase may run several times, as rasterizing and encoding do for every band;
+ * its times add up over the runs.
+ */
+struct
+StatPhase {
+  string process;             // Process that ran the phase
+  string name;                // Phase name
+  bool children = false;      // Measures the child processes waited for instead of the caller
+  double begin = -1;          // Wall clock time the phase first started, in seconds
+  double wall = 0, cpu = 0;   // Seconds spent in the phase
+  long long rss = 0;          // Peak resident memory in KiB
+  vector<pair<string, long long>> counts;   // Items handled in the phase
+  double wallStart, cpuStart; // Start of the current run
+};
+
+/**
+ * Phases measured by this process, appended to the PFC_STATS file on flush
+ */
+vector<StatPhase> statphases;
+
+/**
+ * Trace events recorded by this process, one JSON object each, appended to the
+ * PFC_TRACE file on flush. Spans may be recorded by worker threads.
+ */
+vector<string> traceevents;
+mutex tracelock;
+
+/**
+ * Gets the wall clock time
+ * The monotonic clock is shared by all processes of the host, so the phases and
+ * spans of pfc, the proxy and pfc-draw line up on one timeline.
+ * @return Seconds since an unspecified start
+ */
+double
+stats_wall() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Gets the CPU time used so far, by all threads
+ * @param children Whether to get the time of the child processes waited for instead
+ * @return CPU seconds
+ */
+double
+stats_cpu(
+  bool children
+) {
+  if (!children) {
+    timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+  }
+  rusage usage;
+  getrusage(RUSAGE_CHILDREN, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/**
+ * Checks whether phases are measured, which pfc -t requests through PFC_STATS
+ * @return true if phases are measured
+ */
+bool
+stats_enabled() {
+  return getenv("PFC_STATS") != NULL;
+}
+
+/**
+ * Checks whether spans are traced, which pfc --trace requests through PFC_TRACE
+ * @return true if spans are traced
+ */
+bool
+trace_enabled() {
+  return getenv("PFC_TRACE") != NULL;
+}
+
+/**
+ * Gets the time of the trace clock
+ * @return Microseconds on the clock of stats_wall
+ */
+double
+trace_clock() {
+  return stats_wall() * 1e6;
+}
+
+/**
+ * Records a complete span ending now, in the Trace Event Format
+ * @param name Span name
+ * @param category Span category
+ * @param start Start of the span from trace_clock
+ * @param args Members of the args object in JSON, empty for none
+ */
+void
+trace_span(
+  const string& name,
+  const string& category,
+  double start,
+  const string& args
+) {
+  if (!trace_enabled()) return;
+  char event[256];
+  snprintf(event, sizeof(event), "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d, \"args\": {",
+    name.c_str(), category.c_str(), start, trace_clock() - start, (int) getpid(), (int) syscall(SYS_gettid));
+  lock_guard<mutex> guard(tracelock);
+  traceevents.push_back(event + args + "}}");
+}
+
+/**
+ * Gets a phase, adding it on first use
+ * @param name Phase name
+ * @return Phase
+ */
+StatPhase&
+stats_phase(
+  const string& name
+) {
+  for (StatPhase& phase: statphases) if (phase.name == name) return phase;
+  statphases.push_back(StatPhase());
+  statphases.back().name = name;
+  return statphases.back();
+}
+
+/**
+ * Starts or resumes a phase
+ * @param name Phase name
+ * @param child Name of the child process doing the work, NULL for the caller itself
+ */
+void
+stats_start(
+  const string& name,
+  const char *child
+) {
+  if (!stats_enabled() && !trace_enabled()) return;
+  StatPhase& phase = stats_phase(name);
+  phase.wallStart = stats_wall();
+  if (phase.begin < 0) {
+    phase.begin = phase.wallStart;
+    phase.children = child != NULL;
+    if (child) phase.process = child;
+  }
+  phase.cpuStart = stats_cpu(phase.children);
+}
+
+/**
+ * Pauses a phase, adding the time since it was started
+ * Every run of a phase is also traced as a span.
+ * @param name Phase name
+ */
+void
+stats_stop(
+  const string& name
+) {
+  if (!stats_enabled() && !trace_enabled()) return;
+  StatPhase& phase = stats_phase(name);
+  trace_span(name, "phase", phase.wallStart * 1e6, phase.children ? "\"process\": \"" + phase.process + "\"" : "");
+  phase.wall += stats_wall() - phase.wallStart;
+  phase.cpu += stats_cpu(phase.children) - phase.cpuStart;
+  rusage usage;
+  getrusage(phase.children ? RUSAGE_CHILDREN : RUSAGE_SELF, &usage);
+  phase.rss = usage.ru_maxrss;
+}
+
+/**
+ * Adds to an item count of a phase
+ * @param name Phase name
+ * @param item Item name
+ * @param value Number of items
+ */
+void
+stats_count(
+  const string& name,
+  const string& item,
+  long long value
+) {
+  if (!stats_enabled()) return;
+  StatPhase& phase = stats_phase(name);
+  for (auto& count: phase.counts) {
+    if (count.first == item) {
+      count.second += value;
+      return;
+    }
+  }
+  phase.counts.push_back(make_pair(item, value));
+}
+
+/**
+ * Appends the traced spans to the PFC_TRACE file, one event per line
+ * The first line names the process.
+ * @param process Name of this process
+ */
+void
+trace_flush(
+  const string& process
+) {
+  if (!trace_enabled()) return;
+  lock_guard<mutex> guard(tracelock);
+  if (traceevents.empty()) return;
+  string lines = "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " + to_string(getpid()) + ", \"args\": {\"name\": \"" + process + "\"}}\n";
+  for (string& event: traceevents) lines += event + "\n";
+  FILE *file = fopen(getenv("PFC_TRACE"), "a");
+  if (!file) return;
+  fwrite(lines.data(), 1, lines.size(), file);
+  fclose(file);
+  traceevents.clear();
+}
+
+/**
+ * Appends the measured phases to the PFC_STATS file, and the spans to the PFC_TRACE file
+ * One line per phase: process, phase, begin, wall, cpu, rss and item=count pairs,
+ * separated by tabs. The proxy prelude writes the same format.
+ * @param process Name of this process
+ */
+void
+stats_flush(
+  const string& process
+) {
+  trace_flush(process);
+  if (!stats_enabled() || statphases.empty()) return;
+  string lines;
+  char field[128];
+  for (StatPhase& phase: statphases) {
+    if (phase.begin < 0) continue;
+    snprintf(field, sizeof(field), "\t%s\t%.6f\t%.6f\t%.6f\t%lld\t", phase.name.c_str(), phase.begin, phase.wall, phase.cpu, phase.rss);
+    lines += (phase.process.empty() ? process : phase.process) + field;
+    for (size_t i = 0; i < phase.counts.size(); i++) {
+      lines += (i ? " " : "") + phase.counts[i].first + "=" + to_string(phase.counts[i].second);
+    }
+    lines += "\n";
+  }
+  // A single append, so lines of processes finishing together do not interleave
+  FILE *file = fopen(getenv("PFC_STATS"), "a");
+  if (!file) return;
+  fwrite(lines.data(), 1, lines.size(), file);
+  fclose(file);
+  statphases.clear();
+}
+
+/**
+ * Prints the phases of all processes of the run to standard error and removes the file
+ * Phases are listed in the order they started. Phases of different processes
+ * may overlap, as the proxy and pfc-draw run as a pipeline.
+ * @param process Name of this process, whose phases are flushed first
+ * @param json Whether to print JSON instead of a table
+ */
+void
+stats_report(
+  const string& process,
+  bool json
+) {
+  if (!stats_enabled()) return;
+  stats_flush(process);
+  string fileName = getenv("PFC_STATS");
+  fstream file(fileName, ios::in);
+  vector<StatPhase> phases;
+  string line;
+  while (getline(file, line)) {
+    istringstream fields(line);
+    StatPhase phase;
+    string counts;
+    getline(fields, phase.process, '\t');
+    getline(fields, phase.name, '\t');
+    fields >> phase.begin >> phase.wall >> phase.cpu >> phase.rss;
+    if (!fields) continue;
+    fields.get();
+    getline(fields, counts);
+    istringstream items(counts);
+    string item;
+    while (items >> item) {
+      size_t equal = item.find('=');
+      if (equal != string::npos) phase.counts.push_back(make_pair(item.substr(0, equal), atoll(item.c_str() + equal + 1)));
+    }
+    phases.push_back(phase);
+  }
+  file.close();
+  remove(fileName.c_str());
+  stable_sort(phases.begin(), phases.end(), [](const StatPhase& a, const StatPhase& b) { return a.begin < b.begin; });
+
+  double first = phases.empty() ? 0 : phases[0].begin, last = first;
+  for (StatPhase& phase: phases) last = max(last, phase.begin + phase.wall);
+
+  if (json) {
+    fprintf(stderr, "{\n  \"wall_ms\": %.3f,\n  \"phases\": [", (last - first) * 1000);
+    for (size_t i = 0; i < phases.size(); i++) {
+      StatPhase& phase = phases[i];
+      fprintf(stderr, "%s\n    { \"process\": \"%s\", \"phase\": \"%s\", \"start_ms\": %.3f, \"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"peak_rss_kib\": %lld, \"items\": {",
+        i ? "," : "", phase.process.c_str(), phase.name.c_str(), (phase.begin - first) * 1000, phase.wall * 1000, phase.cpu * 1000, phase.rss);
+      for (size_t k = 0; k < phase.counts.size(); k++) {
+        fprintf(stderr, "%s \"%s\": %lld", k ? "," : "", phase.counts[k].first.c_str(), phase.counts[k].second);
+      }
+      fprintf(stderr, "%s} }", phase.counts.empty() ? "" : " ");
+    }
+    fprintf(stderr, "\n  ]\n}\n");
+    return;
+  }
+
+  fprintf(stderr, "pfc: \033[36m[Stats]\033[0m %-9s %-14s %10s %10s %10s %10s  %s\n", "process", "phase", "start ms", "wall ms", "cpu ms", "peak MiB", "items");
+  for (StatPhase& phase: phases) {
+    string counts;
+    for (auto& count: phase.counts) counts += (counts.empty() ? "  " : " ") + count.first + " " + to_string(count.second);
+    fprintf(stderr, "pfc: \033[36m[Stats]\033[0m %-9s %-14s %10.2f %10.2f %10.2f %10.1f%s\n", phase.process.c_str(), phase.name.c_str(),
+      (phase.begin - first) * 1000, phase.wall * 1000, phase.cpu * 1000, phase.rss / 1024.0, counts.c_str());
+  }
+  fprintf(stderr, "pfc: \033[36m[Stats]\033[0m %-24s %10s %10.2f\n", "total", "", (last - first) * 1000);
+}
+
+/**
+ * Writes the spans of all processes of the run as one Trace Event Format file
+ * The events are gathered in the PFC_TRACE file, which is removed afterwards.
+ * @param process Name of this process, whose spans are flushed first
+ * @param fileName Trace file, for chrome://tracing or Perfetto
+ * @return false if the trace cannot be written
+ */
+bool
+trace_write(
+  const string& process,
+  const string& fileName
+) {
+  if (!trace_enabled()) return true;
+  trace_flush(process);
+  string eventName = getenv("PFC_TRACE");
+  fstream events(eventName, ios::in);
+  FILE *trace = fopen(fileName.c_str(), "w");
+  if (!trace) {
+    remove(eventName.c_str());
+    return false;
+  }
+  fprintf(trace, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  string line;
+  for (bool first = true; getline(events, line); first = false) fprintf(trace, "%s\n%s", first ? "" : ",", line.c_str());
+  fprintf(trace, "\n]}\n");
+  events.close();
+  remove(eventName.c_str());
+  return fclose(trace) == 0;
+}
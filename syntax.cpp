@@ -1,28 +1,52 @@
 #include "format.hpp"
 
 // Recognize Functions
-FormItem reco_parameters(int&, string);
+FormItem reco_parameters(int&, string, vector<string>* = NULL);
 FormItem reco_call(int&, string);
-FormItem reco_power(list<FormItem>&, list<FormItem>::iterator&);
-FormItem reco_formula_inner(int&);
-string reco_formula(int&);
+FormItem reco_fold(vector<FormItem>&, int&, int, bool&);
+string fold_convert(FormItem&, string);
+FormItem reco_formula_inner(int&, bool = false);
+string reco_formula(int&, bool = false, string = "");
 string reco_vec(int&, bool);
+string reco_draw_array(int&);
 string reco_draw(int&);
 string reco_define(int&, int);
 string reco_compare(int&);
 string reco_multiformula(int&);
 string reco_for(int&);
+void check_write(LexiItem&);
+string reco_pfor(int&);
+int task_call_end(int);
+bool check_elementwise(int, int);
+string reco_tasks(int&);
 string reco_if(int&);
 string reco_while(int&);
 string reco_return(int&);
 string reco_block(int&, bool* = NULL);
-string reco_paralist(int&, int&);
+string reco_paralist(int&, int&, vector<ParaItem>&);
 string reco_function(int&);
 
 int blockLayer;
 bool reqReturnVal;
 string nowFuncName;
 
+bool nowFuncImpure;              // Current function draws or calls an impure function
+int nowFuncCost;                 // Static cost of the current function beyond its own tokens
+int loopDepth;                   // Loops enclosing the current token
+int inlineDepth;                 // Inlined calls enclosing the current token
+unordered_map<string, string> inlineRename;  // Parameters of the inlined function to their temporaries
+int pforLayer = -1;              // Scope layer of the innermost pfor index, -1 outside pfor bodies
+string pforIndex;                // Index of the innermost pfor
+int pforCount;                   // pfor statements generated so far, for unique helper names
+vector<string> pforWrites;       // Outer arrays written at the index of the innermost pfor
+bool nowFuncWrites;              // Current function may write the elements of an array parameter
+const int maxArray = 1 << 18;    // Elements of the largest local array
+const int stackArray = 1 << 12;  // Elements of the largest local array on the stack, larger ones live on the heap
+int taskCount;                   // Groups of sibling calls run as tasks so far
+const int loopFactor = 8;        // Assumed iterations of a loop
+const int recursionCost = 1024;  // Assumed cost of a recursive call
+const int maxCost = 1 << 24;     // Cost estimates saturate here
+
 /**
  * Checks if current token is a syntax boundary
  * @param index Current token index
@@ -36,10 +60,42 @@ check_boarder(
     lexiinfo[index].lexiID != keywords.id(",") &&
     lexiinfo[index].lexiID != keywords.id(";") &&
     lexiinfo[index].lexiID != keywords.id(")") &&
+    lexiinfo[index].lexiID != keywords.id("[") &&
+    lexiinfo[index].lexiID != keywords.id("]") &&
     lexiinfo[index].lexiID != keywords.id("color") &&
     !isCompOperator(lexiinfo[index].lexiID);
 }
 
+/**
+ * Checks if a call can be replaced by the returned formula of its function
+ * Arguments must be free of side effects, so their evaluation order does not matter
+ * @param index Token index of the called function name
+ * @param caller Name of the calling function
+ * @param depth Inlined calls enclosing the call
+ * @return true if the call should be inlined
+ */
+bool
+check_inline(
+  int index,
+  string caller,
+  int depth
+) {
+  if (!optiinfo.inlining || !funcinfo.inlineAt[lexiinfo[index].content] || depth >= optiinfo.inlineDepth) return false;
+  int layer = 0;
+  for (index++; lexiinfo[index].lexiID; index++) {
+    int id = lexiinfo[index].lexiID;
+    if (id == keywords.id("(")) layer++;
+    if (id == keywords.id(")") && --layer == 0) break;
+    if (isInDeOperator(id)) return false;
+    if (
+      id == keywords.id("identifier") &&
+      lexiinfo[index + 1].lexiID == keywords.id("(") &&
+      (lexiinfo[index].content == caller || !funcinfo.pure(lexiinfo[index].content))
+    ) return false;
+  }
+  return true;
+}
+
 /**
  * Repeats a string a specified number of times
  * @param str String to repeat
@@ -56,16 +112,43 @@ repeatString(
   return retString;
 }
 
+/**
+ * Gets the element type of an array type
+ * @param type Variable type, "float[64]" for a local array or "float[]" for an array parameter
+ * @return Element type, empty if the type is not an array
+ */
+string
+array_element(
+  const string& type
+) {
+  size_t bracket = type.find('[');
+  return bracket == string::npos ? "" : type.substr(0, bracket);
+}
+
+/**
+ * Adds static cost to the current function, scaled by the enclosing loops
+ * @param cost Cost of one execution
+ */
+void
+add_cost(
+  long long cost
+) {
+  for (int i = 0; i < loopDepth && cost < maxCost; i++) cost *= loopFactor;
+  nowFuncCost = min((long long) maxCost, nowFuncCost + cost);
+}
+
 /**
  * Processes function parameters in a call
  * @param index Current token index
  * @param funcName Name of function being called
+ * @param args Receives each processed argument if not NULL
  * @return FormItem containing processed parameters
  */
 FormItem 
 reco_parameters(
   int& index,
-  string funcName
+  string funcName,
+  vector<string>* args
 ) {
   FormItem item;
   int numParam = funcinfo.num(funcName);
@@ -77,7 +160,23 @@ reco_parameters(
   while (lexiinfo[index].lexiID != keywords.id(")")) {
     if (lexiinfo[index].lexiID == keywords.id(",")) {
       item += FormItem(lexiinfo[index++]).back_push(" ");
-    } else item += reco_formula_inner(index), numParam--;
+    } else {
+      int at = index, param = funcinfo.num(funcName) - numParam;
+      FormItem arg = reco_formula_inner(index);
+      if (param < funcinfo.params[funcName].size()) {
+        string element = array_element(arg.valueType), expected = array_element(funcinfo.params[funcName][param].type);
+        if (element != expected) error_item(
+          "[Semantic Error]",
+          expected.empty() ? "An array cannot be passed for a number." : "Parameter " + to_string(param + 1) + " of function " + funcName + " is an array of " + expected + ".",
+          lexiinfo[at]
+        );
+        // Arrays are passed by reference, so a callee writing its array parameter writes the argument
+        if (!element.empty() && (funcName == nowFuncName ? pforLayer >= 0 : funcinfo.writes[funcName])) check_write(lexiinfo[at]);
+        arg = arg.withCon(fold_convert(arg, funcinfo.params[funcName][param].type));
+      }
+      if (args) args->push_back(arg.content);
+      item += arg, numParam--;
+    }
   }
 
   if (numParam != 0) error_item(
@@ -93,6 +192,38 @@ reco_parameters(
   return item;
 } 
 
+/**
+ * Expands an inlined call into a statement expression
+ * Arguments are bound to renamed temporaries, so they are converted and evaluated once,
+ * and the returned formula is recognized again in a scope holding only the parameters.
+ * @param funcName Name of the inlined function
+ * @param args Processed arguments
+ * @return String containing the inlined call
+ */
+string
+reco_inline(
+  string funcName,
+  vector<string>& args
+) {
+  vector<ParaItem>& params = funcinfo.params[funcName];
+  string content = "({ ", prefix = "Inline" + to_string(++optiinfo.inlined) + "_";
+  unordered_map<string, string> rename;
+  for (int i = 0; i < params.size(); i++) {
+    content += params[i].type + " " + prefix + params[i].paraName + " = " + args[i] + "; ";
+    rename[params[i].paraName] = prefix + params[i].paraName;
+  }
+
+  swap(rename, inlineRename);
+  ++blockLayer, inlineDepth++;
+  for (ParaItem& param: params) variinfo.add(param.paraName, param.type, blockLayer);
+  int at = funcinfo.inlineAt[funcName];
+  content += "(" + funcinfo.type[funcName] + ") (" + reco_formula(at, false, funcinfo.type[funcName]) + "); })";
+  variinfo.del(blockLayer--), inlineDepth--;
+  swap(rename, inlineRename);
+
+  return content;
+}
+
 /**
  * Processes a function call
  * @param index Current token index
@@ -105,48 +236,237 @@ reco_call(
   string funcName
 ) {
   FormItem item;
+  vector<string> args;
+  bool inlined = check_inline(index, nowFuncName, inlineDepth);
 
   if (lexiinfo[index].lexiID == keywords.id("identifier")) {
     item = FormItem(lexiinfo[index++]);
   } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be IDENTIFIER.", lexiinfo[index]);
 
   if (lexiinfo[index].lexiID == keywords.id("(")) {
-    item += reco_parameters(index, funcName);
+    item += reco_parameters(index, funcName, &args);
+  }
+
+  if (inlined) {
+    optiinfo.log(funcName + ": call at line " + to_string(item.line) + " inlined.");
+    item = item.withCon(reco_inline(funcName, args));
+  }
+
+  if (funcName == nowFuncName) add_cost(recursionCost);
+  else {
+    add_cost(funcinfo.cost[funcName]);
+    if (!funcinfo.pure(funcName)) nowFuncImpure = true;
   }
 
   return item;
 }
 
 /**
- * Processes power operator expressions
- * @param phrase List of tokens in expression
- * @param it Iterator to current position
- * @return FormItem containing processed power expression
+ * Evaluates a binary operator on constants with the semantics of the emitted C++ code
+ * @param op Operator ("+", "-", "*", "/" or "^")
+ * @param type Type of the left operand, replaced by the type of the result
+ * @param value Left operand, replaced by the result
+ * @param rightType Type of the right operand
+ * @param right Right operand
+ * @return false if the operation must stay at runtime (unknown type, overflow, division by zero, non-finite result)
+ */
+bool
+fold_constant(
+  string op,
+  string& type,
+  double& value,
+  string rightType,
+  double right
+) {
+  for (string t: { type, rightType }) {
+    if (t != "int" && t != "float" && t != "double") return false;
+  }
+  string resultType;
+  double result;
+  if (op == "^") {
+    resultType = "float", result = runtime_power(value, right);
+  } else if (type == "int" && rightType == "int") {
+    long long a = value, b = right;
+    if (op == "/" && b == 0) return false;
+    long long r = (op == "+") ? a + b : (op == "-") ? a - b : (op == "*") ? a * b : a / b;
+    if (r <= INT32_MIN || r > INT32_MAX) return false;   // INT32_MIN has no int literal
+    resultType = "int", result = r;
+  } else if (type == "double" || rightType == "double") {
+    double a = value, b = right;
+    resultType = "double", result = (op == "+") ? a + b : (op == "-") ? a - b : (op == "*") ? a * b : a / b;
+  } else {
+    float a = value, b = right;
+    float r = (op == "+") ? a + b : (op == "-") ? a - b : (op == "*") ? a * b : a / b;
+    resultType = "float", result = r;
+  }
+  if (!isfinite(result)) return false;
+  type = resultType, value = result;
+  return true;
+}
+
+/**
+ * Writes a folded constant as C++ code of the same type
+ * @param type Type of the constant
+ * @param value Value of the constant
+ * @return Literal, parenthesized when it could bind to a neighbouring operator
+ */
+string
+fold_literal(
+  string type,
+  double value
+) {
+  if (type == "int") {
+    string text = to_string((long long) value);
+    return value < 0 ? "(" + text + ")" : text;
+  }
+  char buffer[32];
+  for (int precision = 1; precision <= 17; precision++) {
+    snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+    if (type == "float" ? (float) strtod(buffer, NULL) == (float) value : strtod(buffer, NULL) == value) break;
+  }
+  string text = buffer;
+  if (text.find_first_of(".e") == string::npos) text += ".0";
+  if (type == "float") return "((float) " + text + ")";
+  return value < 0 ? "(" + text + ")" : text;
+}
+
+/**
+ * Gets the type of a binary operation following the usual arithmetic conversions
+ * @param op Operator
+ * @param left Type of the left operand
+ * @param right Type of the right operand
+ * @return Result type, empty if unknown
+ */
+string
+fold_type(
+  string op,
+  string left,
+  string right
+) {
+  if (op == "^") return "float";
+  if (left.empty() || right.empty()) return "";
+  if (left == "double" || right == "double") return "double";
+  if (left == "float" || right == "float") return "float";
+  return "int";
+}
+
+/**
+ * Combines two operands, folding constants and expanding small integer powers
+ * Power(x, k) for k = 1 ~ 4 repeats the square-and-multiply steps of the prelude,
+ * so the result stays bit-identical.
+ * @param op Operator
+ * @param left Left operand
+ * @param right Right operand
+ * @return FormItem containing the combined expression
  */
 FormItem
-reco_power(
-  list<FormItem>& phrase,
-  list<FormItem>::iterator& it
+fold_binary(
+  string op,
+  FormItem left,
+  FormItem right
 ) {
-  FormItem item = *(it++);
-  item = item.front_push("Power(") + (it++)->withCon(", ");
-  if (
-    it != phrase.end() && 
-    next(it) != phrase.end() && 
-    next(it)->content == "^"
-  ) item += reco_power(phrase, it).back_push(")");
-  else item += (it++)->back_push(")");
+  string text = (op == "^") ? "Power(" + left.content + ", " + right.content + ")" : left.content + " " + op + " " + right.content;
+  FormItem item = left.withCon(text).withDis("subexpression");
+  item.valueType = fold_type(op, left.valueType, right.valueType);
+  item.constant = false, item.runtime = "";
+  if (!optiinfo.fold) return item;
+
+  string type = left.valueType;
+  double value = left.value;
+  if (left.constant && right.constant && fold_constant(op, type, value, right.valueType, right.value)) {
+    string leftCode = left.runtime.empty() ? left.content : left.runtime, rightCode = right.runtime.empty() ? right.content : right.runtime;
+    item.runtime = (op == "^") ? "Power(" + leftCode + ", " + rightCode + ")" : leftCode + " " + op + " " + rightCode;
+    item.content = fold_literal(type, value);
+    item.valueType = type, item.constant = true, item.value = value;
+    optiinfo.log("line " + to_string(item.line) + ": folded " + text + " into " + item.content + ".");
+  } else if (op == "^" && right.constant && right.value >= 1 && right.value <= 4 && right.value == (int) right.value) {
+    static int powers;
+    string base = left.content, prefix;
+    bool simple = !left.constant && base.find_first_not_of("0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_") == string::npos;
+    if (!simple) {
+      prefix = "({ double Power" + to_string(++powers) + " = " + base + "; ";
+      base = "Power" + to_string(powers);
+    } else base = "(double) " + base;
+    string square = "(" + base + " * " + base + ")";
+    string chain[] = { base, square, "(" + base + " * " + square + ")", "(" + square + " * " + square + ")" };
+    item.content = prefix + "(float) " + chain[(int) right.value - 1] + (simple ? "" : "; })");
+    if (simple) item.content = "(" + item.content + ")";
+    optiinfo.log("line " + to_string(item.line) + ": expanded " + text + " into multiplications.");
+  }
+  return item;
+}
+
+/**
+ * Gets the code of a formula whose value is converted to the type of its destination
+ * g++ saturates a constant beyond the int range when converting it to int at compile time,
+ * while the conversion at runtime does not, so such a folded constant keeps its unfolded expression.
+ * @param item Processed formula
+ * @param target Type of the destination, empty if unknown
+ * @return Code of the formula
+ */
+string
+fold_convert(
+  FormItem& item,
+  string target
+) {
+  if (target != "int" || !item.constant || item.valueType == "int" || item.runtime.empty()) return item.content;
+  if (item.value > (double) INT32_MIN - 1 && item.value < (double) INT32_MAX + 1) return item.content;
+  optiinfo.log("line " + to_string(item.line) + ": kept " + item.runtime + " unfolded, its value is beyond the int range.");
+  return item.runtime;
+}
+
+/**
+ * Builds an expression from a checked phrase with the precedence of the emitted C++ code
+ * @param items Operands and operators of the phrase
+ * @param pos Current position in items
+ * @param level Precedence level (0: "+" "-", 1: "*" "/", 2: "^")
+ * @param castFirst Whether the first power chain is still to be cast to double, like draw arguments
+ * @return FormItem containing the expression
+ */
+FormItem
+reco_fold(
+  vector<FormItem>& items,
+  int& pos,
+  int level,
+  bool& castFirst
+) {
+  if (level == 2) {
+    FormItem item = items[pos++];
+    if (pos < items.size() && items[pos].content == "^") {
+      bool noCast = false;
+      pos++;
+      item = fold_binary("^", item, reco_fold(items, pos, 2, noCast));
+    }
+    if (castFirst) {
+      item = item.front_push("(double) ");
+      if (!item.runtime.empty()) item.runtime = "(double) " + item.runtime;
+      item.valueType = "double";
+      castFirst = false;
+    }
+    return item;
+  }
+
+  FormItem item = reco_fold(items, pos, level + 1, castFirst);
+  while (
+    pos < items.size() && 
+    (level == 0 ? (items[pos].content == "+" || items[pos].content == "-") : (items[pos].content == "*" || items[pos].content == "/"))
+  ) {
+    string op = items[pos++].content;
+    item = fold_binary(op, item, reco_fold(items, pos, level + 1, castFirst));
+  }
   return item;
 }
 
 /**
  * Processes inner parts of a formula
  * @param index Current token index
+ * @param castFirst Whether the first power chain is cast to double, like draw arguments
  * @return FormItem containing processed formula
  */
 FormItem
 reco_formula_inner(
-  int& index
+  int& index,
+  bool castFirst
 ) {
   FormItem item;
   list<FormItem> phrase;
@@ -154,33 +474,77 @@ reco_formula_inner(
   while (check_boarder(index)) {
 
     if (lexiinfo[index].lexiID == keywords.id("(")) {
-      FormItem item = FormItem(lexiinfo[index++]);
-      item += reco_formula_inner(index);
+      FormItem item = FormItem(lexiinfo[index++]), inner = reco_formula_inner(index);
+      item += inner;
       if (lexiinfo[index].lexiID == keywords.id(")")) {
         item += lexiinfo[index++];
       } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \")\".", lexiinfo[index]);
+      if (!array_element(inner.valueType).empty()) error_form("[Semantic Error]", "An array is used only through its elements.", inner);
+      item.valueType = inner.valueType, item.constant = inner.constant, item.value = inner.value;
+      if (!inner.runtime.empty()) item.runtime = "(" + inner.runtime + ")";
       phrase.push_back(item);
     }
     
     if (lexiinfo[index].lexiID == keywords.id("identifier")) {
       if (lexiinfo[index + 1].lexiID == keywords.id("(")) {
         if (funcinfo.exist(lexiinfo[index].content)) {
+          string type = funcinfo.type[lexiinfo[index].content];
           phrase.push_back(reco_call(index, lexiinfo[index].content).withDis("function"));
+          phrase.back().valueType = type;
         } else error_item("[Semantic Error]", "Undefined function.", lexiinfo[index]);
       } else {
         if (variinfo.exist(lexiinfo[index].content, blockLayer)) {
+          int at = index;
           FormItem item = FormItem(lexiinfo[index++]).withDis("identifier");
+          string type = variinfo.type(item.content, blockLayer);
+          if (inlineRename.count(item.content)) item = item.withCon(inlineRename[item.content]);
+          if (lexiinfo[index].lexiID == keywords.id("[")) {
+            if (array_element(type).empty()) error_item("[Semantic Error]", "Only arrays can be indexed.", lexiinfo[index]);
+            item += FormItem(lexiinfo[index++]);
+            FormItem subscript = reco_formula_inner(index);
+            if (subscript.content == "") error_item("[Syntax Error]", "Formula missing.", lexiinfo[index]);
+            if (subscript.valueType != "int") error_form("[Semantic Error]", "An array index must be an int.", subscript);
+            item += subscript;
+            if (lexiinfo[index].lexiID == keywords.id("]")) {
+              item += FormItem(lexiinfo[index++]);
+            } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \"]\".", lexiinfo[index]);
+            item = item.withDis("identifier");
+            type = array_element(type);
+            if (isInDeOperator(lexiinfo[index].lexiID)) check_write(lexiinfo[at]);
+          }
           if (!phrase.empty() && phrase.back().typeDis == "indecrement") {
+            check_write(lexiinfo[at]);
             item = phrase.back() + item;
             phrase.pop_back();
           }
+          item.valueType = type;
           phrase.push_back(item);
         } else error_item("[Semantic Error]", "Undefined variable.", lexiinfo[index]);
       }
     }
 
+    if (lexiinfo[index].lexiID == keywords.id("len")) {
+      FormItem item = FormItem(lexiinfo[index++]).withDis("function");
+      if (lexiinfo[index].lexiID != keywords.id("(") || lexiinfo[index + 1].lexiID != keywords.id("identifier") || lexiinfo[index + 2].lexiID != keywords.id(")")) {
+        error_item("[Syntax Error]", "Incomplete syntax structure. Here should be len(ARRAY).", lexiinfo[index]);
+      }
+      string name = lexiinfo[index + 1].content, type = variinfo.type(name, blockLayer);
+      if (array_element(type).empty()) error_item("[Semantic Error]", "len() takes an array.", lexiinfo[index + 1]);
+      index += 3;
+      // Local arrays have a constant length, array parameters carry theirs
+      string size = type.substr(type.find('[') + 1, type.size() - type.find('[') - 2);
+      item = item.withCon(size.empty() ? name + ".size" : size);
+      item.valueType = "int";
+      if (!size.empty()) item.constant = true, item.value = stoi(size);
+      phrase.push_back(item);
+    }
+
     if (isNumber(lexiinfo[index].lexiID)) {
-      phrase.push_back(FormItem(lexiinfo[index++]).withDis("number"));
+      FormItem item = FormItem(lexiinfo[index++]).withDis("number");
+      item.value = stod(item.content);
+      item.valueType = (lexiinfo[index - 1].lexiID == keywords.id("float")) ? "double" : (item.value <= INT32_MAX) ? "int" : "";
+      item.constant = (item.valueType != "");
+      phrase.push_back(item);
     }
 
     if (isAritOperator(lexiinfo[index].lexiID)) {
@@ -190,7 +554,10 @@ reco_formula_inner(
     if (isInDeOperator(lexiinfo[index].lexiID)) {
       FormItem item = FormItem(lexiinfo[index++]).withDis("indecrement");
       if (!phrase.empty() && phrase.back().typeDis == "identifier") {
+        check_write(lexiinfo[index - 2]);
+        string type = phrase.back().valueType;
         item = phrase.back() + item;
+        item.valueType = type;
         phrase.pop_back();
       }
       phrase.push_back(item);
@@ -205,6 +572,12 @@ reco_formula_inner(
     ((it_)->typeDis != "arithmetic") && (it_->typeDis != "indecrement"))
   ) {
     FormItem item = (it->back_push() + (*it_)).withDis("subexpression");
+    item.valueType = it_->valueType;
+    if (it_->constant && (it_->valueType != "int" || it_->value > INT32_MIN)) {
+      item.constant = true;
+      item.value = (it->content == "-") ? -it_->value : it_->value;
+      if (!it_->runtime.empty()) item.runtime = it->content + " " + it_->runtime;
+    }
     phrase.pop_front(), phrase.pop_front();
     phrase.push_front(item);
   }
@@ -224,11 +597,20 @@ reco_formula_inner(
     }
   }
 
-  it = phrase.begin();
-  while (it != phrase.end()) {
-    if (next(it) != phrase.end() && next(it)->content == "^") item += reco_power(phrase, it);
-    else if (it->typeDis == "arithmetic") item += (it++)->space();
-    else item += *(it++);
+  vector<FormItem> items(phrase.begin(), phrase.end());
+  for (FormItem& part: items) {
+    if (items.size() > 1 && !array_element(part.valueType).empty()) error_form("[Semantic Error]", "An array is used only through its elements.", part);
+  }
+  bool wellFormed = (items.size() % 2 == 1);
+  for (int i = 0; i < items.size(); i++) {
+    if ((items[i].typeDis == "arithmetic") != (i % 2 == 1)) wellFormed = false;
+  }
+  if (wellFormed) {
+    int pos = 0;
+    item = reco_fold(items, pos, 0, castFirst);
+  } else {
+    for (FormItem& part: items) item += (part.typeDis == "arithmetic") ? part.space() : part;
+    if (castFirst) item = item.front_push("(double) ");
   }
 
   // cout << endl << "+++++++++++++++++++++++++++++" << endl;
@@ -243,15 +625,20 @@ reco_formula_inner(
 /**
  * Processes a complete formula
  * @param index Current token index
+ * @param castFirst Whether the first power chain is cast to double, like draw arguments
+ * @param target Type the value is converted to, empty if unknown
  * @return String containing processed formula
  */
 string
 reco_formula(
-  int& index
+  int& index,
+  bool castFirst,
+  string target
 ) {
-  FormItem item = reco_formula_inner(index);
+  FormItem item = reco_formula_inner(index, castFirst);
   if (item.content == "") error_item("[Syntax Error]", "Formula missing.", lexiinfo[index]);
-  return item.content;
+  if (!array_element(item.valueType).empty()) error_form("[Semantic Error]", "An array is used only through its elements.", item);
+  return fold_convert(item, target);
 }
 
 /**
@@ -272,11 +659,11 @@ reco_vec(
   } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be keywords \"vec\".", lexiinfo[index]);
 
   if (lexiinfo[index].lexiID == keywords.id("(")) { 
-    content += (isDraw ? "(double) " : "") + reco_formula(++index) + ", ";
+    content += reco_formula(++index, isDraw) + ", ";
   } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \"(\".", lexiinfo[index]);
 
   if (lexiinfo[index].lexiID == keywords.id(",")) {
-    content += (isDraw ? "(double) " : "") + reco_formula(++index);
+    content += reco_formula(++index, isDraw);
   } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \",\".", lexiinfo[index]);
 
   if (lexiinfo[index].lexiID == keywords.id(")")) {
@@ -286,6 +673,23 @@ reco_vec(
   return content;
 }
 
+/**
+ * Processes an array argument of a batched draw command
+ * @param index Current token index
+ * @return String containing the array as an Array of its element type
+ */
+string
+reco_draw_array(
+  int& index
+) {
+  int at = index;
+  FormItem item = reco_formula_inner(index);
+  string element = array_element(item.valueType);
+  if (element.empty()) error_item("[Semantic Error]", "Batched draw commands take arrays of coordinates.", lexiinfo[at]);
+  // Array parameters already are one, local arrays are wrapped with their length
+  return (item.valueType == element + "[]") ? item.content : "Array<" + element + ">(" + item.content + ")";
+}
+
 /**
  * Processes a draw command
  * @param index Current token index
@@ -296,39 +700,52 @@ reco_draw(
   int& index
 ) {
   string content;
-  int vecNumber = 0;
+  int vecNumber = 0, arrays = 0;
   bool hasParam = false;
 
   if (lexiinfo[index].lexiID == keywords.id("draw")) { 
     index++;
+    nowFuncImpure = true;
   } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be keywords \"draw\".", lexiinfo[index]);
 
   if (isDrawtype(lexiinfo[index].lexiID)) {  
 
     if (lexiinfo[index].lexiID == keywords.id("line")) {
-      content = "printf(\"line %.2lf %.2lf %.2lf %.2lf %.2lf %s\\n\", ";
+      content = "DrawLine(" + to_string(lexiinfo[index - 1].line) + ", ";
       vecNumber = 2;
       hasParam = true;
     }
 
     if (lexiinfo[index].lexiID == keywords.id("circle")) {
-      content = "printf(\"circ %.2lf %.2lf %.2lf %s\\n\", ";
+      content = "DrawCirc(" + to_string(lexiinfo[index - 1].line) + ", ";
       vecNumber = 1;
       hasParam = true;
     }
 
     if (lexiinfo[index].lexiID == keywords.id("triangle")) {
-      content = "printf(\"tria %.2lf %.2lf %.2lf %.2lf %.2lf %.2lf %s\\n\", ";
+      content = "DrawTria(" + to_string(lexiinfo[index - 1].line) + ", ";
       vecNumber = 3;
       hasParam = false;
     }
 
     if (lexiinfo[index].lexiID == keywords.id("rectangle")) {
-      content = "printf(\"rect %.2lf %.2lf %.2lf %.2lf %s\\n\", ";
+      content = "DrawRect(" + to_string(lexiinfo[index - 1].line) + ", ";
       vecNumber = 2;
       hasParam = false;
     }
 
+    if (lexiinfo[index].lexiID == keywords.id("circles")) {
+      content = "DrawCircles(" + to_string(lexiinfo[index - 1].line) + ", ";
+      arrays = 3;
+      hasParam = false;
+    }
+
+    if (lexiinfo[index].lexiID == keywords.id("polyline")) {
+      content = "DrawPolyline(" + to_string(lexiinfo[index - 1].line) + ", ";
+      arrays = 2;
+      hasParam = true;
+    }
+
     index++;
   } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be keywords of DRAW-TYPE.", lexiinfo[index]);
 
@@ -336,6 +753,31 @@ reco_draw(
     index++;
   } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \"(\".", lexiinfo[index]);
 
+  if (arrays) {
+    // Batched commands may start with a count, without one every element is drawn
+    string name = lexiinfo[index].content;
+    bool isArray = lexiinfo[index].lexiID == keywords.id("identifier") && lexiinfo[index + 1].lexiID == keywords.id(",") &&
+      variinfo.exist(name, blockLayer) && !array_element(variinfo.type(name, blockLayer)).empty();
+    if (!isArray) {
+      FormItem count = reco_formula_inner(index);
+      if (count.content == "") error_item("[Syntax Error]", "Formula missing.", lexiinfo[index]);
+      if (count.valueType != "int") error_form("[Semantic Error]", "A draw count must be an int.", count);
+      content += count.content + ", ";
+
+      if (lexiinfo[index].lexiID == keywords.id(",")) {
+        index++;
+      } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \",\".", lexiinfo[index]);
+    } else content += "INT_MAX, ";
+  }
+
+  for (int i = 0; i < arrays; i++) {
+    content += reco_draw_array(index) + ", ";
+
+    if (lexiinfo[index].lexiID == keywords.id(",")) {
+      index++;
+    } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \",\".", lexiinfo[index]);
+  }
+
   for (int i = 0; i < vecNumber; i++) {
     if (lexiinfo[index].lexiID == keywords.id("vec")) { 
       content += reco_vec(index, true) + ", ";
@@ -347,7 +789,7 @@ reco_draw(
   }
 
   if (hasParam) {
-    content += "(double) " + reco_formula(index) + ", ";
+    content += reco_formula(index, true) + ", ";
 
     if (lexiinfo[index].lexiID == keywords.id(",")) {
       index++;
@@ -384,6 +826,7 @@ reco_define(
   int layer
 ) {
   string content, name, type;
+  bool header = index > 0 && lexiinfo[index - 1].lexiID == keywords.id("(");
 
   if (isType(lexiinfo[index].lexiID)) {
     type = lexiinfo[index++].content;
@@ -393,15 +836,43 @@ reco_define(
   while (lexiinfo[index].lexiID != keywords.id(";")) {
     if (lexiinfo[index].lexiID == keywords.id("identifier")) {
       name = lexiinfo[index++].content;
-      if (!variinfo.exist(name, layer)) {
+      if (variinfo.exist(name, layer)) error_item("[Semantic Error]", "Redefined variable.", lexiinfo[index - 1]);
+      if (lexiinfo[index].lexiID == keywords.id("[")) {
+        // Fixed-size array, contiguous and zeroed like a C array
+        if (type != "int" && type != "float") error_item("[Semantic Error]", "Arrays hold int or float numbers.", lexiinfo[index - 2]);
+        if (lexiinfo[index + 1].lexiID != keywords.id("integer") || lexiinfo[index + 2].lexiID != keywords.id("]")) {
+          error_item("[Syntax Error]", "Incomplete syntax structure. An array size is an integer followed by \"]\".", lexiinfo[index + 1]);
+        }
+        string size = lexiinfo[index + 1].content;
+        if (stod(size) < 1 || stod(size) > maxArray) {
+          error_item("[Semantic Error]", "An array holds 1 to " + to_string(maxArray) + " elements.", lexiinfo[index + 1]);
+        }
+        index += 3;
+        variinfo.add(name, type + "[" + size + "]", layer);
+        if (stoi(size) <= stackArray) {
+          content += name + "[" + size + "] = {}";
+        } else {
+          // pfor and task workers have small stacks, so a large array ends the declaration
+          // and is zeroed on the heap, then bound to a reference that works like the array
+          if (header) error_item("[Semantic Error]", "An array in a for header holds at most " + to_string(stackArray) + " elements.", lexiinfo[index - 2]);
+          string store = "ArrayHeap" + name;
+          if (content != type + " ") content.replace(content.size() - 2, 2, "; ");
+          else content.clear();
+          content += "std::unique_ptr<" + type + "[][" + size + "]> " + store + "(new " + type + "[1][" + size + "]()); ";
+          content += type + " (&" + name + ")[" + size + "] = " + store + "[0]";
+        }
+        if (lexiinfo[index].lexiID == keywords.id("=")) {
+          error_item("[Semantic Error]", "An array starts zeroed and is filled element by element.", lexiinfo[index]);
+        }
+      } else {
         variinfo.add(name, type, layer);
         content += name;
-      } else error_item("[Semantic Error]", "Redefined variable.", lexiinfo[index - 1]);
+      }
     } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be IDENTIFIER.", lexiinfo[index]);
     
     if (lexiinfo[index].lexiID == keywords.id("=")) {
       content += " " + lexiinfo[index++].content + " ";
-      content += reco_formula(index);
+      content += reco_formula(index, false, type);
     }
 
     if (lexiinfo[index].lexiID == keywords.id(",")) {
@@ -446,14 +917,32 @@ string
 reco_multiformula(
   int& index
 ) {
-  string content;
+  string content, target;
 
   while (lexiinfo[index].lexiID != keywords.id(";")) {
-    content += reco_formula(index);
+    string assigned;
+    if (lexiinfo[index].lexiID == keywords.id("identifier") && lexiinfo[index + 1].lexiID == keywords.id("=")) {
+      check_write(lexiinfo[index]);
+      assigned = variinfo.type(lexiinfo[index].content, blockLayer);
+    } else if (lexiinfo[index].lexiID == keywords.id("identifier") && lexiinfo[index + 1].lexiID == keywords.id("[")) {
+      int end = index + 1;
+      for (int depth = 0; end < lexiinfo.size(); end++) {
+        if (lexiinfo[end].lexiID == keywords.id("[")) depth++;
+        else if (lexiinfo[end].lexiID == keywords.id("]") && --depth == 0) break;
+      }
+      if (end + 1 < lexiinfo.size() && lexiinfo[end + 1].lexiID == keywords.id("=")) {
+        check_write(lexiinfo[index]);
+        assigned = array_element(variinfo.type(lexiinfo[index].content, blockLayer));
+      }
+    }
+    // The value of an assignment is converted to the type of the variable or element it writes
+    content += reco_formula(index, false, target);
+    target = "";
     if (lexiinfo[index].lexiID == keywords.id(",")) {
       content += lexiinfo[index++].content + " ";
     } else if (lexiinfo[index].lexiID == keywords.id("=")) {
       content += " " + lexiinfo[index++].content + " ";
+      target = assigned;
     }
   }
 
@@ -464,6 +953,63 @@ reco_multiformula(
   return content;
 }
 
+/**
+ * Gets the statement mark of the profiling build
+ * @param line Source line of the statement
+ * @return Call that charges the time from here on to the line, empty without profiling
+ */
+string
+profile_line(
+  int line
+) {
+  return optiinfo.profile ? "ProfileLine(" + to_string(line) + "); " : "";
+}
+
+/**
+ * Counts the iterations of a loop in the profiling build
+ * @param block Processed loop body, starting with "{\n"
+ * @param line Source line of the loop
+ * @return Body with the counter, unchanged without profiling
+ */
+string
+profile_loop(
+  string block,
+  int line
+) {
+  if (optiinfo.profile) block.insert(2, repeatString("  ", blockLayer + 1) + "ProfileLoop(" + to_string(line) + ");\n");
+  return block;
+}
+
+/**
+ * Checks a write of a variable or of array elements
+ * Writing an array parameter marks the current function, as the array belongs to the
+ * caller. Inside a pfor body, only variables declared in the body may change, and the
+ * elements of an outer array only at the loop index, so iterations stay independent.
+ * @param item Token of the written variable
+ */
+void
+check_write(
+  LexiItem& item
+) {
+  if (item.lexiID != keywords.id("identifier")) return;
+  string type = variinfo.type(item.content, blockLayer);
+  if (type.size() > 2 && type.substr(type.size() - 2) == "[]") nowFuncWrites = true;
+  if (pforLayer < 0) return;
+  int layer = variinfo.layer(item.content, blockLayer), at = &item - &lexiinfo[0];
+  bool atIndex =
+    !array_element(type).empty() && lexiinfo[at + 1].lexiID == keywords.id("[") &&
+    lexiinfo[at + 2].content == pforIndex && lexiinfo[at + 3].lexiID == keywords.id("]");
+  if (layer >= 0 && layer < pforLayer && atIndex) {
+    pforWrites.push_back(item.content);
+  } else if (layer >= 0 && layer < pforLayer && !array_element(type).empty()) {
+    error_item("[Semantic Error]", "pfor iterations must be independent: \"" + item.content + "\" is declared outside the loop body and written away from the loop index.", item);
+  } else if (layer >= 0 && layer < pforLayer) {
+    error_item("[Semantic Error]", "pfor iterations must be independent: \"" + item.content + "\" is declared outside the loop body.", item);
+  } else if (layer == pforLayer && item.content == pforIndex) {
+    error_item("[Semantic Error]", "The index of a pfor loop cannot be written in its body.", item);
+  }
+}
+
 /**
  * Processes a for loop
  * @param index Current token index
@@ -474,6 +1020,8 @@ reco_for(
   int& index
 ) {
   string content;
+  int start = index;
+  loopDepth++;
 
   if (lexiinfo[index].lexiID == keywords.id("for")) {
     content += lexiinfo[index++].content + " ";
@@ -492,7 +1040,9 @@ reco_for(
     } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \";\".", lexiinfo[index]);
   }
 
-  content += reco_compare(index);
+  // The condition charges the loop header with the time of testing and stepping
+  if (optiinfo.profile) content += "(ProfileLine(" + to_string(lexiinfo[start].line) + "), " + reco_compare(index) + ")";
+  else content += reco_compare(index);
   
   if (lexiinfo[index].lexiID == keywords.id(";")) {
     content += lexiinfo[index++].content + " ";
@@ -514,12 +1064,232 @@ reco_for(
   blockLayer--;
 
   if (lexiinfo[index].lexiID == keywords.id("{")) {
-    content += reco_block(index);
+    content += profile_loop(reco_block(index), lexiinfo[start].line);
   } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \"{\".", lexiinfo[index]);
+
+  loopDepth--;
+  add_cost((index - start) * (loopFactor - 1));
+
+  // g++ builds the proxy without optimization, so element-wise loops get an optimized lambda of their own
+  if (optiinfo.vectorize && !optiinfo.profile && check_elementwise(start, index)) {
+    string indent = repeatString("  ", blockLayer), loop = indent + "  ";
+    for (char c: content) loop += (c == '\n') ? "\n  " : string(1, c);
+    content = "[&]() __attribute__((optimize(\"O3\"))) {\n" + indent + "  #pragma GCC ivdep\n" + loop + "\n" + indent + "}();";
+    optiinfo.log("line " + to_string(lexiinfo[start].line) + ": element-wise loop vectorized.");
+  }
   
   return content;
 } 
 
+/**
+ * Checks if a for loop only computes array elements at its index
+ * The loop must count an int index up by one, and its body must assign arr[i] from
+ * numbers, variables, elements at i and arithmetic. Every iteration then touches only
+ * element i of each array, so iterations carry no dependency, even through aliased
+ * array parameters, and the vectorized loop computes exactly the same values.
+ * @param start Token index of the "for" keyword
+ * @param end Token index after the body
+ * @return true if the loop can be vectorized
+ */
+bool
+check_elementwise(
+  int start,
+  int end
+) {
+  if (lexiinfo[start + 2].content != "int" || lexiinfo[start + 3].lexiID != keywords.id("identifier")) return false;
+  string name = lexiinfo[start + 3].content;
+  auto element = [&](int at) {
+    return
+      !array_element(variinfo.type(lexiinfo[at].content, blockLayer)).empty() && lexiinfo[at + 1].lexiID == keywords.id("[") &&
+      lexiinfo[at + 2].content == name && lexiinfo[at + 3].lexiID == keywords.id("]");
+  };
+
+  // Header: "int i = formula; i < formula; i++" with a bound that no iteration changes
+  int at = start + 4;
+  while (lexiinfo[at].lexiID != keywords.id(";")) at++;
+  if (lexiinfo[++at].content != name || (lexiinfo[at + 1].content != "<" && lexiinfo[at + 1].content != "<=")) return false;
+  for (at += 2; lexiinfo[at].lexiID != keywords.id(";"); at++) {
+    int id = lexiinfo[at].lexiID;
+    if (id == keywords.id("[") || isInDeOperator(id) || (id == keywords.id("identifier") && lexiinfo[at + 1].lexiID == keywords.id("("))) return false;
+  }
+  at++;
+  bool prefix = lexiinfo[at].content == "++" && lexiinfo[at + 1].content == name;
+  bool postfix = lexiinfo[at].content == name && lexiinfo[at + 1].content == "++";
+  if (!(prefix || postfix) || lexiinfo[at + 2].lexiID != keywords.id(")")) return false;
+
+  // Body: "arr[i] = formula;" statements only
+  at += 3;
+  if (lexiinfo[at++].lexiID != keywords.id("{") || at == end - 1) return false;
+  while (at < end - 1) {
+    if (!element(at) || lexiinfo[at + 4].lexiID != keywords.id("=")) return false;
+    for (at += 5; lexiinfo[at].lexiID != keywords.id(";"); at++) {
+      int id = lexiinfo[at].lexiID;
+      if (id == keywords.id("identifier")) {
+        if (lexiinfo[at + 1].lexiID == keywords.id("(")) return false;
+        if (element(at)) at += 3;
+        else if (lexiinfo[at + 1].lexiID == keywords.id("[")) return false;
+      } else if (id == keywords.id("len")) {
+        at += 3;
+      } else if (!isNumber(id) && !isAritOperator(id) && id != keywords.id("(") && id != keywords.id(")")) return false;
+      if (lexiinfo[at].content == "^") return false;
+    }
+    at++;
+  }
+  return true;
+}
+
+/**
+ * Processes a parallel for loop
+ * The header is a for header that declares the index. Iterations must not depend
+ * on each other, so the body may change only the variables it declares itself.
+ * The index values are gathered first, then the iterations run on the thread pool
+ * of the proxy, and their drawing commands are emitted in iteration order.
+ * @param index Current token index
+ * @return String containing processed loop
+ */
+string
+reco_pfor(
+  int& index
+) {
+  string content, header, type, name;
+  int start = index, id = ++pforCount;
+  loopDepth++;
+
+  if (lexiinfo[index].lexiID == keywords.id("pfor")) {
+    index++;
+  } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be keywords \"pfor\".", lexiinfo[index]);
+
+  if (lexiinfo[index].lexiID == keywords.id("(")) {
+    index++;
+  } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \"(\".", lexiinfo[index]);
+
+  if (isType(lexiinfo[index].lexiID) && lexiinfo[index + 1].lexiID == keywords.id("identifier")) {
+    type = lexiinfo[index].content, name = lexiinfo[index + 1].content;
+    header += reco_define(index, ++blockLayer) + " ";
+    if (variinfo.vec.back().first != name) error_item("[Semantic Error]", "A pfor loop declares only its index.", lexiinfo[start + 3]);
+  } else error_item("[Syntax Error]", "Incomplete syntax structure. A pfor loop starts by declaring its index.", lexiinfo[index]);
+
+  header += reco_compare(index);
+
+  if (lexiinfo[index].lexiID == keywords.id(";")) {
+    header += lexiinfo[index++].content + " ";
+  } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \";\".", lexiinfo[index]);
+
+  while (lexiinfo[index].lexiID != keywords.id(")")) {
+    header += reco_formula(index);
+    if (lexiinfo[index].lexiID == keywords.id(",")) {
+      header += lexiinfo[index++].content + " ";
+    } else if (lexiinfo[index].lexiID != keywords.id(")")) {
+      error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \",\".", lexiinfo[index]);
+    }
+  }
+
+  if (lexiinfo[index].lexiID == keywords.id(")")) {
+    index++;
+  } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \")\".", lexiinfo[index]);
+
+  // The body shares the scope layer of the index, like the body of a for loop
+  int outerLayer = pforLayer, bodyStart = index;
+  string outerIndex = pforIndex;
+  vector<string> outerWrites;
+  swap(outerWrites, pforWrites);
+  pforLayer = blockLayer, pforIndex = name;
+  blockLayer--;
+
+  string block;
+  if (lexiinfo[index].lexiID == keywords.id("{")) {
+    block = profile_loop(reco_block(index), lexiinfo[start].line);
+  } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \"{\".", lexiinfo[index]);
+
+  // An outer array written at the index must not be read at other elements either
+  for (int at = bodyStart; at < index; at++) {
+    if (lexiinfo[at].lexiID != keywords.id("identifier") || find(pforWrites.begin(), pforWrites.end(), lexiinfo[at].content) == pforWrites.end()) continue;
+    if (lexiinfo[at + 1].lexiID != keywords.id("[") || lexiinfo[at + 2].content != name || lexiinfo[at + 3].lexiID != keywords.id("]")) {
+      error_item("[Semantic Error]", "pfor iterations must be independent: \"" + lexiinfo[at].content + "\" is written at the loop index, so it is used only there.", lexiinfo[at]);
+    }
+  }
+  swap(outerWrites, pforWrites);
+  pforLayer = outerLayer, pforIndex = outerIndex;
+  loopDepth--;
+  add_cost((index - start) * (loopFactor - 1));
+
+  string values = "PforIndex" + to_string(id), at = "PforAt" + to_string(id);
+  string indent = repeatString("  ", blockLayer + 1);
+  content += "{\n";
+  content += indent + "std::vector<" + type + "> " + values + ";\n";
+  content += indent + "for (" + header + ") " + values + ".push_back(" + name + ");\n";
+  content += indent + "Pfor(" + values + ".size(), [&](size_t " + at + ") {\n";
+  content += indent + "  " + type + " " + name + " = " + values + "[" + at + "];\n";
+  content += indent + "  " + block + "\n";
+  content += indent + "});\n";
+  content += repeatString("  ", blockLayer) + "}";
+  optiinfo.log("pfor at line " + to_string(lexiinfo[start].line) + " runs in parallel.");
+  return content;
+}
+
+/**
+ * Finds the end of a call statement that may run as a task beside its sibling calls
+ * The language has no global variables and passes arguments by value, so sibling
+ * calls share no mutable state but the order of their drawing commands. A call
+ * qualifies when it recurses, or when the callee draws and costs enough to outweigh
+ * spawning a task, and its arguments change no variable.
+ * @param index Index of the first token of the statement
+ * @return Index after the ";" of the statement, -1 if the statement does not qualify
+ */
+int
+task_call_end(
+  int index
+) {
+  string name = lexiinfo[index].content;
+  if (lexiinfo[index].lexiID != keywords.id("identifier") || !funcinfo.exist(name)) return -1;
+  if (lexiinfo[index + 1].lexiID != keywords.id("(")) return -1;
+  if (name != nowFuncName && (!funcinfo.impure[name] || funcinfo.cost[name] < optiinfo.taskThreshold)) return -1;
+
+  // Arrays are passed by reference, so they may be shared only with callees that read them
+  // A recursive call may write arrays through statements after it, so any array parameter counts.
+  bool writes = funcinfo.writes[name];
+  if (name == nowFuncName) for (ParaItem& param: funcinfo.params[name]) writes = writes || !array_element(param.type).empty();
+  int depth = 0;
+  for (index++; index < lexiinfo.size(); index++) {
+    int id = lexiinfo[index].lexiID;
+    if (id == keywords.id("++") || id == keywords.id("--") || id == keywords.id(";")) return -1;
+    if (
+      writes && id == keywords.id("identifier") && lexiinfo[index + 1].lexiID != keywords.id("[") &&
+      !array_element(variinfo.type(lexiinfo[index].content, blockLayer)).empty()
+    ) return -1;
+    if (id == keywords.id("(")) depth++;
+    else if (id == keywords.id(")") && --depth == 0) break;
+  }
+  if (index + 1 >= lexiinfo.size() || lexiinfo[index + 1].lexiID != keywords.id(";")) return -1;
+  return index + 2;
+}
+
+/**
+ * Processes a run of sibling call statements as tasks
+ * Each call runs as a task on the work-stealing pool of the proxy, writing its
+ * drawing commands to a buffer of its own. The buffers are emitted in program order,
+ * and tasks nested deeper than the depth cutoff of the pool run inline.
+ * @param index Current token index, at the first call of at least two
+ * @return String containing processed calls
+ */
+string
+reco_tasks(
+  int& index
+) {
+  string group = "Tasks" + to_string(++taskCount), indent = repeatString("  ", blockLayer + 1);
+  string content = "{\n" + indent + "TaskGroup " + group + ";\n";
+  int line = lexiinfo[index].line, calls = 0;
+
+  while (task_call_end(index) >= 0) {
+    content += indent + group + ".run([=]() { " + reco_multiformula(index) + " });\n";
+    calls++;
+  }
+
+  content += indent + group + ".wait();\n" + repeatString("  ", blockLayer) + "}";
+  optiinfo.log(to_string(calls) + " calls at line " + to_string(line) + " run as parallel tasks.");
+  return content;
+}
+
 /**
  * Processes an if statement
  * @param index Current token index
@@ -571,6 +1341,8 @@ reco_while(
   int& index
 ) {
   string content;
+  int start = index;
+  loopDepth++;
 
   if (lexiinfo[index].lexiID == keywords.id("while")) {
     content += lexiinfo[index++].content;
@@ -580,16 +1352,20 @@ reco_while(
     content += lexiinfo[index++].content;
   } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \"(\".", lexiinfo[index]);
 
-  content += reco_compare(index);
+  if (optiinfo.profile) content += "(ProfileLine(" + to_string(lexiinfo[start].line) + "), " + reco_compare(index) + ")";
+  else content += reco_compare(index);
 
   if (lexiinfo[index].lexiID == keywords.id(")")) {
     content += lexiinfo[index++].content + " ";
   } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \")\".", lexiinfo[index]);
 
   if (lexiinfo[index].lexiID == keywords.id("{")) {
-    content += reco_block(index);
+    content += profile_loop(reco_block(index), lexiinfo[start].line);
   } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \"{\".", lexiinfo[index]);
 
+  loopDepth--;
+  add_cost((index - start) * (loopFactor - 1));
+
   return content;
 }
 
@@ -605,11 +1381,12 @@ reco_return(
   string content;
 
   if (lexiinfo[index].lexiID == keywords.id("return")) {
+    if (pforLayer >= 0) error_item("[Semantic Error]", "Cannot return from inside a pfor body.", lexiinfo[index]);
     content += lexiinfo[index++].content;
   } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be keywords \"return\".", lexiinfo[index]);
 
   if (check_boarder(index)) {
-    content += " " + reco_formula(index);
+    content += " " + reco_formula(index, false, funcinfo.type[nowFuncName]);
   } else if (reqReturnVal) {
     error_item("[Semantic Error]", "Function need return value to return.", lexiinfo[index]);
   }
@@ -640,23 +1417,28 @@ reco_block(
   } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \"{\".", lexiinfo[index]);
 
   while (lexiinfo[index].lexiID != keywords.id("}")) {
+    string indent = repeatString("  ", blockLayer) + profile_line(lexiinfo[index].line);
     if (lexiinfo[index].lexiID == keywords.id("draw")) {
       if (isDrawtype(lexiinfo[index + 1].lexiID)) {
-        content += repeatString("  ", blockLayer) + reco_draw(index) + "\n";
+        content += indent + reco_draw(index) + "\n";
       } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be keywords of DRAW-TYPE.", lexiinfo[index + 1]);
     } else if (lexiinfo[index].lexiID == keywords.id("for")) {
-      content += repeatString("  ", blockLayer) + reco_for(index) + "\n";
+      content += indent + reco_for(index) + "\n";
+    } else if (lexiinfo[index].lexiID == keywords.id("pfor")) {
+      content += indent + reco_pfor(index) + "\n";
     } else if (lexiinfo[index].lexiID == keywords.id("while")) {
-      content += repeatString("  ", blockLayer) + reco_while(index) + "\n";
+      content += indent + reco_while(index) + "\n";
     } else if (lexiinfo[index].lexiID == keywords.id("if")) {
-      content += repeatString("  ", blockLayer) + reco_if(index) + "\n";
+      content += indent + reco_if(index) + "\n";
     } else if (lexiinfo[index].lexiID == keywords.id("return")) {
-      content += repeatString("  ", blockLayer) + reco_return(index) + "\n";
+      content += indent + reco_return(index) + "\n";
       if (hasReturn) *hasReturn = true;
     } else if (isType(lexiinfo[index].lexiID)) {
-      content += repeatString("  ", blockLayer) + reco_define(index, blockLayer) + "\n";
+      content += indent + reco_define(index, blockLayer) + "\n";
+    } else if (optiinfo.tasks && !optiinfo.profile && task_call_end(index) >= 0 && task_call_end(task_call_end(index)) >= 0) {
+      content += indent + reco_tasks(index) + "\n";
     } else {
-      content += repeatString("  ", blockLayer) + reco_multiformula(index) + "\n";
+      content += indent + reco_multiformula(index) + "\n";
     }
   }
 
@@ -674,12 +1456,14 @@ reco_block(
  * Processes function parameter list
  * @param index Current token index
  * @param numParam Reference to parameter count
+ * @param paraItems Receives the parameter types and names
  * @return String containing processed parameter list
  */
 string 
 reco_paralist(
   int& index,
-  int& numParam
+  int& numParam,
+  vector<ParaItem>& paraItems
 ) {
   string content;
 
@@ -692,7 +1476,17 @@ reco_paralist(
       if (lexiinfo[index + 1].lexiID == keywords.id("identifier")) {
         numParam++;
         string type = lexiinfo[index++].content, name = lexiinfo[index++].content;
-        content += type + " " + name;
+        if (lexiinfo[index].lexiID == keywords.id("[")) {
+          // Array parameters refer to the caller's array, which carries its length
+          if (type != "int" && type != "float") error_item("[Semantic Error]", "Arrays hold int or float numbers.", lexiinfo[index - 2]);
+          if (lexiinfo[index + 1].lexiID != keywords.id("]")) {
+            error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \"]\".", lexiinfo[index + 1]);
+          }
+          index += 2;
+          content += "Array<" + type + "> " + name;
+          type += "[]";
+        } else content += type + " " + name;
+        paraItems.push_back((ParaItem) { type, name });
         if (!variinfo.exist(name, blockLayer + 1)) {
           variinfo.add(name, type, blockLayer + 1);
         } else error_item("[Semantic Error]", "Redefined variable.", lexiinfo[index - 1]);
@@ -713,6 +1507,45 @@ reco_paralist(
   return content;
 }
 
+/**
+ * Wraps a function definition with a memo table
+ * The original body is renamed, and recursive calls inside it go through the memo again
+ * @param returnType Return type of the function
+ * @param functionName Function name
+ * @param paraContent Processed parameter list
+ * @param block Processed function body
+ * @return String containing the memoized function
+ */
+string
+reco_memo(
+  string returnType,
+  string functionName,
+  string paraContent,
+  string block
+) {
+  string head = returnType + " " + functionName + "(" + paraContent + ")";
+  string body = "MemoBody_" + functionName, args, key;
+  int numKey = 1;                   // Parameters and a trailing 0, so the key is never empty
+  for (ParaItem& param: funcinfo.params[functionName]) {
+    args += (args.empty() ? "" : ", ") + param.paraName;
+    key += "(double) " + param.paraName + ", ";
+    numKey++;
+  }
+
+  return
+    head + ";\n" +
+    returnType + " " + body + "(" + paraContent + ") " + block + "\n\n" +
+    head + " {\n" +
+    "  static MemoLocal Memo<" + returnType + ", " + to_string(numKey) + ", " + to_string(optiinfo.memoSize) + "> memo;\n" +
+    "  double key[] = { " + key + "0 };\n" +
+    "  " + returnType + " value;\n" +
+    "  if (memo.find(key, value)) return value;\n" +
+    "  value = " + body + "(" + args + ");\n" +
+    "  memo.put(key, value);\n" +
+    "  return value;\n" +
+    "}";
+}
+
 /**
  * Processes a function definition
  * @param index Current token index
@@ -733,9 +1566,11 @@ reco_function(
                                                     
   if (lexiinfo[index].lexiID == keywords.id("(")) { 
     int numParam = 0;
-    paraContent = reco_paralist(index, numParam);
+    vector<ParaItem> paraItems;
+    paraContent = reco_paralist(index, numParam, paraItems);
     if (!funcinfo.exist(functionName)) {
       funcinfo.add(functionName, numParam);
+      funcinfo.params[functionName] = paraItems;
     } else error_item("[Semantic Error]", "Redefined function.", lexiinfo[functionPos]);
   } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \"(\".", lexiinfo[index]);
 
@@ -746,21 +1581,71 @@ reco_function(
   if (isType(lexiinfo[index].lexiID)) {
     returnType = lexiinfo[index++].content;
     if (functionName == "main") returnType = "int";
+    funcinfo.type[functionName] = returnType;
   } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be keywords of TYPE.", lexiinfo[index]);
 
   nowFuncName = functionName;
+  nowFuncImpure = (functionName == "main");
+  nowFuncWrites = false;
+  nowFuncCost = loopDepth = 0;
+  // Results depend on the contents of array parameters, so they are never memoized or inlined
+  bool arrays = false;
+  for (ParaItem& param: funcinfo.params[functionName]) arrays = arrays || !array_element(param.type).empty();
+  nowFuncImpure = nowFuncImpure || arrays;
   reqReturnVal = (returnType != "void");
   content = returnType + " " + functionName + "(" + paraContent + ") ";
 
   bool hasReturn = false;
+  int bodyPos = index;
+  string block;
   if (lexiinfo[index].lexiID == keywords.id("{")) {
-    content += reco_block(index, &hasReturn);
+    block = reco_block(index, &hasReturn);
+    if (optiinfo.profile) {
+      // Charges the body to the function and its call stack until it returns
+      block.insert(2, "  ProfileCall profileCall(" + to_string(funcinfo.vec.size() - 1) + ", " + to_string(lexiinfo[functionPos].line) + ");\n");
+    }
+    content += block;
   } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be \"{\".", lexiinfo[index]);
 
   if (functionName != "main" && returnType != "void" && !hasReturn) {
     error_item("[Semantic Error]", "Function " + functionName + " does not have RETURN SENTENCE.", lexiinfo[index - 1]);
   }
 
+  // Only the real main may fall off its end, but main is renamed in shared objects.
+  if (functionName == "main" && !hasReturn) {
+    content.insert(content.length() - 1, "  return 0;\n");
+  }
+
+  add_cost(index - bodyPos);
+  funcinfo.impure[functionName] = nowFuncImpure;
+  funcinfo.writes[functionName] = nowFuncWrites;
+  funcinfo.cost[functionName] = nowFuncCost;
+  if (functionName != "main") {
+    if (nowFuncImpure) {
+      optiinfo.log(functionName + ": impure, not memoized.");
+    } else if (returnType == "void") {
+      optiinfo.log(functionName + ": pure, returns no value, not memoized.");
+    } else if (nowFuncCost < optiinfo.memoThreshold) {
+      optiinfo.log(functionName + ": pure, static cost " + to_string(nowFuncCost) + ", below the memo threshold.");
+    } else if (!optiinfo.memoize) {
+      optiinfo.log(functionName + ": pure, static cost " + to_string(nowFuncCost) + ", memoization disabled.");
+    } else {
+      optiinfo.log(functionName + ": pure, static cost " + to_string(nowFuncCost) + ", memoized.");
+      funcinfo.memo[functionName] = true;
+      content = reco_memo(returnType, functionName, paraContent, block);
+    }
+  }
+
+  // A body of the form "{ return formula; }" can replace calls, unless the formula recurses.
+  bool single = 
+    functionName != "main" && returnType != "void" && !funcinfo.memo[functionName] && !arrays &&
+    lexiinfo[bodyPos + 1].lexiID == keywords.id("return") && index - bodyPos - 4 <= optiinfo.inlineThreshold;
+  for (int i = bodyPos + 2; single && i < index - 1; i++) {
+    if (lexiinfo[i].lexiID == keywords.id(";")) single = (i == index - 2);
+    if (lexiinfo[i].content == functionName && lexiinfo[i + 1].lexiID == keywords.id("(")) single = false;
+  }
+  if (single) funcinfo.inlineAt[functionName] = bodyPos + 2;
+
   return content;
 }
 
@@ -782,8 +1667,494 @@ generate_proxy(
 }
 
 string content = 
+"#include <algorithm>                            \n" 
+"#include <climits>                              \n" 
 "#include <cmath>                                \n" 
+"#include <cstdio>                               \n" 
+"#include <cstdlib>                              \n" 
+"#include <cstring>                              \n" 
 "#include <iostream>                             \n" 
+"#include <map>                                  \n" 
+"#include <memory>                               \n" 
+"#include <vector>                               \n" 
+"#ifdef PFC_TASKS                                \n" 
+"#include <atomic>                               \n" 
+"#include <condition_variable>                   \n" 
+"#include <deque>                                \n" 
+"#include <functional>                           \n" 
+"#include <mutex>                                \n" 
+"#include <thread>                               \n" 
+"#endif                                          \n" 
+"                                                \n" 
+"template <typename T>                           \n" 
+"struct Array {                                  \n" 
+"  T *data;                                      \n" 
+"  int size;                                     \n" 
+"  template <int N> Array(T (&elements)[N]) : data(elements), size(N) {}\n" 
+"  T &operator[](int at) const { return data[at]; }\n" 
+"};                                              \n" 
+"                                                \n" 
+"typedef void (*DrawSink)(void*, const char*, const double*, int, const char*);\n" 
+"DrawSink drawSink;                              \n" 
+"void *drawUser;                                 \n" 
+"                                                \n" 
+"double CanvasWidth = -1, CanvasHeight = -1;     \n" 
+"long long DrawCount, DrawCulled;                \n" 
+"#ifdef PFC_STATS                                \n" 
+"long long DrawTypes[4];                         \n" 
+"#endif                                          \n" 
+"#ifdef PFC_VERBOSE                              \n" 
+"std::map<int, std::pair<long long, long long> > DrawSites;\n" 
+"#endif                                          \n" 
+"                                                \n" 
+"struct CanvasInit {                             \n" 
+"  CanvasInit() {                                \n" 
+"    const char *canvas = getenv(\"PFC_CANVAS\");  \n" 
+"    if (canvas) sscanf(canvas, \"%lf %lf\", &CanvasWidth, &CanvasHeight);\n" 
+"  }                                             \n" 
+"} canvasInit;                                   \n" 
+"                                                \n" 
+"#ifdef PFC_PROFILE                              \n" 
+"#include <ctime>                                \n" 
+"struct ProfileLineStat { long long hits, iterations, draws, time; };\n" 
+"struct ProfileNode { int parent, func, child, sibling; long long time; };\n" 
+"extern const int ProfileLines, ProfileFunctions;\n" 
+"extern ProfileLineStat ProfileLineData[];       \n" 
+"extern long long ProfileCalls[], ProfileSelf[], ProfileDraws[];\n" 
+"std::vector<ProfileNode> ProfileNodes(1, ProfileNode{ -1, -1, -1, -1, 0 });\n" 
+"int ProfileNodeAt, ProfileLineAt, ProfileFuncAt = -1;\n" 
+"long long ProfileLast;                          \n" 
+"                                                \n" 
+"long long ProfileNow() {                        \n" 
+"  timespec now;                                 \n" 
+"  clock_gettime(CLOCK_MONOTONIC, &now);         \n" 
+"  return now.tv_sec * 1000000000LL + now.tv_nsec;\n" 
+"}                                               \n" 
+"                                                \n" 
+"void ProfileMark() {                            \n" 
+"  long long now = ProfileNow(), spent = now - ProfileLast;\n" 
+"  ProfileLast = now;                            \n" 
+"  ProfileLineData[ProfileLineAt].time += spent; \n" 
+"  ProfileNodes[ProfileNodeAt].time += spent;    \n" 
+"  if (ProfileFuncAt >= 0) ProfileSelf[ProfileFuncAt] += spent;\n" 
+"}                                               \n" 
+"                                                \n" 
+"void ProfileLine(int line) {                    \n" 
+"  ProfileMark();                                \n" 
+"  ProfileLineAt = line;                         \n" 
+"  ProfileLineData[line].hits++;                 \n" 
+"}                                               \n" 
+"                                                \n" 
+"void ProfileLoop(int line) {                    \n" 
+"  ProfileLineData[line].iterations++;           \n" 
+"}                                               \n" 
+"                                                \n" 
+"struct ProfileCall {                            \n" 
+"  int line, node, func;                         \n" 
+"  ProfileCall(int id, int at) : line(ProfileLineAt), node(ProfileNodeAt), func(ProfileFuncAt) {\n" 
+"    ProfileMark();                              \n" 
+"    int child = ProfileNodes[node].child;       \n" 
+"    while (child >= 0 && ProfileNodes[child].func != id) child = ProfileNodes[child].sibling;\n" 
+"    if (child < 0) {                            \n" 
+"      child = ProfileNodes.size();              \n" 
+"      ProfileNodes.push_back(ProfileNode{ node, id, -1, ProfileNodes[node].child, 0 });\n" 
+"      ProfileNodes[node].child = child;         \n" 
+"    }                                           \n" 
+"    ProfileNodeAt = child, ProfileFuncAt = id, ProfileLineAt = at;\n" 
+"    ProfileCalls[id]++, ProfileLineData[at].hits++;\n" 
+"  }                                             \n" 
+"  ~ProfileCall() {                              \n" 
+"    ProfileMark();                              \n" 
+"    ProfileLineAt = line, ProfileNodeAt = node, ProfileFuncAt = func;\n" 
+"  }                                             \n" 
+"};                                              \n" 
+"                                                \n" 
+"struct ProfileReport {                          \n" 
+"  ProfileReport() { ProfileLast = ProfileNow(); }\n" 
+"  ~ProfileReport() {                            \n" 
+"    ProfileMark();                              \n" 
+"    const char *path = getenv(\"PFC_PROFILE\");   \n" 
+"    FILE *file = path ? fopen(path, \"w\") : NULL;\n" 
+"    if (!file) return;                          \n" 
+"    for (int i = 0; i < ProfileLines; i++) {    \n" 
+"      ProfileLineStat &at = ProfileLineData[i]; \n" 
+"      if (at.hits || at.draws) fprintf(file, \"L %d %lld %lld %lld %lld\\n\", i, at.hits, at.iterations, at.draws, at.time);\n" 
+"    }                                           \n" 
+"    for (int i = 0; i < ProfileFunctions; i++) {\n" 
+"      fprintf(file, \"F %d %lld %lld %lld\\n\", i, ProfileCalls[i], ProfileSelf[i], ProfileDraws[i]);\n" 
+"    }                                           \n" 
+"    for (size_t i = 1; i < ProfileNodes.size(); i++) {\n" 
+"      ProfileNode &at = ProfileNodes[i];        \n" 
+"      fprintf(file, \"N %zu %d %d %lld\\n\", i, at.parent, at.func, at.time);\n" 
+"    }                                           \n" 
+"    fclose(file);                               \n" 
+"  }                                             \n" 
+"} profileReport;                                \n" 
+"#endif                                          \n" 
+"                                                \n" 
+"#ifdef PFC_TASKS                                \n" 
+"struct DrawRecord { int site; bool visible; const char *name; double params[6]; int num; const char *color; std::vector<double> payload; };\n" 
+"thread_local std::vector<DrawRecord> *DrawBuffer;\n" 
+"#endif                                          \n" 
+"                                                \n" 
+"bool Visible(const double *params, int num, double pad) {\n" 
+"  if (CanvasWidth < 0) return true;             \n" 
+"  for (int i = 0; i < num; i++) if (params[i] != params[i]) return true;\n" 
+"  double x0 = params[0], x1 = params[0], y0 = params[1], y1 = params[1];\n" 
+"  for (int i = 2; i + 1 < num; i += 2) {        \n" 
+"    x0 = fmin(x0, params[i]), x1 = fmax(x1, params[i]);\n" 
+"    y0 = fmin(y0, params[i + 1]), y1 = fmax(y1, params[i + 1]);\n" 
+"  }                                             \n" 
+"  pad += 1;                                     \n" 
+"  return !(x1 < -pad || y1 < -pad || x0 > CanvasWidth + pad || y0 > CanvasHeight + pad);\n" 
+"}                                               \n" 
+"                                                \n" 
+"bool DrawBatched(const char *name) {            \n" 
+"  return !strcmp(name, \"circs\") || !strcmp(name, \"poly\");\n" 
+"}                                               \n" 
+"                                                \n" 
+"int DrawItems(const char *name, int num) {      \n" 
+"  if (!strcmp(name, \"circs\")) return num / 3;   \n" 
+"  if (!strcmp(name, \"poly\")) return num / 2 - 1;\n" 
+"  return 1;                                     \n" 
+"}                                               \n" 
+"                                                \n" 
+"void Draw(int site, bool visible, const char *name, const double *params, int num, const char *color) {\n" 
+"#ifdef PFC_TASKS                                \n" 
+"  if (DrawBuffer) {                             \n" 
+"    DrawBuffer->push_back(DrawRecord{ site, visible, name, {}, num, color });\n" 
+"    if (num > 6) DrawBuffer->back().payload.assign(params, params + num);\n" 
+"    else memcpy(DrawBuffer->back().params, params, num * sizeof(double));\n" 
+"    return;                                     \n" 
+"  }                                             \n" 
+"#endif                                          \n" 
+"  int items = DrawItems(name, num);             \n" 
+"#ifdef PFC_VERBOSE                              \n" 
+"  (visible ? DrawSites[site].first : DrawSites[site].second) += items;\n" 
+"#endif                                          \n" 
+"  if (!visible) {                               \n" 
+"    DrawCulled += items;                        \n" 
+"    return;                                     \n" 
+"  }                                             \n" 
+"  DrawCount += items;                           \n" 
+"#ifdef PFC_PROFILE                              \n" 
+"  ProfileLineData[site].draws += items;         \n" 
+"  if (ProfileFuncAt >= 0) ProfileDraws[ProfileFuncAt] += items;\n" 
+"#endif                                          \n" 
+"#ifdef PFC_STATS                                \n" 
+"  DrawTypes[(name[0] == 'c') + 2 * (name[0] == 't') + 3 * (name[0] == 'r')] += items;\n" 
+"#endif                                          \n" 
+"  if (drawSink) {                               \n" 
+"    drawSink(drawUser, name, params, num, color);\n" 
+"    return;                                     \n" 
+"  }                                             \n" 
+"  printf(\"%s\", name);                           \n" 
+"  if (DrawBatched(name)) printf(\" %d\", num);    \n" 
+"  for (int i = 0; i < num; i++) printf(\" %.2lf\", params[i]);\n" 
+"  printf(\" %s\\n\", color);                       \n" 
+"}                                               \n" 
+"                                                \n" 
+"void DrawLine(int site, double x1, double y1, double x2, double y2, double w, const char *color) {\n" 
+"  double params[] = { x1, y1, x2, y2, w };      \n" 
+"  Draw(site, Visible(params, 4, fabs(w) / 2), \"line\", params, 5, color);\n" 
+"}                                               \n" 
+"                                                \n" 
+"void DrawCirc(int site, double x, double y, double r, const char *color) {\n" 
+"  double params[] = { x, y, r };                \n" 
+"  Draw(site, Visible(params, 2, fabs(r)), \"circ\", params, 3, color);\n" 
+"}                                               \n" 
+"                                                \n" 
+"void DrawTria(int site, double x1, double y1, double x2, double y2, double x3, double y3, const char *color) {\n" 
+"  double params[] = { x1, y1, x2, y2, x3, y3 }; \n" 
+"  Draw(site, Visible(params, 6, 0), \"tria\", params, 6, color);\n" 
+"}                                               \n" 
+"                                                \n" 
+"void DrawRect(int site, double x1, double y1, double x2, double y2, const char *color) {\n" 
+"  double params[] = { x1, y1, x2, y2 };         \n" 
+"  Draw(site, Visible(params, 4, 0), \"rect\", params, 4, color);\n" 
+"}                                               \n" 
+"                                                \n" 
+"template <typename X, typename Y, typename R>   \n" 
+"void DrawCircles(int site, int count, Array<X> xs, Array<Y> ys, Array<R> rs, const char *color) {\n" 
+"  count = std::min(count, std::min(xs.size, std::min(ys.size, rs.size)));\n" 
+"  std::vector<double> params;                   \n" 
+"  params.reserve(3 * std::max(count, 0));       \n" 
+"  for (int i = 0; i < count; i++) {             \n" 
+"    double circle[] = { (double) xs[i], (double) ys[i], (double) rs[i] };\n" 
+"    if (Visible(circle, 2, fabs(circle[2]))) params.insert(params.end(), circle, circle + 3);\n" 
+"    else Draw(site, false, \"circ\", circle, 3, color);\n" 
+"  }                                             \n" 
+"  if (!params.empty()) Draw(site, true, \"circs\", params.data(), params.size(), color);\n" 
+"}                                               \n" 
+"                                                \n" 
+"template <typename X, typename Y>               \n" 
+"void DrawPolyline(int site, int count, Array<X> xs, Array<Y> ys, double w, const char *color) {\n" 
+"  count = std::min(count, std::min(xs.size, ys.size));\n" 
+"  if (count < 2) return;                        \n" 
+"  std::vector<double> params(1 + 2 * count);    \n" 
+"  params[0] = w;                                \n" 
+"  for (int i = 0; i < count; i++) params[1 + 2 * i] = xs[i], params[2 + 2 * i] = ys[i];\n" 
+"  Draw(site, Visible(params.data() + 1, 2 * count, fabs(w) / 2), \"poly\", params.data(), params.size(), color);\n" 
+"}                                               \n" 
+"                                                \n" 
+"#ifdef PFC_TASKS                                \n" 
+"struct Task {                                   \n" 
+"  std::function<void()> body;                   \n" 
+"  std::vector<DrawRecord> buffer;               \n" 
+"  int depth;                                    \n" 
+"  std::atomic<bool> claimed{false}, done{false};\n" 
+"};                                              \n" 
+"                                                \n" 
+"struct TaskQueue {                              \n" 
+"  std::mutex lock;                              \n" 
+"  std::deque<std::shared_ptr<Task> > tasks;     \n" 
+"};                                              \n" 
+"                                                \n" 
+"thread_local int TaskWorker = -1, TaskDepth;    \n" 
+"                                                \n" 
+"struct TaskPool {                               \n" 
+"  std::vector<std::thread> workers;             \n" 
+"  std::unique_ptr<TaskQueue[]> queues;          \n" 
+"  std::atomic<int> pending{0};                  \n" 
+"  std::mutex lock;                              \n" 
+"  std::condition_variable wake;                 \n" 
+"  bool quit = false;                            \n" 
+"  int cutoff = 0;                               \n" 
+"  TaskPool() {                                  \n" 
+"    const char *threads = getenv(\"PFC_THREADS\"), *depth = getenv(\"PFC_TASK_DEPTH\");\n" 
+"    int count = threads ? atoi(threads) : std::thread::hardware_concurrency();\n" 
+"    if (count < 2) count = 0;                   \n" 
+"    queues.reset(new TaskQueue[count + 1]);     \n" 
+"    if (depth) cutoff = atoi(depth);            \n" 
+"    else while ((1 << cutoff) < count * 8) cutoff++;\n" 
+"    for (int i = 0; i < count; i++) workers.emplace_back([this, i]() {\n" 
+"      TaskWorker = i;                           \n" 
+"      for (;;) {                                \n" 
+"        std::shared_ptr<Task> task = take();    \n" 
+"        if (task) {                             \n" 
+"          run(*task);                           \n" 
+"          continue;                             \n" 
+"        }                                       \n" 
+"        std::unique_lock<std::mutex> guard(lock);\n" 
+"        wake.wait(guard, [&]() { return quit || pending > 0; });\n" 
+"        if (quit) return;                       \n" 
+"      }                                         \n" 
+"    });                                         \n" 
+"  }                                             \n" 
+"  ~TaskPool() {                                 \n" 
+"    {                                           \n" 
+"      std::lock_guard<std::mutex> guard(lock);  \n" 
+"      quit = true;                              \n" 
+"    }                                           \n" 
+"    wake.notify_all();                          \n" 
+"    for (auto &worker: workers) worker.join();  \n" 
+"  }                                             \n" 
+"  void push(const std::shared_ptr<Task> &task) {\n" 
+"    TaskQueue &queue = queues[TaskWorker < 0 ? workers.size() : TaskWorker];\n" 
+"    {                                           \n" 
+"      std::lock_guard<std::mutex> guard(queue.lock);\n" 
+"      queue.tasks.push_back(task);              \n" 
+"    }                                           \n" 
+"    {                                           \n" 
+"      std::lock_guard<std::mutex> guard(lock);  \n" 
+"      pending++;                                \n" 
+"    }                                           \n" 
+"    wake.notify_one();                          \n" 
+"  }                                             \n" 
+"  std::shared_ptr<Task> take() {                \n" 
+"    int count = workers.size() + 1, self = TaskWorker < 0 ? count - 1 : TaskWorker;\n" 
+"    for (int i = 0; i < count; i++) {           \n" 
+"      TaskQueue &queue = queues[(self + i) % count];\n" 
+"      std::shared_ptr<Task> task;               \n" 
+"      {                                         \n" 
+"        std::lock_guard<std::mutex> guard(queue.lock);\n" 
+"        if (queue.tasks.empty()) continue;      \n" 
+"        if (i == 0) task = queue.tasks.back(), queue.tasks.pop_back();\n" 
+"        else task = queue.tasks.front(), queue.tasks.pop_front();\n" 
+"      }                                         \n" 
+"      pending--;                                \n" 
+"      if (!task->claimed.exchange(true)) return task;\n" 
+"      i--;                                      \n" 
+"    }                                           \n" 
+"    return NULL;                                \n" 
+"  }                                             \n" 
+"  void run(Task &task) {                        \n" 
+"    std::vector<DrawRecord> *buffer = DrawBuffer;\n" 
+"    int depth = TaskDepth;                      \n" 
+"    DrawBuffer = &task.buffer, TaskDepth = task.depth;\n" 
+"    task.body();                                \n" 
+"    DrawBuffer = buffer, TaskDepth = depth;     \n" 
+"    task.done.store(true, std::memory_order_release);\n" 
+"  }                                             \n" 
+"};                                              \n" 
+"                                                \n" 
+"TaskPool &TaskWorkers() {                       \n" 
+"  static TaskPool pool;                         \n" 
+"  return pool;                                  \n" 
+"}                                               \n" 
+"                                                \n" 
+"struct TaskGroup {                              \n" 
+"  std::vector<std::shared_ptr<Task> > tasks;    \n" 
+"  bool spawn;                                   \n" 
+"  TaskGroup() {                                 \n" 
+"#ifdef PFC_PROFILE                              \n" 
+"    spawn = false;                              \n" 
+"#else                                           \n" 
+"    TaskPool &pool = TaskWorkers();             \n" 
+"    spawn = pool.workers.size() >= 2 && TaskDepth < pool.cutoff;\n" 
+"#endif                                          \n" 
+"  }                                             \n" 
+"  ~TaskGroup() { wait(); }                      \n" 
+"  template <typename F>                         \n" 
+"  void run(const F &body) {                     \n" 
+"    if (!spawn) {                               \n" 
+"      body();                                   \n" 
+"      return;                                   \n" 
+"    }                                           \n" 
+"    std::shared_ptr<Task> task = std::make_shared<Task>();\n" 
+"    task->body = body, task->depth = TaskDepth + 1;\n" 
+"    tasks.push_back(task);                      \n" 
+"    TaskWorkers().push(task);                   \n" 
+"  }                                             \n" 
+"  void wait() {                                 \n" 
+"    TaskPool &pool = TaskWorkers();             \n" 
+"    for (std::shared_ptr<Task> &task: tasks) {  \n" 
+"      if (!task->claimed.exchange(true)) {      \n" 
+"        int depth = TaskDepth;                  \n" 
+"        TaskDepth = task->depth;                \n" 
+"        task->body();                           \n" 
+"        TaskDepth = depth;                      \n" 
+"        continue;                               \n" 
+"      }                                         \n" 
+"      while (!task->done.load(std::memory_order_acquire)) {\n" 
+"        std::shared_ptr<Task> other = pool.take();\n" 
+"        if (other) pool.run(*other);            \n" 
+"        else std::this_thread::yield();         \n" 
+"      }                                         \n" 
+"      for (DrawRecord &record: task->buffer) {  \n" 
+"        const double *params = (record.num > 6) ? record.payload.data() : record.params;\n" 
+"        Draw(record.site, record.visible, record.name, params, record.num, record.color);\n" 
+"      }                                         \n" 
+"    }                                           \n" 
+"    tasks.clear();                              \n" 
+"  }                                             \n" 
+"};                                              \n" 
+"                                                \n" 
+"template <typename F>                           \n" 
+"void Pfor(size_t count, const F &body) {        \n" 
+"  TaskGroup group;                              \n" 
+"  if (!group.spawn || count < 2) {              \n" 
+"    for (size_t i = 0; i < count; i++) body(i); \n" 
+"    return;                                     \n" 
+"  }                                             \n" 
+"  size_t chunks = std::min(count, TaskWorkers().workers.size() * 8);\n" 
+"  for (size_t c = 0; c < chunks; c++) group.run([&body, c, count, chunks]() {\n" 
+"    for (size_t i = c * count / chunks; i < (c + 1) * count / chunks; i++) body(i);\n" 
+"  });                                           \n" 
+"  group.wait();                                 \n" 
+"}                                               \n" 
+"#endif                                          \n" 
+"                                                \n" 
+"#ifdef PFC_SHARED                               \n" 
+"int proxy_main();                               \n" 
+"extern \"C\" int proxy_entry(DrawSink sink, void *user) {\n" 
+"  drawSink = sink, drawUser = user;             \n" 
+"  proxy_main();                                 \n" 
+"  drawSink = NULL, drawUser = NULL;             \n" 
+"  return 0;                                     \n" 
+"}                                               \n" 
+"#define main proxy_main                         \n" 
+"#endif                                          \n" 
+"                                                \n" 
+"#ifdef PFC_TASKS                                \n" 
+"#define MemoLocal thread_local                  \n" 
+"std::atomic<long long> MemoHits, MemoMisses;    \n" 
+"#else                                           \n" 
+"#define MemoLocal                               \n" 
+"long long MemoHits, MemoMisses;                 \n" 
+"#endif                                          \n" 
+"#ifdef PFC_VERBOSE                              \n" 
+"struct RuntimeReport {                          \n" 
+"  ~RuntimeReport() {                            \n" 
+"    if (MemoHits || MemoMisses) fprintf(stderr, \"pfc: \\033[36m[Runtime]\\033[0m memo hits %lld, misses %lld\\n\", (long long) MemoHits, (long long) MemoMisses);\n" 
+"    if (CanvasWidth >= 0) fprintf(stderr, \"pfc: \\033[36m[Runtime]\\033[0m culled %lld of %lld primitives\\n\", DrawCulled, DrawCount + DrawCulled);\n" 
+"    for (auto &site: DrawSites) {               \n" 
+"      if (site.second.first == 0) fprintf(stderr, \"pfc: \\033[36m[Runtime]\\033[0m draw at line %d produced only off-canvas primitives (%lld culled)\\n\", site.first, site.second.second);\n" 
+"    }                                           \n" 
+"  }                                             \n" 
+"} runtimeReport;                                \n" 
+"#endif                                          \n" 
+"                                                \n" 
+"#if defined(PFC_STATS) && !defined(PFC_SHARED)  \n" 
+"#include <ctime>                                \n" 
+"#include <unistd.h>                             \n" 
+"#include <sys/syscall.h>                        \n" 
+"#include <sys/resource.h>                       \n" 
+"struct StatsReport {                            \n" 
+"  timespec begin, start;                        \n" 
+"  StatsReport() {                               \n" 
+"    clock_gettime(CLOCK_MONOTONIC, &begin);     \n" 
+"    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);\n" 
+"  }                                             \n" 
+"  ~StatsReport() {                              \n" 
+"    fflush(stdout);                             \n" 
+"    timespec end, cpu;                          \n" 
+"    clock_gettime(CLOCK_MONOTONIC, &end);       \n" 
+"    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);\n" 
+"    rusage usage;                               \n" 
+"    getrusage(RUSAGE_SELF, &usage);             \n" 
+"    double from = begin.tv_sec + begin.tv_nsec / 1e9;\n" 
+"    double wall = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;\n" 
+"    const char *path = getenv(\"PFC_STATS\");     \n" 
+"    FILE *file = path ? fopen(path, \"a\") : NULL;\n" 
+"    if (file) {                                 \n" 
+"      fprintf(file, \"proxy\\texecute\\t%.6f\\t%.6f\\t%.6f\\t%ld\\tline=%lld circ=%lld tria=%lld rect=%lld culled=%lld memo_hits=%lld memo_misses=%lld\\n\",\n" 
+"        from, wall, (cpu.tv_sec - start.tv_sec) + (cpu.tv_nsec - start.tv_nsec) / 1e9, usage.ru_maxrss,\n" 
+"        DrawTypes[0], DrawTypes[1], DrawTypes[2], DrawTypes[3], DrawCulled, (long long) MemoHits, (long long) MemoMisses);\n" 
+"      fclose(file);                             \n" 
+"    }                                           \n" 
+"    path = getenv(\"PFC_TRACE\");                 \n" 
+"    file = path ? fopen(path, \"a\") : NULL;      \n" 
+"    if (file) {                                 \n" 
+"      int pid = getpid(), tid = syscall(SYS_gettid);\n" 
+"      fprintf(file, \"{\\\"name\\\": \\\"process_name\\\", \\\"ph\\\": \\\"M\\\", \\\"pid\\\": %d, \\\"args\\\": {\\\"name\\\": \\\"proxy\\\"}}\\n\", pid);\n" 
+"      fprintf(file, \"{\\\"name\\\": \\\"execute\\\", \\\"cat\\\": \\\"phase\\\", \\\"ph\\\": \\\"X\\\", \\\"ts\\\": %.3f, \\\"dur\\\": %.3f, \\\"pid\\\": %d, \\\"tid\\\": %d, \\\"args\\\": {\\\"commands\\\": %lld, \\\"culled\\\": %lld}}\\n\",\n" 
+"        from * 1e6, wall * 1e6, pid, tid, DrawCount, DrawCulled);\n" 
+"      fclose(file);                             \n" 
+"    }                                           \n" 
+"  }                                             \n" 
+"} statsReport;                                  \n" 
+"#endif                                          \n" 
+"                                                \n" 
+"template <typename R, int N, int SIZE>          \n" 
+"struct Memo {                                   \n" 
+"  struct Entry { bool used; double key[N]; R value; };\n" 
+"  Entry *table;                                 \n" 
+"  Entry *slot(const double *key) {              \n" 
+"    if (!table) table = new Entry[SIZE]();      \n" 
+"    unsigned long long hash = 14695981039346656037ULL, bits;\n" 
+"    for (int i = 0; i < N; i++) {               \n" 
+"      memcpy(&bits, key + i, sizeof(bits));     \n" 
+"      bits = (bits ^ (bits >> 33)) * 0xff51afd7ed558ccdULL;\n" 
+"      hash = (hash ^ bits) * 1099511628211ULL;  \n" 
+"    }                                           \n" 
+"    return table + (hash ^ (hash >> 32)) % SIZE;\n" 
+"  }                                             \n" 
+"  bool find(const double *key, R &value) {      \n" 
+"    Entry *entry = slot(key);                   \n" 
+"    if (entry->used && !memcmp(entry->key, key, sizeof(entry->key))) {\n" 
+"      value = entry->value, MemoHits++;         \n" 
+"      return true;                              \n" 
+"    }                                           \n" 
+"    MemoMisses++;                               \n" 
+"    return false;                               \n" 
+"  }                                             \n" 
+"  void put(const double *key, R value) {        \n" 
+"    Entry *entry = slot(key);                   \n" 
+"    entry->used = true, entry->value = value;   \n" 
+"    memcpy(entry->key, key, sizeof(entry->key));\n" 
+"  }                                             \n" 
+"};                                              \n" 
 "                                                \n" 
 "float Power(double n, double k) {               \n" 
 "  bool neg = false;                             \n" 
@@ -810,10 +2181,23 @@ recognize(
   int index = 0;
   while (lexiinfo[index].lexiID) {
     if (lexiinfo[index].lexiID == keywords.id("def")) {
+      double start = trace_clock();
       content += reco_function(index) + "\n\n";
+      trace_span("def " + funcinfo.vec.back(), "parse", start);
     } else error_item("[Syntax Error]", "Incomplete syntax structure. Here should be keyword \"def\".", lexiinfo[index]);
   }
+  if (optiinfo.inlining) optiinfo.log(to_string(optiinfo.inlined) + " calls inlined.");
+  if (optiinfo.profile) {
+    int lines = 1;
+    for (LexiItem& item: lexiinfo) lines = max(lines, item.line + 1);
+    string functions = to_string(max((size_t) 1, funcinfo.vec.size()));
+    content +=
+      "extern const int ProfileLines = " + to_string(lines) + ", ProfileFunctions = " + to_string(funcinfo.vec.size()) + ";\n" +
+      "ProfileLineStat ProfileLineData[" + to_string(lines) + "];\n" +
+      "long long ProfileCalls[" + functions + "], ProfileSelf[" + functions + "], ProfileDraws[" + functions + "];\n\n";
+  }
   content += "// Proxy code ends.\n";
+  if (pforCount || taskCount) content.insert(0, "#define PFC_TASKS\n");
   if (cprxcode) generate_proxy(content, ouName);
   return content;
 }
\ No newline at end of file